@@ -0,0 +1,277 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "census.h"
+
+// Longer extensions are counted as none: they are more likely to be parts of
+// names than types of file.
+#define EXTENSION_LIMIT 16
+
+// Groups of sizes and ages: 0, and then [2^(i - 1), 2^i) for each i up to 64.
+#define GROUP_COUNT 65
+
+typedef struct Count {
+  uint64_t files;
+  uint64_t bytes;
+} Count;
+
+typedef struct Extension {
+  // Empty in an empty slot.
+  char name[EXTENSION_LIMIT + 1];
+  Count count;
+} Extension;
+
+typedef enum CensusType {
+  CensusFile,
+  CensusDirectory,
+  CensusSymlink,
+  CensusOther,
+  CensusTypeCount,
+} CensusType;
+
+static const char* type_names[CensusTypeCount] = {"file", "directory",
+                                                  "symlink", "other"};
+
+struct Census {
+  time_t now;
+  Count types[CensusTypeCount];
+  // Regular files without an extension.
+  Count none;
+  Count sizes[GROUP_COUNT];
+  Count ages[GROUP_COUNT];
+  // An open-addressed hash table of `capacity` slots (a power of 2), no more
+  // than half full.
+  size_t count;
+  size_t capacity;
+  Extension* extensions;
+};
+
+Census* NewCensus(time_t now) {
+  Census* c = calloc(1, sizeof(Census));
+  if (!c) {
+    Die(errno, "calloc");
+  }
+  c->now = now;
+  c->capacity = 256;
+  c->extensions = calloc(c->capacity, sizeof(Extension));
+  if (!c->extensions) {
+    Die(errno, "calloc");
+  }
+  return c;
+}
+
+Census* NewCensusLike(const Census* c) {
+  return NewCensus(c->now);
+}
+
+static void AddCount(Count* c, uint64_t files, uint64_t bytes) {
+  c->files += files;
+  c->bytes += bytes;
+}
+
+static size_t GetGroup(uint64_t n) {
+  return n ? (size_t)(64 - __builtin_clzll(n)) : 0;
+}
+
+static uint64_t HashName(const char* name) {
+  uint64_t hash = UINT64_C(14695981039346656037);
+  for (; *name; name++) {
+    hash = (hash ^ (unsigned char)*name) * UINT64_C(1099511628211);
+  }
+  return hash;
+}
+
+// Returns the slot of `c` for the extension `name`, which is either its slot or
+// the empty one where it belongs.
+static Extension* FindExtension(Extension* extensions,
+                                size_t capacity,
+                                const char* name) {
+  size_t i = (size_t)HashName(name) & (capacity - 1);
+  while (extensions[i].name[0] && strcmp(extensions[i].name, name)) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return &extensions[i];
+}
+
+// Adds `files` and `bytes` to the extension `name`.
+static void CountExtension(Census* c,
+                           const char* name,
+                           uint64_t files,
+                           uint64_t bytes) {
+  Extension* e = FindExtension(c->extensions, c->capacity, name);
+  if (!e->name[0]) {
+    if (2 * (c->count + 1) > c->capacity) {
+      const size_t capacity = 2 * c->capacity;
+      Extension* extensions = calloc(capacity, sizeof(Extension));
+      if (!extensions) {
+        Die(errno, "calloc");
+      }
+      for (size_t i = 0; i < c->capacity; i++) {
+        if (c->extensions[i].name[0]) {
+          *FindExtension(extensions, capacity, c->extensions[i].name) =
+              c->extensions[i];
+        }
+      }
+      free(c->extensions);
+      c->extensions = extensions;
+      c->capacity = capacity;
+      e = FindExtension(c->extensions, c->capacity, name);
+    }
+    memcpy(e->name, name, strlen(name) + 1);
+    c->count++;
+  }
+  AddCount(&e->count, files, bytes);
+}
+
+void AddToCensus(Census* c,
+                 const char* name,
+                 size_t length,
+                 const struct stat* status) {
+  const uint64_t bytes = status->st_size > 0 ? (uint64_t)status->st_size : 0;
+  CensusType type = CensusOther;
+  if (S_ISREG(status->st_mode)) {
+    type = CensusFile;
+  } else if (S_ISDIR(status->st_mode)) {
+    type = CensusDirectory;
+  } else if (S_ISLNK(status->st_mode)) {
+    type = CensusSymlink;
+  }
+  AddCount(&c->types[type], 1, bytes);
+  if (type != CensusFile) {
+    return;
+  }
+
+  AddCount(&c->sizes[GetGroup(bytes)], 1, bytes);
+  const time_t age = c->now - status->st_mtime;
+  AddCount(&c->ages[GetGroup(age > 0 ? (uint64_t)age / 86400 : 0)], 1, bytes);
+
+  // The extension follows the last '.', unless that begins the name (as in
+  // .profile).
+  size_t dot = length;
+  while (dot > 0 && name[dot - 1] != '.' && length - dot <= EXTENSION_LIMIT) {
+    dot--;
+  }
+  const size_t extension_length = length - dot;
+  if (dot <= 1 || extension_length == 0 ||
+      extension_length > EXTENSION_LIMIT) {
+    AddCount(&c->none, 1, bytes);
+    return;
+  }
+  char extension[EXTENSION_LIMIT + 1];
+  for (size_t i = 0; i < extension_length; i++) {
+    extension[i] = (char)tolower((unsigned char)name[dot + i]);
+  }
+  extension[extension_length] = '\0';
+  CountExtension(c, extension, 1, bytes);
+}
+
+void MergeCensus(Census* into, const Census* from) {
+  for (size_t i = 0; i < CensusTypeCount; i++) {
+    AddCount(&into->types[i], from->types[i].files, from->types[i].bytes);
+  }
+  AddCount(&into->none, from->none.files, from->none.bytes);
+  for (size_t i = 0; i < GROUP_COUNT; i++) {
+    AddCount(&into->sizes[i], from->sizes[i].files, from->sizes[i].bytes);
+    AddCount(&into->ages[i], from->ages[i].files, from->ages[i].bytes);
+  }
+  for (size_t i = 0; i < from->capacity; i++) {
+    const Extension* e = &from->extensions[i];
+    if (e->name[0]) {
+      CountExtension(into, e->name, e->count.files, e->count.bytes);
+    }
+  }
+}
+
+static void PrintCount(Output* o,
+                       const char* category,
+                       const char* label,
+                       const Count* c,
+                       char ors) {
+  AppendString(o, category);
+  AppendChar(o, '\t');
+  AppendString(o, label);
+  AppendChar(o, '\t');
+  AppendInteger(o, (int64_t)c->files, 0, ' ');
+  AppendChar(o, '\t');
+  AppendInteger(o, (int64_t)c->bytes, 0, ' ');
+  AppendChar(o, ors);
+}
+
+static void PrintGroups(Output* o,
+                        const char* category,
+                        const Count* groups,
+                        char ors) {
+  for (size_t i = 0; i < GROUP_COUNT; i++) {
+    if (groups[i].files) {
+      char label[24];
+      MustFormat(label, sizeof(label), "%llu", i ? 1ULL << (i - 1) : 0ULL);
+      PrintCount(o, category, label, &groups[i], ors);
+    }
+  }
+}
+
+// Orders extensions by bytes, most first, and then by name.
+static int CompareExtensions(const void* a, const void* b) {
+  const Extension* x = *(Extension* const*)a;
+  const Extension* y = *(Extension* const*)b;
+  if (x->count.bytes != y->count.bytes) {
+    return x->count.bytes > y->count.bytes ? -1 : 1;
+  }
+  return strcmp(x->name, y->name);
+}
+
+void PrintCensus(const Census* c, size_t extensions, char ors, Output* o) {
+  for (size_t i = 0; i < CensusTypeCount; i++) {
+    if (c->types[i].files) {
+      PrintCount(o, "type", type_names[i], &c->types[i], ors);
+    }
+  }
+
+  const Extension** sorted = calloc(c->count ? c->count : 1, sizeof(void*));
+  if (!sorted) {
+    Die(errno, "calloc");
+  }
+  size_t count = 0;
+  for (size_t i = 0; i < c->capacity; i++) {
+    if (c->extensions[i].name[0]) {
+      sorted[count] = &c->extensions[i];
+      count++;
+    }
+  }
+  qsort(sorted, count, sizeof(void*), CompareExtensions);
+  Count rest = {0};
+  for (size_t i = 0; i < count; i++) {
+    if (i < extensions) {
+      PrintCount(o, "extension", sorted[i]->name, &sorted[i]->count, ors);
+    } else {
+      AddCount(&rest, sorted[i]->count.files, sorted[i]->count.bytes);
+    }
+  }
+  free(sorted);
+  if (c->none.files) {
+    PrintCount(o, "extension", "(none)", &c->none, ors);
+  }
+  if (rest.files) {
+    PrintCount(o, "extension", "(rest)", &rest, ors);
+  }
+
+  PrintGroups(o, "size", c->sizes, ors);
+  PrintGroups(o, "age", c->ages, ors);
+}
+
+void FreeCensus(Census** c) {
+  Census* x = *c;
+  if (!x) {
+    return;
+  }
+  free(x->extensions);
+  free(x);
+  *c = NULL;
+}
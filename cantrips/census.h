@@ -0,0 +1,54 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#ifndef CENSUS_H
+#define CENSUS_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "utils.h"
+
+// Counts of the files a walk matched, and the bytes they hold (their sizes,
+// not the disk space they use): by type, and for regular files, by extension,
+// by size, and by age. Sizes and ages are grouped by powers of 2, so that a
+// census of any tree takes a few KiB, plus a little per extension.
+//
+// A `Census` is used by 1 thread at a time. A walk with several threads gives
+// each its own, and merges them when done.
+typedef struct Census Census;
+
+// Returns a new, empty `Census`, which measures ages from `now`.
+Census* NewCensus(time_t now);
+
+// Returns a new, empty `Census` that measures ages from the same time as `c`,
+// e.g. for another thread.
+Census* NewCensusLike(const Census* c);
+
+// Counts the file whose name is `name`, of `length` bytes, and whose status is
+// `status`.
+void AddToCensus(Census* c,
+                 const char* name,
+                 size_t length,
+                 const struct stat* status);
+
+// Adds the counts of `from` to `into`.
+void MergeCensus(Census* into, const Census* from);
+
+// Prints `c` to `o`, as records (each followed by `ors`) of 4 tab-separated
+// fields: a category, a label, a number of files, and their bytes. The
+// categories are:
+//
+// * type: file, directory, symlink, or other.
+// * extension: lowercased, or (none). Only the `extensions` with the most bytes
+//   are listed, and then (rest) for the others.
+// * size: the least size in the group: 0, 1, 2, 4, 8, and so on.
+// * age: the least age in days since modification in the group: 0 (including
+//   the future), 1, 2, 4, 8, and so on.
+void PrintCensus(const Census* c, size_t extensions, char ors, Output* o);
+
+// Destroys `*c`. See `AUTO`.
+void FreeCensus(Census** c);
+
+#endif
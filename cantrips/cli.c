@@ -163,7 +163,7 @@ Arguments ParseCLI(CLI* cli, int count, char** arguments) {
           PrintRegexError(r.error, &r.value);
           exit(EXIT_FAILURE);
         }
-        v->r = r.value;  // Yep; copy.
+        v->r = r;  // Yep; copy.
         v->b = true;
         break;
       }
@@ -9,6 +9,8 @@
 #include <stdnoreturn.h>
 #include <time.h>
 
+#include "utils.h"
+
 // Describes the type of an `OptionValue` object.
 typedef enum OptionType {
   OptionTypeBool,
@@ -28,7 +30,7 @@ typedef struct OptionValue {
     time_t dt;
     double d;
     int64_t i;
-    regex_t r;
+    Regex r;
     size_t z;
     char* s;
   };
@@ -388,7 +388,7 @@ static FindResult FindFirstMatch(const char* input, Patterns patterns) {
   for (size_t i = 0; i < patterns.count; i++) {
     const Regex* r = &(patterns.patterns[i].regex);
     regmatch_t match;
-    const int e = regexec(&(r->value), input, 1, &match, 0);
+    const int e = FindRegex(r, input, &match);
     if (e) {
       if (e != REG_NOMATCH) {
         PrintRegexError(e, &(r->value));
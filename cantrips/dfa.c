@@ -0,0 +1,837 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfa.h"
+#include "utils.h"
+
+// Limits on the sizes of the NFA, and of the DFA built from it. Patterns that
+// need more are left to `regexec`.
+#define MAX_NODES 4096
+#define MAX_STATES 4096
+#define MAX_REPEAT 255
+
+typedef struct ByteSet {
+  uint64_t bits[4];
+} ByteSet;
+
+static void AddByte(ByteSet* s, unsigned b) {
+  s->bits[b >> 6] |= UINT64_C(1) << (b & 63);
+}
+
+static bool HasByte(const ByteSet* s, unsigned b) {
+  return (s->bits[b >> 6] >> (b & 63)) & 1;
+}
+
+// Adds the other case of each letter in `s`.
+static void FoldByteSet(ByteSet* s) {
+  for (unsigned c = 'a'; c <= 'z'; c++) {
+    const unsigned upper = c - 'a' + 'A';
+    if (HasByte(s, c) || HasByte(s, upper)) {
+      AddByte(s, c);
+      AddByte(s, upper);
+    }
+  }
+}
+
+// The syntax tree of a pattern.
+typedef enum TreeType {
+  TreeBytes,
+  TreeBol,
+  TreeEol,
+  TreeConcat,
+  TreeAlternate,
+  TreeRepeat,
+} TreeType;
+
+typedef struct Tree {
+  TreeType type;
+  // The operands of `TreeConcat` and `TreeAlternate`; `TreeRepeat` uses only
+  // `left`.
+  int left;
+  int right;
+  // The bounds of `TreeRepeat`. A negative `max` means unbounded.
+  int min;
+  int max;
+  // The bytes that `TreeBytes` matches.
+  ByteSet bytes;
+} Tree;
+
+// A recursive-descent parser for EREs. Each function returns the index of the
+// tree it parsed, or -1 if the pattern uses something `Dfa` does not support.
+// Since `regcomp` has already accepted the pattern, -1 does not mean an error.
+typedef struct Parser {
+  const char* p;
+  bool fold;
+  size_t count;
+  size_t capacity;
+  Tree* trees;
+} Parser;
+
+static int NewTree(Parser* x, Tree t) {
+  if (x->count == MAX_NODES) {
+    return -1;
+  }
+  if (x->count == x->capacity) {
+    x->capacity = x->capacity ? x->capacity * 2 : 64;
+    Tree* trees = realloc(x->trees, x->capacity * sizeof(Tree));
+    if (!trees) {
+      Die(errno, "realloc");
+    }
+    x->trees = trees;
+  }
+  x->trees[x->count] = t;
+  x->count++;
+  return (int)(x->count - 1);
+}
+
+static int NewBytes(Parser* x, ByteSet s) {
+  if (x->fold) {
+    FoldByteSet(&s);
+  }
+  // Input strings end at NUL, so NUL is never matched.
+  s.bits[0] &= ~UINT64_C(1);
+  return NewTree(x, (Tree){.type = TreeBytes, .bytes = s});
+}
+
+typedef struct Class {
+  const char* name;
+  int (*test)(int);
+} Class;
+
+static const Class classes[] = {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+    {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+    {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+    {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+};
+
+static bool AddClass(ByteSet* s, const char* name, size_t length) {
+  for (size_t i = 0; i < COUNT(classes); i++) {
+    if (strlen(classes[i].name) == length &&
+        memcmp(classes[i].name, name, length) == 0) {
+      for (unsigned c = 1; c < 256; c++) {
+        if (classes[i].test((int)c)) {
+          AddByte(s, c);
+        }
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+// Parses the bracket expression after `[`.
+static int ParseBracket(Parser* x) {
+  const char* p = x->p;
+  const bool negate = *p == '^';
+  if (negate) {
+    p++;
+  }
+  ByteSet s = {0};
+  for (bool first = true; *p && (*p != ']' || first); first = false) {
+    if (p[0] == '[' && p[1] == ':') {
+      const char* end = strstr(&p[2], ":]");
+      if (!end || !AddClass(&s, &p[2], (size_t)(end - p - 2))) {
+        return -1;
+      }
+      p = &end[2];
+      continue;
+    } else if (p[0] == '[' && (p[1] == '.' || p[1] == '=')) {
+      return -1;
+    }
+    const unsigned lo = (unsigned char)*p;
+    unsigned hi = lo;
+    p++;
+    if (p[0] == '-' && p[1] && p[1] != ']') {
+      if (p[1] == '[') {
+        return -1;
+      }
+      hi = (unsigned char)p[1];
+      p += 2;
+    }
+    for (unsigned c = lo; c <= hi; c++) {
+      AddByte(&s, c);
+    }
+  }
+  if (*p != ']') {
+    return -1;
+  }
+  x->p = &p[1];
+
+  if (negate) {
+    if (x->fold) {
+      FoldByteSet(&s);
+    }
+    for (size_t i = 0; i < COUNT(s.bits); i++) {
+      s.bits[i] = ~s.bits[i];
+    }
+  }
+  return NewBytes(x, s);
+}
+
+static int ParseAlternation(Parser* x);
+
+static int ParseAtom(Parser* x) {
+  ByteSet s = {0};
+  unsigned c = (unsigned char)*x->p;
+  switch (c) {
+    case '(': {
+      x->p++;
+      const int t = ParseAlternation(x);
+      if (t < 0 || *x->p != ')') {
+        return -1;
+      }
+      x->p++;
+      return t;
+    }
+    case '[':
+      x->p++;
+      return ParseBracket(x);
+    case '.':
+      x->p++;
+      memset(&s, 0xFF, sizeof(s));
+      return NewBytes(x, s);
+    case '^':
+      x->p++;
+      return NewTree(x, (Tree){.type = TreeBol});
+    case '$':
+      x->p++;
+      return NewTree(x, (Tree){.type = TreeEol});
+    case '\\':
+      // `\` before a letter or digit is a back-reference or a GNU extension,
+      // and before `<`, `>`, `` ` ``, or `'`, it is a GNU anchor.
+      c = (unsigned char)x->p[1];
+      if (!c || isalnum((int)c) || c == '<' || c == '>' || c == '`' ||
+          c == '\'') {
+        return -1;
+      }
+      x->p += 2;
+      AddByte(&s, c);
+      return NewBytes(x, s);
+    case '\0':
+    case ')':
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+    case '|':
+      return -1;
+    default:
+      x->p++;
+      AddByte(&s, c);
+      return NewBytes(x, s);
+  }
+}
+
+static int ParseNumber(const char** p) {
+  int n = 0;
+  for (; isdigit((unsigned char)**p); (*p)++) {
+    if (n <= MAX_REPEAT) {
+      n = n * 10 + (**p - '0');
+    }
+  }
+  return n;
+}
+
+// Parses the interval expression at `{`.
+static bool ParseInterval(Parser* x, int* min, int* max) {
+  const char* p = &x->p[1];
+  if (!isdigit((unsigned char)*p)) {
+    return false;
+  }
+  *min = ParseNumber(&p);
+  *max = *min;
+  if (*p == ',') {
+    p++;
+    *max = isdigit((unsigned char)*p) ? ParseNumber(&p) : -1;
+  }
+  if (*p != '}' || *min > MAX_REPEAT || *max > MAX_REPEAT ||
+      (*max >= 0 && *max < *min)) {
+    return false;
+  }
+  x->p = &p[1];
+  return true;
+}
+
+static int ParseRepeat(Parser* x) {
+  int t = ParseAtom(x);
+  while (t >= 0) {
+    int min = 0;
+    int max = -1;
+    switch (*x->p) {
+      case '*':
+        x->p++;
+        break;
+      case '+':
+        min = 1;
+        x->p++;
+        break;
+      case '?':
+        max = 1;
+        x->p++;
+        break;
+      case '{':
+        if (!ParseInterval(x, &min, &max)) {
+          return -1;
+        }
+        break;
+      default:
+        return t;
+    }
+    if (x->trees[t].type == TreeBol || x->trees[t].type == TreeEol) {
+      return -1;
+    }
+    t = NewTree(
+        x, (Tree){.type = TreeRepeat, .left = t, .min = min, .max = max});
+  }
+  return t;
+}
+
+static int ParseConcatenation(Parser* x) {
+  int t = -1;
+  while (*x->p && *x->p != '|' && *x->p != ')') {
+    const int r = ParseRepeat(x);
+    if (r < 0) {
+      return -1;
+    }
+    t = t < 0 ? r
+              : NewTree(x, (Tree){.type = TreeConcat, .left = t, .right = r});
+    if (t < 0) {
+      return -1;
+    }
+  }
+  return t;
+}
+
+static int ParseAlternation(Parser* x) {
+  int t = ParseConcatenation(x);
+  while (t >= 0 && *x->p == '|') {
+    x->p++;
+    const int r = ParseConcatenation(x);
+    if (r < 0) {
+      return -1;
+    }
+    t = NewTree(x, (Tree){.type = TreeAlternate, .left = t, .right = r});
+  }
+  return t;
+}
+
+// The NFA. `NodeSplit` and `NodeBol` move to their successors without
+// consuming input (the latter only at the start of the input); `NodeEol` moves
+// on only at the end of the input.
+typedef enum NodeType {
+  NodeBytes,
+  NodeSplit,
+  NodeBol,
+  NodeEol,
+  NodeMatch,
+} NodeType;
+
+typedef struct Node {
+  NodeType type;
+  int out;
+  int out2;
+  ByteSet bytes;
+} Node;
+
+typedef enum StateFlag {
+  // The state belongs to an unanchored search, which may start a new match at
+  // any position.
+  StateUnanchored = 1 << 0,
+  // The state is at the start of the input.
+  StateBol = 1 << 1,
+} StateFlag;
+
+// A DFA state: the set of NFA nodes that the input so far could have reached.
+typedef struct State {
+  unsigned flags;
+  // A match ends here.
+  bool match;
+  // A match ends here, if this is the end of the input.
+  bool match_at_end;
+  size_t count;
+  int* nodes;
+} State;
+
+// Matching follows links, which name a state by the offset of its row in
+// `Dfa.next`, with these flags in the low bits. 0 is not a link; state 0 is
+// never used.
+typedef enum LinkFlag {
+  LinkMatch = 1 << 0,
+  // No match can end here or later.
+  LinkDead = 1 << 1,
+  LinkFlags = LinkMatch | LinkDead,
+} LinkFlag;
+
+struct Dfa {
+  size_t node_count;
+  Node* nodes;
+  int start;
+  // Bytes in the same class have the same transitions in every state.
+  uint8_t classes[256];
+  uint8_t class_bytes[256];
+  size_t class_count;
+  // Rows of `next` are `1 << shift` links long, which is at least
+  // `class_count`, and at least 4, to leave room for the `LinkFlag`s.
+  unsigned shift;
+  // The link for each state and byte class, or 0 if not computed yet. It is
+  // allocated for `MAX_STATES` up front, so that it never moves, and only the
+  // rows of states that exist are ever touched. A byte of input costs a single
+  // load from it.
+  _Atomic uint32_t* next;
+  // The links to the states for unanchored searches from the start of the
+  // input, and anchored ones from the start and from other positions.
+  uint32_t starts[3];
+  State* states;
+
+  // Guards the members below, and the writing of `next` and `states`.
+  // Matching reads them without it.
+  pthread_mutex_t lock;
+  size_t state_count;
+  // An open-addressed hash table of state numbers, for finding states by their
+  // nodes. 0 marks an empty slot.
+  uint32_t table[2 * MAX_STATES];
+  // Scratch space for `Closure`.
+  unsigned generation;
+  unsigned* marks;
+  int* stack;
+  int* list;
+};
+
+static int AddNode(Dfa* d, Node n) {
+  if (d->node_count == MAX_NODES) {
+    return -1;
+  }
+  d->nodes[d->node_count] = n;
+  d->node_count++;
+  return (int)(d->node_count - 1);
+}
+
+// Compiles tree `t` into NFA nodes that continue to `next`, and returns the
+// first of them, or -1 if there are too many nodes.
+static int Emit(Dfa* d, const Tree* trees, int t, int next) {
+  const Tree* tree = &trees[t];
+  switch (tree->type) {
+    case TreeBytes:
+      return AddNode(d, (Node){.type = NodeBytes, .out = next,
+                               .bytes = tree->bytes});
+    case TreeBol:
+      return AddNode(d, (Node){.type = NodeBol, .out = next});
+    case TreeEol:
+      return AddNode(d, (Node){.type = NodeEol, .out = next});
+    case TreeConcat: {
+      const int right = Emit(d, trees, tree->right, next);
+      return right < 0 ? -1 : Emit(d, trees, tree->left, right);
+    }
+    case TreeAlternate: {
+      const int left = Emit(d, trees, tree->left, next);
+      const int right = Emit(d, trees, tree->right, next);
+      if (left < 0 || right < 0) {
+        return -1;
+      }
+      return AddNode(d, (Node){.type = NodeSplit, .out = left, .out2 = right});
+    }
+    case TreeRepeat: {
+      int start = next;
+      if (tree->max < 0) {
+        const int loop =
+            AddNode(d, (Node){.type = NodeSplit, .out = -1, .out2 = next});
+        const int body = loop < 0 ? -1 : Emit(d, trees, tree->left, loop);
+        if (body < 0) {
+          return -1;
+        }
+        d->nodes[loop].out = body;
+        start = loop;
+      }
+      for (int i = tree->min; i < tree->max; i++) {
+        const int body = Emit(d, trees, tree->left, start);
+        start = body < 0 ? -1
+                         : AddNode(d, (Node){.type = NodeSplit, .out = body,
+                                             .out2 = next});
+        if (start < 0) {
+          return -1;
+        }
+      }
+      for (int i = 0; i < tree->min; i++) {
+        start = Emit(d, trees, tree->left, start);
+        if (start < 0) {
+          return -1;
+        }
+      }
+      return start;
+    }
+  }
+  return -1;
+}
+
+static void ComputeClasses(Dfa* d) {
+  size_t count = 1;
+  for (size_t i = 0; i < d->node_count; i++) {
+    const Node* n = &d->nodes[i];
+    if (n->type != NodeBytes) {
+      continue;
+    }
+    // Split each class into the bytes that are in `n->bytes` and those that
+    // are not.
+    int16_t split[256][2];
+    memset(split, 0xFF, sizeof(split));
+    size_t refined = 0;
+    for (unsigned b = 0; b < 256; b++) {
+      int16_t* c = &split[d->classes[b]][HasByte(&n->bytes, b)];
+      if (*c < 0) {
+        *c = (int16_t)refined;
+        refined++;
+      }
+      d->classes[b] = (uint8_t)*c;
+    }
+    count = refined;
+  }
+  d->class_count = count;
+  for (unsigned b = 256; b-- > 0;) {
+    d->class_bytes[d->classes[b]] = (uint8_t)b;
+  }
+  d->shift = 2;
+  while ((size_t)1 << d->shift < count) {
+    d->shift++;
+  }
+}
+
+static void NextGeneration(Dfa* d) {
+  d->generation++;
+  if (!d->generation) {
+    memset(d->marks, 0, d->node_count * sizeof(unsigned));
+    d->generation = 1;
+  }
+}
+
+// Adds to `d->list` the `NodeBytes`, `NodeEol`, and `NodeMatch` nodes that can
+// be reached from node `n` without consuming input. Passes through `NodeBol`
+// nodes only if `bol`.
+static void Closure(Dfa* d, int n, bool bol, size_t* count) {
+  size_t top = 0;
+  d->stack[top++] = n;
+  while (top) {
+    n = d->stack[--top];
+    if (d->marks[n] == d->generation) {
+      continue;
+    }
+    d->marks[n] = d->generation;
+    const Node* node = &d->nodes[n];
+    switch (node->type) {
+      case NodeSplit:
+        d->stack[top++] = node->out2;
+        d->stack[top++] = node->out;
+        break;
+      case NodeBol:
+        if (bol) {
+          d->stack[top++] = node->out;
+        }
+        break;
+      default:
+        d->list[*count] = n;
+        (*count)++;
+    }
+  }
+}
+
+// Reports whether a match ends if the input ends with `nodes`.
+static bool MatchesAtEnd(Dfa* d, const int* nodes, size_t count, bool bol) {
+  NextGeneration(d);
+  size_t top = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (d->nodes[nodes[i]].type == NodeEol) {
+      d->stack[top++] = d->nodes[nodes[i]].out;
+    }
+  }
+  while (top) {
+    const int n = d->stack[--top];
+    if (d->marks[n] == d->generation) {
+      continue;
+    }
+    d->marks[n] = d->generation;
+    const Node* node = &d->nodes[n];
+    switch (node->type) {
+      case NodeMatch:
+        return true;
+      case NodeSplit:
+        d->stack[top++] = node->out2;
+        d->stack[top++] = node->out;
+        break;
+      case NodeBol:
+        if (!bol) {
+          break;
+        }
+        // Fall through.
+      case NodeEol:
+        d->stack[top++] = node->out;
+        break;
+      case NodeBytes:
+        break;
+    }
+  }
+  return false;
+}
+
+static int CompareInts(const void* a, const void* b) {
+  const int x = *(const int*)a;
+  const int y = *(const int*)b;
+  return (x > y) - (x < y);
+}
+
+static uint32_t GetLink(const Dfa* d, uint32_t id) {
+  const State* s = &d->states[id];
+  // An unanchored search adds the same nodes at every step, so if there are
+  // none, it too is finished.
+  return id << d->shift | (s->match ? LinkMatch : 0) |
+         (s->count ? 0 : LinkDead);
+}
+
+static const State* GetLinkState(const Dfa* d, uint32_t link) {
+  return &d->states[link >> d->shift];
+}
+
+// Returns the link to the state for the `count` nodes in `d->list` and
+// `flags`, adding the state if necessary. Returns 0 if the DFA is full.
+static uint32_t FindState(Dfa* d, size_t count, unsigned flags) {
+  int* nodes = d->list;
+  qsort(nodes, count, sizeof(int), CompareInts);
+  uint64_t hash = UINT64_C(14695981039346656037) ^ flags;
+  for (size_t i = 0; i < count; i++) {
+    hash = (hash ^ (uint64_t)nodes[i]) * UINT64_C(1099511628211);
+  }
+  size_t slot = (size_t)(hash % COUNT(d->table));
+  for (; d->table[slot]; slot = (slot + 1) % COUNT(d->table)) {
+    const State* s = &d->states[d->table[slot]];
+    if (s->flags == flags && s->count == count &&
+        memcmp(s->nodes, nodes, count * sizeof(int)) == 0) {
+      return GetLink(d, d->table[slot]);
+    }
+  }
+  if (d->state_count == MAX_STATES) {
+    return 0;
+  }
+
+  d->state_count++;
+  const uint32_t id = (uint32_t)d->state_count;
+  State* s = &d->states[id];
+  s->flags = flags;
+  s->count = count;
+  s->nodes = malloc((count ? count : 1) * sizeof(int));
+  if (!s->nodes) {
+    Die(errno, "malloc");
+  }
+  memcpy(s->nodes, nodes, count * sizeof(int));
+  for (size_t i = 0; i < count; i++) {
+    s->match |= d->nodes[nodes[i]].type == NodeMatch;
+  }
+  s->match_at_end =
+      s->match || MatchesAtEnd(d, s->nodes, count, flags & StateBol);
+  d->table[slot] = id;
+  return GetLink(d, id);
+}
+
+static uint32_t StartState(Dfa* d, unsigned flags) {
+  NextGeneration(d);
+  size_t count = 0;
+  Closure(d, d->start, flags & StateBol, &count);
+  return FindState(d, count, flags);
+}
+
+// Computes the link from the state at `link` on bytes of class `c`. Returns 0
+// if the DFA is full.
+static uint32_t Transition(Dfa* d, uint32_t link, size_t c) {
+  pthread_mutex_lock(&d->lock);
+  _Atomic uint32_t* slot = &d->next[(link & ~(uint32_t)LinkFlags) + c];
+  uint32_t next = atomic_load_explicit(slot, memory_order_relaxed);
+  if (!next) {
+    const State* s = GetLinkState(d, link);
+    const unsigned b = d->class_bytes[c];
+    NextGeneration(d);
+    size_t count = 0;
+    for (size_t i = 0; i < s->count; i++) {
+      const Node* n = &d->nodes[s->nodes[i]];
+      if (n->type == NodeBytes && HasByte(&n->bytes, b)) {
+        Closure(d, n->out, false, &count);
+      }
+    }
+    if (s->flags & StateUnanchored) {
+      Closure(d, d->start, false, &count);
+    }
+    next = FindState(d, count, s->flags & StateUnanchored);
+    if (next) {
+      atomic_store_explicit(slot, next, memory_order_release);
+    }
+  }
+  pthread_mutex_unlock(&d->lock);
+  return next;
+}
+
+static inline uint32_t Next(Dfa* d, uint32_t link, uint8_t b) {
+  const size_t c = d->classes[b];
+  const uint32_t next = atomic_load_explicit(
+      &d->next[(link & ~(uint32_t)LinkFlags) + c], memory_order_acquire);
+  return next ? next : Transition(d, link, c);
+}
+
+Dfa* NewDfa(const char* pattern, int flags) {
+  if ((flags & ~(REG_EXTENDED | REG_ICASE | REG_NOSUB)) ||
+      !(flags & REG_EXTENDED)) {
+    return NULL;
+  }
+  Parser x = {.p = pattern, .fold = flags & REG_ICASE};
+  const int root = ParseAlternation(&x);
+  if (root < 0 || *x.p) {
+    free(x.trees);
+    return NULL;
+  }
+
+  Dfa* d = calloc(1, sizeof(Dfa));
+  if (!d) {
+    Die(errno, "calloc");
+  }
+  d->nodes = malloc(MAX_NODES * sizeof(Node));
+  if (!d->nodes) {
+    Die(errno, "malloc");
+  }
+  const int match = AddNode(d, (Node){.type = NodeMatch});
+  d->start = Emit(d, x.trees, root, match);
+  free(x.trees);
+  if (d->start < 0) {
+    free(d->nodes);
+    free(d);
+    return NULL;
+  }
+
+  ComputeClasses(d);
+  // `calloc` of this much memory gets fresh pages from the kernel, which are
+  // not backed by anything until they are written.
+  d->next = calloc((size_t)(MAX_STATES + 1) << d->shift, sizeof(*d->next));
+  d->states = calloc(MAX_STATES + 1, sizeof(State));
+  d->marks = calloc(d->node_count, sizeof(unsigned));
+  d->stack = malloc((2 * d->node_count + 1) * sizeof(int));
+  d->list = malloc(d->node_count * sizeof(int));
+  if (!d->next || !d->states || !d->marks || !d->stack || !d->list) {
+    Die(errno, "malloc");
+  }
+  pthread_mutex_init(&d->lock, NULL);
+  d->starts[0] = StartState(d, StateUnanchored | StateBol);
+  d->starts[1] = StartState(d, StateBol);
+  d->starts[2] = StartState(d, 0);
+  return d;
+}
+
+DfaResult RunDfa(Dfa* d, const char* s) {
+  uint32_t link = d->starts[0];
+  for (const uint8_t* p = (const uint8_t*)s; !(link & LinkFlags); p++) {
+    if (!*p) {
+      return GetLinkState(d, link)->match_at_end ? DfaMatch : DfaNoMatch;
+    }
+    link = Next(d, link, *p);
+    if (!link) {
+      return DfaUnknown;
+    }
+  }
+  return link & LinkMatch ? DfaMatch : DfaNoMatch;
+}
+
+DfaResult RunDfaBytes(Dfa* d, const char* s, size_t length) {
+  return EndDfa(d, AdvanceDfa(d, StartDfa(d), s, length));
+}
+
+// A `DfaState` is a link. Once it has a `LinkFlag`, the rest of the input
+// cannot change the result, so it stays there.
+
+DfaState StartDfa(const Dfa* d) {
+  return d->starts[0];
+}
+
+DfaState AdvanceDfa(Dfa* d, DfaState state, const char* s, size_t length) {
+  const uint8_t* p = (const uint8_t*)s;
+  const uint8_t* end = p + length;
+  for (; state && !(state & LinkFlags) && p != end; p++) {
+    state = Next(d, state, *p);
+  }
+  return state;
+}
+
+DfaResult EndDfa(const Dfa* d, DfaState state) {
+  if (!state) {
+    return DfaUnknown;
+  } else if (state & LinkFlags) {
+    return state & LinkMatch ? DfaMatch : DfaNoMatch;
+  }
+  return GetLinkState(d, state)->match_at_end ? DfaMatch : DfaNoMatch;
+}
+
+DfaResult DecideDfa(DfaState state) {
+  if (state & LinkMatch) {
+    return DfaMatch;
+  } else if (state & LinkDead) {
+    return DfaNoMatch;
+  }
+  return DfaUnknown;
+}
+
+DfaResult FindDfa(Dfa* d, const char* s, size_t* start, size_t* end) {
+  const DfaResult r = RunDfa(d, s);
+  if (r != DfaMatch) {
+    return r;
+  }
+
+  // Try anchored matches from each position in turn; the first to match is
+  // the leftmost, and running it until it dies finds the longest.
+  const uint8_t* bytes = (const uint8_t*)s;
+  for (size_t i = 0;; i++) {
+    uint32_t link = d->starts[i ? 2 : 1];
+    size_t last = SIZE_MAX;
+    for (size_t j = i; !(link & LinkDead); j++) {
+      if (!bytes[j]) {
+        last = GetLinkState(d, link)->match_at_end ? j : last;
+        break;
+      } else if (link & LinkMatch) {
+        last = j;
+      }
+      link = Next(d, link, bytes[j]);
+      if (!link) {
+        return DfaUnknown;
+      }
+    }
+    if (last != SIZE_MAX) {
+      *start = i;
+      *end = last;
+      return DfaMatch;
+    }
+    if (!bytes[i]) {
+      return DfaNoMatch;
+    }
+  }
+}
+
+void FreeDfa(Dfa** d) {
+  Dfa* x = *d;
+  if (!x) {
+    return;
+  }
+  for (size_t i = 1; i <= x->state_count; i++) {
+    free(x->states[i].nodes);
+  }
+  pthread_mutex_destroy(&x->lock);
+  free(x->next);
+  free(x->states);
+  free(x->nodes);
+  free(x->marks);
+  free(x->stack);
+  free(x->list);
+  free(x);
+  *d = NULL;
+}
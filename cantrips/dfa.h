@@ -0,0 +1,67 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#ifndef DFA_H
+#define DFA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A deterministic finite automaton for a POSIX extended regular expression,
+// built lazily: each state and transition is computed the first time an input
+// needs it, and then cached. Matching is then a table lookup per input byte,
+// however complicated the expression.
+//
+// It supports the common subset of EREs: literals, `.`, bracket expressions
+// (with ranges and character classes), `^`, `$`, grouping, alternation, and
+// the repetition operators, in the C locale. A `Dfa` may be used by several
+// threads at once.
+typedef struct Dfa Dfa;
+
+typedef enum DfaResult {
+  DfaNoMatch,
+  DfaMatch,
+  // The DFA has grown as large as it is allowed to, and needs a state it does
+  // not have. The caller should use `regexec` instead.
+  DfaUnknown,
+} DfaResult;
+
+// Returns a new `Dfa` for `pattern`, which `regcomp` has accepted with `flags`.
+// Returns `NULL` if `flags` (other than `REG_EXTENDED`, `REG_ICASE`, and
+// `REG_NOSUB`) or `pattern` use features that `Dfa` does not support.
+Dfa* NewDfa(const char* pattern, int flags);
+
+// Reports whether `d` matches anywhere in the C string `s`.
+DfaResult RunDfa(Dfa* d, const char* s);
+
+// Like `RunDfa`, but for the `length` bytes at `s`, which may contain NUL.
+DfaResult RunDfaBytes(Dfa* d, const char* s, size_t length);
+
+// The state of a `Dfa` partway through its input, so that inputs with a
+// common prefix can share the work of matching it. 0 means the DFA grew too
+// large to say (see `DfaUnknown`), whatever the rest of the input.
+typedef uint32_t DfaState;
+
+// Returns the state of `d` at the start of its input.
+DfaState StartDfa(const Dfa* d);
+
+// Returns the state of `d` after the `length` bytes at `s`, continuing from
+// `state`.
+DfaState AdvanceDfa(Dfa* d, DfaState state, const char* s, size_t length);
+
+// Reports whether `d` matches an input that ends at `state`.
+DfaResult EndDfa(const Dfa* d, DfaState state);
+
+// Reports whether `d` matches every input that continues from `state`
+// (`DfaMatch`), none of them (`DfaNoMatch`), or whether that depends on the
+// rest of the input (`DfaUnknown`).
+DfaResult DecideDfa(DfaState state);
+
+// Finds the leftmost-longest match of `d` in the C string `s`, and sets
+// `*start` and `*end` to its bounds.
+DfaResult FindDfa(Dfa* d, const char* s, size_t* start, size_t* end);
+
+// Destroys `*d`. See `AUTO`.
+void FreeDfa(Dfa** d);
+
+#endif
@@ -0,0 +1,200 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cli.h"
+#include "utils.h"
+
+// clang-format off
+static char description[] =
+"check and benchmark the DFA regular expression engine against regexec\n"
+"\n"
+"    dfa_test [options...] [pattern...] < corpus\n"
+"\n"
+"Reads records from stdin (e.g. the output of `walk /`), and matches each pattern (default: a built-in set) against every record, both with the DFA and with `regexec`, case-sensitively and not. Exits with an error if their results ever differ. Then prints how long each took.";
+
+static Option options[] = {
+  {
+    .flag = '0',
+    .description = "delimit input records with NUL instead of newline",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'h',
+    .description = "print help message",
+    .value = { .type = OptionTypeBool }
+  },
+};
+
+static CLI cli = {
+  .name = "dfa_test",
+  .description = description,
+  .options = {.count = COUNT(options), .values = options},
+};
+// clang-format on
+
+static char* default_patterns[] = {
+    "(makefile|\\.mk|\\.c|\\.h|\\.cc|\\.cpp|\\.hpp|\\.S|\\.asm|\\.ld|\\.go|"
+    "\\.py|\\.rs|\\.toml)$",
+    "\\.(txt|tex|md|content|html?|rst)$",
+    "lib",
+    "^/usr/(lib|share)/[^/]+$",
+    "(^|/)\\.[^/]*$",
+    "[[:digit:]]{2,}",
+    "a.*b.*c",
+    "x+y?z*",
+    "[^a-z/]{3}",
+    "/[A-Z][a-z]+\\.",
+    "^$",
+    "e{2}|o{2}",
+    "(ab|a)(bc|c)?",
+    "[]x-]",
+    "\\.\\.?/",
+    "(a|b)*abb",
+    "\\(",
+    "(o)\\1",
+    "\\<bar",
+    "r\\>",
+    "\\`foo",
+    "bar\\'",
+};
+
+typedef struct Corpus {
+  size_t count;
+  size_t capacity;
+  char** records;
+} Corpus;
+
+static Corpus ReadCorpus(FILE* input, char fs) {
+  Corpus c = {0};
+  char* record = NULL;
+  size_t capacity = 0;
+  while (true) {
+    ssize_t length = getdelim(&record, &capacity, fs, input);
+    if (length < 0) {
+      break;
+    }
+    if (length && record[length - 1] == fs) {
+      record[length - 1] = '\0';
+    }
+    if (c.count == c.capacity) {
+      c.capacity = c.capacity ? c.capacity * 2 : 1024;
+      char** records = realloc(c.records, c.capacity * sizeof(char*));
+      if (!records) {
+        Die(errno, "realloc");
+      }
+      c.records = records;
+    }
+    c.records[c.count] = strdup(record);
+    if (!c.records[c.count]) {
+      Die(errno, "strdup");
+    }
+    c.count++;
+  }
+  free(record);
+  return c;
+}
+
+static void FreeCorpus(Corpus* c) {
+  for (size_t i = 0; i < c->count; i++) {
+    free(c->records[i]);
+  }
+  free(c->records);
+}
+
+// Checks that `r` agrees with `regexec`, and returns false if not.
+static bool Check(const Regex* r, const char* pattern, const Corpus* c) {
+  for (size_t i = 0; i < c->count; i++) {
+    const char* s = c->records[i];
+    regmatch_t expected;
+    const int e = regexec(&r->value, s, 1, &expected, 0);
+    if (MatchRegex(r, s) != (e == 0)) {
+      MustPrintf(stderr, "FAILED: /%s/ MatchRegex on \"%s\": expected %s\n",
+                 pattern, s, e ? "no match" : "match");
+      return false;
+    }
+    regmatch_t actual;
+    const int a = FindRegex(r, s, &actual);
+    if (a != e || (e == 0 && (actual.rm_so != expected.rm_so ||
+                              actual.rm_eo != expected.rm_eo))) {
+      MustPrintf(stderr,
+                 "FAILED: /%s/ FindRegex on \"%s\": expected %d [%lld, %lld), "
+                 "got %d [%lld, %lld)\n",
+                 pattern, s, e, (long long)expected.rm_so,
+                 (long long)expected.rm_eo, a, (long long)actual.rm_so,
+                 (long long)actual.rm_eo);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void Benchmark(const Regex* r,
+                      const char* pattern,
+                      bool fold,
+                      const Corpus* c) {
+  size_t matches = 0;
+  int64_t start = GetEpochNanoseconds();
+  for (size_t i = 0; i < c->count; i++) {
+    matches += regexec(&r->value, c->records[i], 0, NULL, 0) == 0;
+  }
+  const int64_t posix = GetEpochNanoseconds() - start;
+
+  start = GetEpochNanoseconds();
+  for (size_t i = 0; i < c->count; i++) {
+    matches -= MatchRegex(r, c->records[i]);
+  }
+  const int64_t dfa = GetEpochNanoseconds() - start;
+  if (matches) {
+    Die(0, "BUG: counts differ\n");
+  }
+
+  const int64_t n = c->count ? (int64_t)c->count : 1;
+  MustPrintf(stdout, "%8" PRId64 " %8" PRId64 " %7.1fx  %s%s%s\n", posix / n,
+             dfa / n, dfa ? (double)posix / (double)dfa : 0.0,
+             fold ? "-i " : "", r->dfa ? "" : "(no DFA) ", pattern);
+}
+
+int main(int count, char** arguments) {
+  Arguments as = ParseCLI(&cli, count, arguments);
+  if (FindOptionValue(cli.options, 'h')->b) {
+    PrintHelpAndExit(&cli, false, true);
+  }
+  if (!as.count) {
+    as.count = COUNT(default_patterns);
+    as.values = default_patterns;
+  }
+  AUTO(Corpus, corpus,
+       ReadCorpus(stdin, FindOptionValue(cli.options, '0')->b ? '\0' : '\n'),
+       FreeCorpus);
+
+  bool ok = true;
+  MustPrintf(stdout,
+             "%zu records\n"
+             "regexec      DFA  speedup  (ns per record)\n",
+             corpus.count);
+  const int flags[] = {REG_EXTENDED, REG_EXTENDED | REG_ICASE};
+  for (size_t i = 0; i < as.count; i++) {
+    for (size_t j = 0; j < COUNT(flags); j++) {
+      AUTO(Regex, r, CompileRegex(as.values[i], flags[j]), FreeRegex);
+      if (r.error) {
+        PrintRegexError(r.error, &r.value);
+        continue;
+      }
+      if (!Check(&r, as.values[i], &corpus)) {
+        ok = false;
+        continue;
+      }
+      Benchmark(&r, as.values[i], flags[j] & REG_ICASE, &corpus);
+    }
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,555 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "duplicates.h"
+
+// How much of each end of a file the second stage hashes.
+#define EDGE_SIZE 4096
+
+// How much of a file the third stage reads at once.
+#define READ_SIZE (1024 * 1024)
+
+typedef struct Hash {
+  uint64_t a;
+  uint64_t b;
+} Hash;
+
+typedef struct Candidate {
+  char* pathname;
+  uint64_t size;
+  dev_t device;
+  ino_t inode;
+  // Set if reading the file failed, or it changed size since the walk.
+  bool failed;
+  // Of the first and last `EDGE_SIZE` bytes; or, for files no larger than
+  // twice that, of the whole file, the same as `full`.
+  Hash edges;
+  Hash full;
+  // The index of the first of the candidates with the same `full` hash that
+  // has the same bytes.
+  size_t same;
+} Candidate;
+
+struct Duplicates {
+  bool gentle;
+  pthread_mutex_t lock;
+  size_t count;
+  size_t capacity;
+  Candidate* values;
+};
+
+Duplicates* NewDuplicates(bool gentle) {
+  Duplicates* d = calloc(1, sizeof(Duplicates));
+  if (!d) {
+    Die(errno, "calloc");
+  }
+  d->gentle = gentle;
+  pthread_mutex_init(&d->lock, NULL);
+  return d;
+}
+
+void AddCandidate(Duplicates* d,
+                  const char* pathname,
+                  const struct stat* status) {
+  if (status->st_size <= 0) {
+    return;
+  }
+  char* copy = strdup(pathname);
+  if (!copy) {
+    Die(errno, "strdup");
+  }
+  pthread_mutex_lock(&d->lock);
+  if (d->count == d->capacity) {
+    d->capacity = d->capacity ? d->capacity * 2 : 1024;
+    Candidate* values = realloc(d->values, d->capacity * sizeof(Candidate));
+    if (!values) {
+      Die(errno, "realloc");
+    }
+    d->values = values;
+  }
+  d->values[d->count] = (Candidate){.pathname = copy,
+                                    .size = (uint64_t)status->st_size,
+                                    .device = status->st_dev,
+                                    .inode = status->st_ino};
+  d->count++;
+  pthread_mutex_unlock(&d->lock);
+}
+
+static uint64_t Rotate(uint64_t x, int n) {
+  return (x << n) | (x >> (64 - n));
+}
+
+static uint64_t Mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= UINT64_C(0xff51afd7ed558ccd);
+  x ^= x >> 33;
+  x *= UINT64_C(0xc4ceb9fe1a85ec53);
+  x ^= x >> 33;
+  return x;
+}
+
+// Adds `count` bytes to `h`. All but the last call for a given hash must pass
+// a multiple of 8 bytes.
+static void HashBytes(Hash* h, const char* bytes, size_t count) {
+  // 2 lanes, each folding in 8 bytes at a time with a different multiplier.
+  size_t i = 0;
+  for (; count - i >= 8; i += 8) {
+    uint64_t word;
+    memcpy(&word, &bytes[i], sizeof(word));
+    h->a = Rotate((h->a ^ word) * UINT64_C(0x9e3779b97f4a7c15), 31);
+    h->b = Rotate((h->b + word) * UINT64_C(0xc2b2ae3d27d4eb4f), 29);
+  }
+  if (i < count) {
+    uint64_t word = 0;
+    memcpy(&word, &bytes[i], count - i);
+    h->a = Rotate((h->a ^ word) * UINT64_C(0x9e3779b97f4a7c15), 31);
+    h->b = Rotate((h->b + word) * UINT64_C(0xc2b2ae3d27d4eb4f), 29);
+  }
+}
+
+static Hash FinishHash(Hash h, uint64_t size) {
+  return (Hash){.a = Mix(h.a ^ size), .b = Mix(h.b + Rotate(h.a, 17))};
+}
+
+static int CompareHashes(const Hash* a, const Hash* b) {
+  if (a->a != b->a) {
+    return a->a < b->a ? -1 : 1;
+  }
+  if (a->b != b->b) {
+    return a->b < b->b ? -1 : 1;
+  }
+  return 0;
+}
+
+// Reads up to `count` bytes at `offset` of `fd`, stopping short only at the end
+// of the file. Returns the number read, or -1.
+static ssize_t ReadFully(int fd, char* buffer, size_t count, off_t offset) {
+  size_t total = 0;
+  while (total < count) {
+    const ssize_t n =
+        pread(fd, &buffer[total], count - total, offset + (off_t)total);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    total += (size_t)n;
+  }
+  return (ssize_t)total;
+}
+
+// Hashes the ends of `c`, the open file `fd`, into `c->edges`. Reports whether
+// it read all it expected to.
+static bool HashEdges(Candidate* c, int fd, char* buffer) {
+  Hash h = {0};
+  if (c->size <= 2 * EDGE_SIZE) {
+    const ssize_t n = ReadFully(fd, buffer, (size_t)c->size + 1, 0);
+    if (n != (ssize_t)c->size) {
+      return false;
+    }
+    HashBytes(&h, buffer, (size_t)n);
+    c->edges = FinishHash(h, c->size);
+    c->full = c->edges;
+    return true;
+  }
+  // Keep readahead from fetching much more than the ends.
+  (void)posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+  if (ReadFully(fd, buffer, EDGE_SIZE, 0) != EDGE_SIZE ||
+      ReadFully(fd, &buffer[EDGE_SIZE], EDGE_SIZE,
+                (off_t)(c->size - EDGE_SIZE)) != EDGE_SIZE) {
+    return false;
+  }
+  HashBytes(&h, buffer, 2 * EDGE_SIZE);
+  c->edges = FinishHash(h, c->size);
+  return true;
+}
+
+// Hashes all of `c`, the open file `fd`, into `c->full`. Reports whether it
+// read all it expected to.
+static bool HashFull(Candidate* c, int fd, char* buffer) {
+  (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  Hash h = {0};
+  uint64_t total = 0;
+  while (true) {
+    const ssize_t n = ReadFully(fd, buffer, READ_SIZE, (off_t)total);
+    if (n < 0) {
+      return false;
+    }
+    HashBytes(&h, buffer, (size_t)n);
+    total += (uint64_t)n;
+    if (n < READ_SIZE) {
+      break;
+    }
+  }
+  c->full = FinishHash(h, total);
+  return total == c->size;
+}
+
+// The work of hashing, or comparing, `count` `values`, shared among threads.
+typedef struct Hashing {
+  Candidate* values;
+  size_t count;
+  atomic_size_t next;
+  bool full;
+  bool gentle;
+} Hashing;
+
+// Opens `pathname` to read, and if `gentle`, without updating its access time
+// where permitted.
+static int OpenCandidate(const char* pathname, bool gentle) {
+#ifdef O_NOATIME
+  if (gentle) {
+    const int fd = open(pathname, O_RDONLY | O_CLOEXEC | O_NOATIME);
+    if (fd >= 0 || errno != EPERM) {
+      return fd;
+    }
+  }
+#endif
+  return open(pathname, O_RDONLY | O_CLOEXEC);
+}
+
+static void* RunHashing(void* context) {
+  Hashing* h = context;
+  AUTO(char*, buffer, malloc(h->full ? READ_SIZE : 2 * EDGE_SIZE + 1),
+       FreeChar);
+  if (!buffer) {
+    Die(errno, "malloc");
+  }
+  for (size_t i; (i = atomic_fetch_add(&h->next, 1)) < h->count;) {
+    Candidate* c = &h->values[i];
+    if (h->full && c->size <= 2 * EDGE_SIZE) {
+      continue;
+    }
+    const int fd = OpenCandidate(c->pathname, h->gentle);
+    if (fd < 0) {
+      Warn(errno, "%s", c->pathname);
+      c->failed = true;
+      continue;
+    }
+    errno = 0;
+    const bool ok =
+        h->full ? HashFull(c, fd, buffer) : HashEdges(c, fd, buffer);
+    if (!ok) {
+      if (errno) {
+        Warn(errno, "%s", c->pathname);
+      }
+      c->failed = true;
+    }
+    if (h->gentle) {
+      (void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(fd);
+  }
+  return NULL;
+}
+
+// Runs `start` on `h` with `thread_count` threads.
+static void RunThreads(Hashing* h, void* start(void*), size_t thread_count) {
+  if (thread_count > h->count) {
+    thread_count = h->count;
+  }
+  if (thread_count <= 1) {
+    start(h);
+    return;
+  }
+  pthread_t* threads = calloc(thread_count, sizeof(pthread_t));
+  if (!threads) {
+    Die(errno, "calloc");
+  }
+  for (size_t i = 0; i < thread_count; i++) {
+    const int e = pthread_create(&threads[i], NULL, start, h);
+    if (e) {
+      Die(e, "pthread_create");
+    }
+  }
+  for (size_t i = 0; i < thread_count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+}
+
+// Hashes each of the `count` `values`, as `HashFull` or `HashEdges` according
+// to `full`, with `thread_count` threads.
+static void HashCandidates(const Duplicates* d,
+                           Candidate* values,
+                           size_t count,
+                           bool full,
+                           size_t thread_count) {
+  Hashing h = {
+      .values = values, .count = count, .full = full, .gentle = d->gentle};
+  atomic_init(&h.next, 0);
+  RunThreads(&h, RunHashing, thread_count);
+}
+
+static int CompareInodes(const void* a, const void* b) {
+  const Candidate* x = a;
+  const Candidate* y = b;
+  if (x->size != y->size) {
+    return x->size < y->size ? -1 : 1;
+  }
+  if (x->device != y->device) {
+    return x->device < y->device ? -1 : 1;
+  }
+  if (x->inode != y->inode) {
+    return x->inode < y->inode ? -1 : 1;
+  }
+  return strcmp(x->pathname, y->pathname);
+}
+
+static int CompareEdges(const void* a, const void* b) {
+  const Candidate* x = a;
+  const Candidate* y = b;
+  if (x->size != y->size) {
+    return x->size < y->size ? -1 : 1;
+  }
+  return CompareHashes(&x->edges, &y->edges);
+}
+
+static int CompareContents(const void* a, const void* b) {
+  const Candidate* x = a;
+  const Candidate* y = b;
+  if (x->size != y->size) {
+    return x->size < y->size ? -1 : 1;
+  }
+  const int c = CompareHashes(&x->full, &y->full);
+  return c ? c : strcmp(x->pathname, y->pathname);
+}
+
+typedef bool Same(const Candidate* a, const Candidate* b);
+
+static bool SameSize(const Candidate* a, const Candidate* b) {
+  return a->size == b->size;
+}
+
+static bool SameInode(const Candidate* a, const Candidate* b) {
+  return SameSize(a, b) && a->device == b->device && a->inode == b->inode;
+}
+
+static bool SameEdges(const Candidate* a, const Candidate* b) {
+  return SameSize(a, b) && !CompareHashes(&a->edges, &b->edges);
+}
+
+static bool SameContents(const Candidate* a, const Candidate* b) {
+  return SameSize(a, b) && !CompareHashes(&a->full, &b->full);
+}
+
+// Returns the length of the run of `values`, from `i` on, that are the `same`
+// as `values[i]`.
+static size_t CountRun(const Candidate* values,
+                       size_t count,
+                       size_t i,
+                       Same* same) {
+  size_t j = i + 1;
+  while (j < count && same(&values[i], &values[j])) {
+    j++;
+  }
+  return j - i;
+}
+
+// Keeps only the `values` in runs, of those that are the `same`, with at least
+// 2 that have not `failed`. Frees the rest, and returns the new count.
+static size_t KeepRuns(Candidate* values, size_t count, Same* same) {
+  size_t kept = 0;
+  for (size_t i = 0; i < count;) {
+    const size_t n = CountRun(values, count, i, same);
+    size_t good = 0;
+    for (size_t j = i; j < i + n; j++) {
+      good += !values[j].failed;
+    }
+    for (size_t j = i; j < i + n; j++) {
+      if (good >= 2 && !values[j].failed) {
+        values[kept] = values[j];
+        kept++;
+      } else {
+        free(values[j].pathname);
+      }
+    }
+    i += n;
+  }
+  return kept;
+}
+
+// Frees all but the first of each run of `values` that are the same file.
+// Returns the new count.
+static size_t DropLinks(Candidate* values, size_t count) {
+  size_t kept = 0;
+  for (size_t i = 0; i < count;) {
+    const size_t n = CountRun(values, count, i, SameInode);
+    values[kept] = values[i];
+    kept++;
+    for (size_t j = i + 1; j < i + n; j++) {
+      free(values[j].pathname);
+    }
+    i += n;
+  }
+  return kept;
+}
+
+// Reports whether the files `a` and `b`, of `size` bytes, have the same
+// contents, reading them into `buffers` (2 of `READ_SIZE` bytes). If reading
+// either fails, warns, sets `*failed` to it, and returns false.
+static bool SameBytes(Candidate* a,
+                      Candidate* b,
+                      bool gentle,
+                      char* buffers,
+                      Candidate** failed) {
+  Candidate* files[2] = {a, b};
+  int fds[2] = {-1, -1};
+  *failed = NULL;
+  for (size_t i = 0; i < COUNT(fds) && !*failed; i++) {
+    fds[i] = OpenCandidate(files[i]->pathname, gentle);
+    if (fds[i] < 0) {
+      *failed = files[i];
+    } else {
+      (void)posix_fadvise(fds[i], 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+  }
+  bool same = !*failed;
+  uint64_t total = 0;
+  while (same) {
+    ssize_t n[2];
+    for (size_t i = 0; i < COUNT(fds) && !*failed; i++) {
+      n[i] = ReadFully(fds[i], &buffers[i * READ_SIZE], READ_SIZE,
+                       (off_t)total);
+      if (n[i] < 0) {
+        *failed = files[i];
+      }
+    }
+    same = !*failed && n[0] == n[1] &&
+           !memcmp(buffers, &buffers[READ_SIZE], (size_t)n[0]);
+    total += same ? (uint64_t)n[0] : 0;
+    if (!same || n[0] < READ_SIZE) {
+      break;
+    }
+  }
+  if (*failed) {
+    Warn(errno, "%s", (*failed)->pathname);
+  }
+  for (size_t i = 0; i < COUNT(fds); i++) {
+    if (fds[i] >= 0) {
+      if (gentle) {
+        (void)posix_fadvise(fds[i], 0, 0, POSIX_FADV_DONTNEED);
+      }
+      close(fds[i]);
+    }
+  }
+  return same && total == a->size;
+}
+
+// Sets `same` of each of `h->values`, which are sorted by `full` hash, by
+// comparing each with the first of each set of the same bytes before it in its
+// run of the same hash.
+static void* RunComparing(void* context) {
+  Hashing* h = context;
+  AUTO(char*, buffers, malloc(2 * READ_SIZE), FreeChar);
+  if (!buffers) {
+    Die(errno, "malloc");
+  }
+  Candidate* values = h->values;
+  for (size_t i; (i = atomic_fetch_add(&h->next, 1)) < h->count;) {
+    if (i > 0 && SameContents(&values[i - 1], &values[i])) {
+      continue;
+    }
+    const size_t n = CountRun(values, h->count, i, SameContents);
+    for (size_t j = i; j < i + n; j++) {
+      Candidate* c = &values[j];
+      c->same = j;
+      for (size_t k = i; k < j && !c->failed; k++) {
+        if (values[k].failed || values[k].same != k) {
+          continue;
+        }
+        Candidate* failed;
+        if (SameBytes(&values[k], c, h->gentle, buffers, &failed)) {
+          c->same = k;
+          break;
+        } else if (failed) {
+          failed->failed = true;
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+DuplicateCount PrintDuplicates(Duplicates* d,
+                               size_t thread_count,
+                               char ors,
+                               Output* o) {
+  Candidate* values = d->values;
+  size_t count = d->count;
+
+  qsort(values, count, sizeof(Candidate), CompareInodes);
+  count = DropLinks(values, count);
+  count = KeepRuns(values, count, SameSize);
+
+  HashCandidates(d, values, count, false, thread_count);
+  qsort(values, count, sizeof(Candidate), CompareEdges);
+  count = KeepRuns(values, count, SameEdges);
+
+  HashCandidates(d, values, count, true, thread_count);
+  qsort(values, count, sizeof(Candidate), CompareContents);
+  count = KeepRuns(values, count, SameContents);
+  d->count = count;
+
+  Hashing h = {.values = values, .count = count, .gentle = d->gentle};
+  atomic_init(&h.next, 0);
+  RunThreads(&h, RunComparing, thread_count);
+
+  // Within a run of the same hash, there is a group for each set of the same
+  // bytes (almost always, just 1).
+  DuplicateCount result = {0};
+  for (size_t i = 0; i < count;) {
+    const size_t n = CountRun(values, count, i, SameContents);
+    for (size_t first = i; first < i + n; first++) {
+      if (values[first].same != first) {
+        continue;
+      }
+      size_t members = 0;
+      for (size_t j = first; j < i + n; j++) {
+        members += !values[j].failed && values[j].same == first;
+      }
+      if (members < 2) {
+        continue;
+      }
+      for (size_t j = first; j < i + n; j++) {
+        if (!values[j].failed && values[j].same == first) {
+          AppendString(o, values[j].pathname);
+          AppendChar(o, ors);
+        }
+      }
+      AppendChar(o, ors);
+      result.groups++;
+      result.files += members - 1;
+      result.bytes += (members - 1) * values[i].size;
+    }
+    i += n;
+  }
+  return result;
+}
+
+void FreeDuplicates(Duplicates** d) {
+  if (!*d) {
+    return;
+  }
+  for (size_t i = 0; i < (*d)->count; i++) {
+    free((*d)->values[i].pathname);
+  }
+  free((*d)->values);
+  pthread_mutex_destroy(&(*d)->lock);
+  free(*d);
+  *d = NULL;
+}
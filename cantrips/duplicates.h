@@ -0,0 +1,61 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#ifndef DUPLICATES_H
+#define DUPLICATES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+
+// A collection of files to find duplicates among. A walk adds the files it
+// finds, and when it is done, `PrintDuplicates` narrows them down in stages,
+// reading no more of each file than it has to:
+//
+// 1. Files with a size no other file has are unique. So are empty files, for
+//    the purpose of reclaiming space, and the hard links to a file already
+//    added, which take no more space.
+// 2. Of the rest, files whose first and last 4 KiB hash differently from every
+//    other file's of the same size are unique.
+// 3. The rest are hashed in full.
+// 4. Files whose hashes match are compared byte for byte, since the hash is a
+//    fast 128-bit one, not a cryptographic one, and files crafted to collide
+//    could fool it.
+typedef struct Duplicates Duplicates;
+
+// Returns a new, empty `Duplicates`. If `gentle`, it reads files without
+// updating their access times where permitted, and drops them from the page
+// cache afterward.
+Duplicates* NewDuplicates(bool gentle);
+
+// Adds the regular file named `pathname`, whose status is `status`, to `d`.
+// Several threads may add at once.
+void AddCandidate(Duplicates* d,
+                  const char* pathname,
+                  const struct stat* status);
+
+typedef struct DuplicateCount {
+  // The number of groups of files with the same contents.
+  size_t groups;
+  // The number of files in those groups, beyond the first of each.
+  size_t files;
+  // The bytes those files take up.
+  uint64_t bytes;
+} DuplicateCount;
+
+// Finds the groups of files in `d` with the same contents, using
+// `thread_count` threads to read them, and prints each group to `o`: each
+// pathname followed by `ors`, and then an empty record. Groups are in order of
+// file size, largest last, and pathnames are sorted within them.
+DuplicateCount PrintDuplicates(Duplicates* d,
+                               size_t thread_count,
+                               char ors,
+                               Output* o);
+
+// Destroys `*d`. See `AUTO`.
+void FreeDuplicates(Duplicates** d);
+
+#endif
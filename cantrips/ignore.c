@@ -0,0 +1,346 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <regex.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ignore.h"
+#include "utils.h"
+
+const char* const ignore_file_names[2] = {".gitignore", ".ignore"};
+
+// A run of consecutive rules that all ignore, or all un-ignore, the pathnames
+// they match.
+typedef struct Segment {
+  bool negate;
+  bool has_any;
+  Regex any;
+  // The rules that end in `/`, which match only directories.
+  bool has_directories;
+  Regex directories;
+} Segment;
+
+struct Ignores {
+  atomic_size_t references;
+  Ignores* parent;
+  size_t base;
+  char* prefix;
+  size_t count;
+  Segment* segments;
+};
+
+static void Append(Path* p, const char* s) {
+  ReplacePathSuffix(p, p->count, s, strlen(s));
+}
+
+static void AppendByte(Path* p, char c) {
+  ReplacePathSuffix(p, p->count, &c, 1);
+}
+
+// Appends to `r` an ERE for the gitignore pattern `g`, of `length` bytes (with
+// any trailing `/` removed), that matches pathnames relative to the ignore
+// file's directory.
+static void AppendRule(Path* r, const char* g, size_t length) {
+  // A pattern with a `/` in it is relative to the directory; otherwise it
+  // matches names at any depth.
+  if (memchr(g, '/', length)) {
+    if (*g == '/') {
+      g++;
+      length--;
+    }
+  } else {
+    Append(r, "(.*/)?");
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    char c = g[i];
+    const bool whole = (i == 0 || g[i - 1] == '/') && i + 1 < length &&
+                       g[i + 1] == '*' && (i + 2 == length || g[i + 2] == '/');
+    if (c == '*' && whole) {
+      // `**` as a whole component matches any number of components.
+      if (i + 2 == length) {
+        Append(r, ".*");
+        i++;
+      } else {
+        Append(r, "(.*/)?");
+        i += 2;
+      }
+    } else if (c == '*') {
+      Append(r, "[^/]*");
+    } else if (c == '?') {
+      Append(r, "[^/]");
+    } else if (c == '[' && FindGlobBracketEnd(&g[i], length - i)) {
+      const size_t end = (size_t)(FindGlobBracketEnd(&g[i], length - i) - g);
+      AppendByte(r, '[');
+      i++;
+      if (g[i] == '!' || g[i] == '^') {
+        AppendByte(r, '^');
+        i++;
+      }
+      ReplacePathSuffix(r, r->count, &g[i], end - i + 1);
+      i = end;
+    } else {
+      if (c == '\\' && i + 1 < length) {
+        i++;
+        c = g[i];
+      }
+      if (strchr(".[]^$()|*+?{}\\", c)) {
+        AppendByte(r, '\\');
+      }
+      AppendByte(r, c);
+    }
+  }
+}
+
+static void FreeSegment(Segment* g) {
+  if (g->has_any) {
+    FreeRegex(&g->any);
+  }
+  if (g->has_directories) {
+    FreeRegex(&g->directories);
+  }
+}
+
+static bool CompileSegmentRegex(Path* pattern, Regex* r, const char* name) {
+  if (!pattern->count) {
+    return false;
+  }
+  Append(pattern, ")$");
+  *r = CompileRegex(pattern->values, REG_EXTENDED | REG_NOSUB);
+  TruncatePath(pattern, 0);
+  if (r->error) {
+    Warn(0, "%s: ", name);
+    PrintRegexError(r->error, &r->value);
+    FreeRegex(r);
+    return false;
+  }
+  return true;
+}
+
+// Compiles the rules gathered in `any` and `directories` into a new segment
+// of `s`.
+static void EndSegment(Ignores* s,
+                       bool negate,
+                       Path* any,
+                       Path* directories,
+                       const char* name) {
+  Segment g = {.negate = negate};
+  g.has_any = CompileSegmentRegex(any, &g.any, name);
+  g.has_directories =
+      CompileSegmentRegex(directories, &g.directories, name);
+  if (!g.has_any && !g.has_directories) {
+    return;
+  }
+  Segment* segments = realloc(s->segments, (s->count + 1) * sizeof(Segment));
+  if (!segments) {
+    Die(errno, "realloc");
+  }
+  s->segments = segments;
+  s->segments[s->count] = g;
+  s->count++;
+}
+
+// Parses the ignore file `contents`, named `name`, into `s->segments`.
+static void CompileRules(Ignores* s, char* contents, const char* name) {
+  AUTO(Path, any, (Path){0}, FreePath);
+  AUTO(Path, directories, (Path){0}, FreePath);
+  bool negate = false;
+  char* state;
+  for (char* line = strtok_r(contents, "\n", &state); line;
+       line = strtok_r(NULL, "\n", &state)) {
+    size_t length = strlen(line);
+    if (length && line[length - 1] == '\r') {
+      length--;
+    }
+    if (!length || line[0] == '#') {
+      continue;
+    }
+    const bool negated = line[0] == '!';
+    if (negated || (line[0] == '\\' && (line[1] == '#' || line[1] == '!'))) {
+      line++;
+      length--;
+    }
+    while (length && line[length - 1] == ' ' &&
+           !(length > 1 && line[length - 2] == '\\')) {
+      length--;
+    }
+    const bool directory = length && line[length - 1] == '/';
+    length -= directory;
+    if (!length) {
+      continue;
+    }
+
+    if (negated != negate) {
+      EndSegment(s, negate, &any, &directories, name);
+      negate = negated;
+    }
+    Path* r = directory ? &directories : &any;
+    Append(r, r->count ? "|" : "^(");
+    AppendRule(r, line, length);
+  }
+  EndSegment(s, negate, &any, &directories, name);
+}
+
+static char* ReadIgnoreFile(int directory, const char* name) {
+  const int fd = openat(directory, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      Warn(errno, "%s", name);
+    }
+    return NULL;
+  }
+  struct stat status;
+  char* contents = NULL;
+  if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode)) {
+    const size_t size = (size_t)status.st_size;
+    contents = malloc(size + 1);
+    if (!contents) {
+      Die(errno, "malloc");
+    }
+    size_t count = 0;
+    while (count < size) {
+      const ssize_t r = read(fd, &contents[count], size - count);
+      if (r <= 0) {
+        break;
+      }
+      count += (size_t)r;
+    }
+    contents[count] = '\0';
+  }
+  close(fd);
+  return contents;
+}
+
+Ignores* PushIgnores(Ignores* parent,
+                     int directory,
+                     const char* name,
+                     size_t base,
+                     const char* prefix) {
+  AUTO(char*, contents, ReadIgnoreFile(directory, name), FreeChar);
+  if (!contents) {
+    return RetainIgnores(parent);
+  }
+  Ignores* s = calloc(1, sizeof(Ignores));
+  if (!s) {
+    Die(errno, "calloc");
+  }
+  CompileRules(s, contents, name);
+  if (!s->count) {
+    free(s);
+    return RetainIgnores(parent);
+  }
+  atomic_init(&s->references, 1);
+  s->parent = RetainIgnores(parent);
+  s->base = base;
+  s->prefix = strdup(prefix);
+  if (!s->prefix) {
+    Die(errno, "strdup");
+  }
+  return s;
+}
+
+Ignores* NewParentIgnores(const char* root, size_t length) {
+  AUTO(char*, real, realpath(root, NULL), FreeChar);
+  if (!real) {
+    return NULL;
+  }
+
+  // Find the top of the repository: the nearest directory, starting with
+  // `root` itself, that has a .git in it.
+  AUTO(Path, candidate, (Path){0}, FreePath);
+  size_t top = strlen(real);
+  while (true) {
+    SetPath(&candidate, real);
+    TruncatePath(&candidate, top);
+    AppendPath(&candidate, ".git", 4);
+    if (access(candidate.values, F_OK) == 0) {
+      break;
+    }
+    if (top <= 1) {
+      return NULL;
+    }
+    top = LastIndex(real, top, '/');
+    top = top ? top : 1;
+  }
+
+  // Read the ignore files of each directory from there down to, but not
+  // including, `root`.
+  Ignores* s = NULL;
+  const size_t end = strlen(real);
+  while (top < end) {
+    SetPath(&candidate, real);
+    TruncatePath(&candidate, top);
+    const int d = open(candidate.values, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d < 0) {
+      break;
+    }
+    // Skip the `/` between the directory and the rest, unless the directory
+    // is the root directory, whose name already ends in one.
+    const char* prefix = &real[top == 1 ? 1 : top + 1];
+    SetPath(&candidate, prefix);
+    Append(&candidate, "/");
+    for (size_t i = 0; i < COUNT(ignore_file_names); i++) {
+      Ignores* t =
+          PushIgnores(s, d, ignore_file_names[i], length, candidate.values);
+      ReleaseIgnores(&s);
+      s = t;
+    }
+    close(d);
+    const char* next = strchr(prefix, '/');
+    top = next ? (size_t)(next - real) : end;
+  }
+  return s;
+}
+
+Ignores* RetainIgnores(Ignores* s) {
+  if (s) {
+    atomic_fetch_add(&s->references, 1);
+  }
+  return s;
+}
+
+void ReleaseIgnores(Ignores** s) {
+  Ignores* x = *s;
+  *s = NULL;
+  while (x && atomic_fetch_sub(&x->references, 1) == 1) {
+    Ignores* parent = x->parent;
+    for (size_t i = 0; i < x->count; i++) {
+      FreeSegment(&x->segments[i]);
+    }
+    free(x->segments);
+    free(x->prefix);
+    free(x);
+    x = parent;
+  }
+}
+
+bool IsIgnored(const Ignores* s, const char* pathname, bool is_directory) {
+  char buffer[PATH_MAX];
+  // Deeper files take precedence over shallower ones, and later rules over
+  // earlier ones, so look for the last rule that matches.
+  for (; s; s = s->parent) {
+    const char* relative = &pathname[s->base + 1];
+    if (s->prefix[0]) {
+      Format(buffer, sizeof(buffer), "%s%s", s->prefix, relative);
+      relative = buffer;
+    }
+    for (size_t i = s->count; i-- > 0;) {
+      const Segment* g = &s->segments[i];
+      if ((g->has_any && MatchRegex(&g->any, relative)) ||
+          (is_directory && g->has_directories &&
+           MatchRegex(&g->directories, relative))) {
+        return !g->negate;
+      }
+    }
+  }
+  return false;
+}
@@ -0,0 +1,52 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#ifndef IGNORE_H
+#define IGNORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A stack of ignore files (.gitignore, .ignore), 1 per directory from the top
+// of a walk down to the directory being walked. Each file's rules are compiled
+// into a few regular expressions: 1 per run of rules that ignore or un-ignore
+// (`!`), and per whether they match only directories.
+//
+// Stacks are immutable and reference-counted, so a walk can push and pop them
+// as it descends and returns, and hand them to other threads along with the
+// directories it has yet to walk.
+typedef struct Ignores Ignores;
+
+// The names of the ignore files that `PushIgnores` reads, in the order it
+// reads them. Later files take precedence.
+extern const char* const ignore_file_names[2];
+
+// Returns `parent` with the rules of the ignore file `name`, in the directory
+// open as `directory`, on top; or `parent` again (with another reference) if
+// the file has no rules or cannot be read.
+//
+// The pathnames later given to `IsIgnored` must name the directory in their
+// first `base` bytes. `prefix` is the pathname of the walk's top directory
+// relative to `directory` (e.g. "src/lib/"), or "" if `directory` is in the
+// walk.
+Ignores* PushIgnores(Ignores* parent,
+                     int directory,
+                     const char* name,
+                     size_t base,
+                     const char* prefix);
+
+// Returns the stack for the directories that contain `root`, up to the top of
+// the git repository it is in, or `NULL` if it is not in one. `root` will be
+// the first `length` bytes of the pathnames given to `IsIgnored`.
+Ignores* NewParentIgnores(const char* root, size_t length);
+
+// Adds a reference to `s`, and returns it.
+Ignores* RetainIgnores(Ignores* s);
+
+// Drops a reference to `*s`. See `AUTO`.
+void ReleaseIgnores(Ignores** s);
+
+// Reports whether the rules in `s` ignore `pathname`.
+bool IsIgnored(const Ignores* s, const char* pathname, bool is_directory);
+
+#endif
@@ -0,0 +1,187 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cli.h"
+#include "testing.h"
+#include "utils.h"
+
+// clang-format off
+static char description[] =
+"time `walk` with and without -I on a repository full of ignored files\n"
+"\n"
+"    ignore_test [options...]\n"
+"\n"
+"Builds a temporary repository of source files in src/, and of files in target/ and node_modules/, which its .gitignore ignores; all of them named with the extension c. Then runs `walk -e c` on it, with -I and without, first with a cold cache and then with a warm one, and prints how long each took (at best, over the given number of runs). Exits with an error if `walk` fails, or if it prints the wrong number of records. Emptying the cache takes permission to write /proc/sys/vm/drop_caches (usually, only root's); without it, only the warm cache is timed. Then removes the repository.";
+
+static Option options[] = {
+  {
+    .flag = 'h',
+    .description = "print help message",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'i',
+    .description = "put this many ignored files in target/, and half as many in node_modules/",
+    .value = { .type = OptionTypeSize, .z = 100000 }
+  },
+  {
+    .flag = 'r',
+    .description = "run each this many times",
+    .value = { .type = OptionTypeSize, .z = 5 }
+  },
+  {
+    .flag = 's',
+    .description = "put this many source files in src/",
+    .value = { .type = OptionTypeSize, .z = 2000 }
+  },
+  {
+    .flag = 'w',
+    .description = "run this `walk` executable",
+    .value = { .type = OptionTypeString, .s = "./walk" }
+  },
+};
+
+static CLI cli = {
+  .name = "ignore_test",
+  .description = description,
+  .options = {.count = COUNT(options), .values = options},
+};
+// clang-format on
+
+// How many files each directory of the repository holds.
+#define DIRECTORY_SIZE 1000
+
+// Makes the directory `name` in `root`, holding `count` files named with the
+// extension c, `DIRECTORY_SIZE` to a subdirectory.
+static void BuildFiles(int root, const char* name, size_t count) {
+  if (mkdirat(root, name, 0755)) {
+    Die(errno, "%s", name);
+  }
+  int directory = -1;
+  for (size_t i = 0; i < count; i++) {
+    char n[64];
+    if (i % DIRECTORY_SIZE == 0) {
+      if (directory >= 0) {
+        close(directory);
+      }
+      MustFormat(n, sizeof(n), "%s/d%zu", name, i / DIRECTORY_SIZE);
+      if (mkdirat(root, n, 0755)) {
+        Die(errno, "%s", n);
+      }
+      directory = openat(root, n, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (directory < 0) {
+        Die(errno, "%s", n);
+      }
+    }
+    MustFormat(n, sizeof(n), "f%zu.c", i);
+    CreateFile(directory, n);
+  }
+  if (directory >= 0) {
+    close(directory);
+  }
+}
+
+// Runs `walk` with `arguments` `runs` times, each after emptying the caches if
+// `cold`, and sets `*best` to the least time it took. Returns false if it
+// failed, or did not print `expected` records.
+static bool Time(char* const* arguments,
+                 size_t runs,
+                 bool cold,
+                 size_t expected,
+                 int64_t* best) {
+  *best = INT64_MAX;
+  for (size_t i = 0; i < runs; i++) {
+    if (cold) {
+      DropCaches();
+    }
+    size_t records = 0;
+    const int64_t start = GetEpochNanoseconds();
+    const bool ok = RunProgram(arguments, NULL, 0, CountRecords, &records);
+    const int64_t elapsed = GetEpochNanoseconds() - start;
+    if (!ok) {
+      MustPrintf(stderr, "FAILED: %s did not exit successfully\n",
+                 arguments[0]);
+      return false;
+    }
+    if (records != expected) {
+      MustPrintf(stderr, "FAILED: %s %s: expected %zu records, got %zu\n",
+                 arguments[0], arguments[1], expected, records);
+      return false;
+    }
+    *best = elapsed < *best ? elapsed : *best;
+  }
+  return true;
+}
+
+// Times `walk -e c` and `walk -I -e c` on `root`, and prints the times.
+static bool Compare(char* walk,
+                    char* root,
+                    size_t runs,
+                    bool cold,
+                    size_t sources,
+                    size_t ignored) {
+  char* const all[] = {walk, "-e", "c", root, NULL};
+  char* const obeying[] = {walk, "-I", "-e", "c", root, NULL};
+  int64_t without;
+  int64_t with;
+  if (!Time(all, runs, cold, sources + ignored, &without) ||
+      !Time(obeying, runs, cold, sources, &with)) {
+    return false;
+  }
+  MustPrintf(stdout, "%s  %10.1f  %8.1f\n", cold ? "cold" : "warm",
+             (double)without / 1e6, (double)with / 1e6);
+  return true;
+}
+
+int main(int count, char** arguments) {
+  Arguments as = ParseCLI(&cli, count, arguments);
+  if (FindOptionValue(cli.options, 'h')->b || as.count) {
+    PrintHelpAndExit(&cli, as.count > 0, true);
+  }
+  const size_t sources = FindOptionValue(cli.options, 's')->z;
+  const size_t ignored = FindOptionValue(cli.options, 'i')->z;
+  const size_t runs = FindOptionValue(cli.options, 'r')->z;
+  char* walk = FindOptionValue(cli.options, 'w')->s;
+
+  char root[] = "/tmp/ignore_test.XXXXXX";
+  if (!mkdtemp(root)) {
+    Die(errno, "mkdtemp");
+  }
+  const int directory = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory < 0) {
+    Die(errno, "%s", root);
+  }
+  const int fd = openat(directory, ".gitignore",
+                        O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  const char rules[] = "target/\nnode_modules/\n";
+  if (fd < 0 || write(fd, rules, sizeof(rules) - 1) != sizeof(rules) - 1 ||
+      close(fd)) {
+    Die(errno, ".gitignore");
+  }
+  BuildFiles(directory, "src", sources);
+  BuildFiles(directory, "target", ignored);
+  BuildFiles(directory, "node_modules", ignored / 2);
+
+  MustPrintf(stdout,
+             "%zu sources, %zu ignored\n"
+             "      without -I   with -I  (ms)\n",
+             sources, ignored + ignored / 2);
+  bool ok = true;
+  if (DropCaches()) {
+    ok = Compare(walk, root, runs, true, sources, ignored + ignored / 2);
+  }
+  ok = ok && Compare(walk, root, runs, false, sources, ignored + ignored / 2);
+
+  close(directory);
+  RemoveAll(AT_FDCWD, root);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,192 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "inodes.h"
+#include "utils.h"
+
+#define INODE_BITS 48
+#define INODE_LIMIT (UINT64_C(1) << INODE_BITS)
+#define DEVICE_LIMIT ((UINT64_C(1) << (64 - INODE_BITS)) - 1)
+
+// A member too large to pack into 8 bytes. `device` is 1 more than the
+// device's index, so that an empty slot is all 0.
+typedef struct Large {
+  uint64_t device;
+  uint64_t inode;
+} Large;
+
+struct InodeSet {
+  size_t count;
+
+  // The devices seen so far, in order. `last_device` is the index of the most
+  // recently used, which is nearly always the next one asked for.
+  size_t device_count;
+  size_t device_capacity;
+  dev_t* devices;
+  size_t last_device;
+
+  // Packed members: 1 more than the device index, and then the inode number.
+  // 0 marks an empty slot.
+  size_t small_count;
+  size_t small_mask;
+  uint64_t* small;
+
+  size_t large_count;
+  size_t large_mask;
+  Large* large;
+};
+
+static size_t Mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= UINT64_C(0xff51afd7ed558ccd);
+  x ^= x >> 33;
+  return (size_t)x;
+}
+
+static void* MustCalloc(size_t count, size_t size) {
+  void* p = calloc(count, size);
+  if (!p) {
+    Die(errno, "calloc");
+  }
+  return p;
+}
+
+InodeSet* NewInodeSet(void) {
+  InodeSet* s = MustCalloc(1, sizeof(InodeSet));
+  s->small_mask = 1024 - 1;
+  s->small = MustCalloc(s->small_mask + 1, sizeof(uint64_t));
+  s->large_mask = 16 - 1;
+  s->large = MustCalloc(s->large_mask + 1, sizeof(Large));
+  return s;
+}
+
+// Returns the index of `device` in `s->devices`, adding it if necessary.
+static size_t FindDevice(InodeSet* s, dev_t device) {
+  if (s->device_count && s->devices[s->last_device] == device) {
+    return s->last_device;
+  }
+  for (size_t i = 0; i < s->device_count; i++) {
+    if (s->devices[i] == device) {
+      s->last_device = i;
+      return i;
+    }
+  }
+  if (s->device_count == s->device_capacity) {
+    s->device_capacity = s->device_capacity ? 2 * s->device_capacity : 8;
+    dev_t* devices = realloc(s->devices, s->device_capacity * sizeof(dev_t));
+    if (!devices) {
+      Die(errno, "realloc");
+    }
+    s->devices = devices;
+  }
+  s->devices[s->device_count] = device;
+  s->last_device = s->device_count;
+  s->device_count++;
+  return s->last_device;
+}
+
+// Returns the slot of `key` in `slots`, or the empty slot where it belongs.
+static uint64_t* FindSmall(uint64_t* slots, size_t mask, uint64_t key) {
+  for (size_t i = Mix(key) & mask;; i = (i + 1) & mask) {
+    if (slots[i] == key || !slots[i]) {
+      return &slots[i];
+    }
+  }
+}
+
+static Large* FindLarge(Large* slots, size_t mask, Large key) {
+  for (size_t i = Mix(key.device * UINT64_C(0x9e3779b97f4a7c15) ^ key.inode) &
+                  mask;
+       ; i = (i + 1) & mask) {
+    if ((slots[i].device == key.device && slots[i].inode == key.inode) ||
+        !slots[i].device) {
+      return &slots[i];
+    }
+  }
+}
+
+static void GrowSmall(InodeSet* s) {
+  const size_t mask = 2 * s->small_mask + 1;
+  uint64_t* slots = MustCalloc(mask + 1, sizeof(uint64_t));
+  for (size_t i = 0; i <= s->small_mask; i++) {
+    if (s->small[i]) {
+      *FindSmall(slots, mask, s->small[i]) = s->small[i];
+    }
+  }
+  free(s->small);
+  s->small = slots;
+  s->small_mask = mask;
+}
+
+static void GrowLarge(InodeSet* s) {
+  const size_t mask = 2 * s->large_mask + 1;
+  Large* slots = MustCalloc(mask + 1, sizeof(Large));
+  for (size_t i = 0; i <= s->large_mask; i++) {
+    if (s->large[i].device) {
+      *FindLarge(slots, mask, s->large[i]) = s->large[i];
+    }
+  }
+  free(s->large);
+  s->large = slots;
+  s->large_mask = mask;
+}
+
+static bool IsCrowded(size_t count, size_t mask) {
+  return 4 * (count + 1) > 3 * (mask + 1);
+}
+
+bool AddInode(InodeSet* s, dev_t device, ino_t inode) {
+  const uint64_t index = FindDevice(s, device) + 1;
+  if (index <= DEVICE_LIMIT && inode < INODE_LIMIT) {
+    const uint64_t key = index << INODE_BITS | inode;
+    uint64_t* slot = FindSmall(s->small, s->small_mask, key);
+    if (*slot) {
+      return false;
+    }
+    if (IsCrowded(s->small_count, s->small_mask)) {
+      GrowSmall(s);
+      slot = FindSmall(s->small, s->small_mask, key);
+    }
+    *slot = key;
+    s->small_count++;
+  } else {
+    const Large key = {.device = index, .inode = inode};
+    Large* slot = FindLarge(s->large, s->large_mask, key);
+    if (slot->device) {
+      return false;
+    }
+    if (IsCrowded(s->large_count, s->large_mask)) {
+      GrowLarge(s);
+      slot = FindLarge(s->large, s->large_mask, key);
+    }
+    *slot = key;
+    s->large_count++;
+  }
+  s->count++;
+  return true;
+}
+
+size_t CountInodes(const InodeSet* s) {
+  return s->count;
+}
+
+size_t SizeInodeSet(const InodeSet* s) {
+  return sizeof(InodeSet) + s->device_capacity * sizeof(dev_t) +
+         (s->small_mask + 1) * sizeof(uint64_t) +
+         (s->large_mask + 1) * sizeof(Large);
+}
+
+void FreeInodeSet(InodeSet** s) {
+  InodeSet* x = *s;
+  *s = NULL;
+  if (x) {
+    free(x->devices);
+    free(x->small);
+    free(x->large);
+    free(x);
+  }
+}
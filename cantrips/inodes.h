@@ -0,0 +1,38 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#ifndef INODES_H
+#define INODES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// A set of (device, inode) pairs, as from `stat`, for noticing files that a
+// walk reaches more than once: by symbolic links, bind mounts, or hard links.
+//
+// Most members take 8 bytes: the inode number in the low 48 bits, and the
+// index of the device in a small table of those seen in the high 16. The rest
+// (inode numbers of 2^48 or more, or devices past the 65535th) take 16 bytes,
+// in a table of their own. Both tables are open-addressed and kept between 3/8
+// and 3/4 full, so the set costs about 11 to 21 bytes per member.
+//
+// A set must be used by only 1 thread at a time.
+typedef struct InodeSet InodeSet;
+
+// Returns a new, empty `InodeSet`.
+InodeSet* NewInodeSet(void);
+
+// Adds (`device`, `inode`) to `s`. Reports whether it was not already there.
+bool AddInode(InodeSet* s, dev_t device, ino_t inode);
+
+// Returns the number of members of `s`.
+size_t CountInodes(const InodeSet* s);
+
+// Returns the number of bytes of memory `s` uses.
+size_t SizeInodeSet(const InodeSet* s);
+
+// Destroys `*s`. See `AUTO`.
+void FreeInodeSet(InodeSet** s);
+
+#endif
@@ -0,0 +1,177 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cli.h"
+#include "testing.h"
+#include "utils.h"
+
+// clang-format off
+static char description[] =
+"time `walk` fetching file statuses with and without -O\n"
+"\n"
+"    inodes_test [options...] [directory]\n"
+"\n"
+"Builds a temporary tree in the directory (default: /tmp) of directories of empty files, created in order, so that their inode numbers are in order of name; on most filesystems, readdir returns them in another. Then runs `walk -s 1`, which must fetch every file's status, with -O and without, first with a cold cache and then with a warm one, and prints how long each took (at best, over the given number of runs). Exits with an error if `walk` fails, or if the 2 print different records. Emptying the cache takes permission to write /proc/sys/vm/drop_caches (usually, only root's); without it, only the warm cache is timed. -O is for disks that seek, so the directory is best on one. Then removes the tree.";
+
+static Option options[] = {
+  {
+    .flag = 'd',
+    .description = "make this many directories",
+    .value = { .type = OptionTypeSize, .z = 100 }
+  },
+  {
+    .flag = 'f',
+    .description = "make this many files in each directory",
+    .value = { .type = OptionTypeSize, .z = 2000 }
+  },
+  {
+    .flag = 'h',
+    .description = "print help message",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'r',
+    .description = "run each this many times",
+    .value = { .type = OptionTypeSize, .z = 3 }
+  },
+  {
+    .flag = 'w',
+    .description = "run this `walk` executable",
+    .value = { .type = OptionTypeString, .s = "./walk" }
+  },
+};
+
+static CLI cli = {
+  .name = "inodes_test",
+  .description = description,
+  .options = {.count = COUNT(options), .values = options},
+};
+// clang-format on
+
+static void BuildTree(const char* root, size_t directories, size_t files) {
+  const int r = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (r < 0) {
+    Die(errno, "%s", root);
+  }
+  for (size_t i = 0; i < directories; i++) {
+    char name[32];
+    MustFormat(name, sizeof(name), "d%zu", i);
+    if (mkdirat(r, name, 0755)) {
+      Die(errno, "%s", name);
+    }
+    const int d = openat(r, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d < 0) {
+      Die(errno, "%s", name);
+    }
+    for (size_t j = 0; j < files; j++) {
+      MustFormat(name, sizeof(name), "f%zu", j);
+      CreateFile(d, name);
+    }
+    close(d);
+  }
+  close(r);
+}
+
+// Runs `walk` with `arguments` `runs` times, each after emptying the caches if
+// `cold`, and sets `*best` to the least time it took. Returns what it printed
+// the last time, which the caller must free, or `NULL` if it failed.
+static char* Time(char* const* arguments,
+                  size_t runs,
+                  bool cold,
+                  int64_t* best) {
+  *best = INT64_MAX;
+  char* output = NULL;
+  for (size_t i = 0; i < runs; i++) {
+    if (cold) {
+      DropCaches();
+    }
+    free(output);
+    bool ok = true;
+    const int64_t start = GetEpochNanoseconds();
+    output = ReadProgram(arguments, NULL, &ok);
+    const int64_t elapsed = GetEpochNanoseconds() - start;
+    if (!ok) {
+      MustPrintf(stderr, "FAILED: %s did not exit successfully\n",
+                 arguments[0]);
+      free(output);
+      return NULL;
+    }
+    *best = elapsed < *best ? elapsed : *best;
+  }
+  return output;
+}
+
+// Times `walk -s 1` and `walk -O -s 1` on `root`, and prints the times.
+// Returns false if `walk` failed, or printed other than `expected` records, or
+// different ones with -O.
+static bool Compare(char* walk,
+                    char* root,
+                    size_t runs,
+                    bool cold,
+                    size_t expected) {
+  char* const unordered[] = {walk, "-s", "1", root, NULL};
+  char* const ordered[] = {walk, "-O", "-s", "1", root, NULL};
+  int64_t without;
+  int64_t with;
+  AUTO(char*, a, Time(unordered, runs, cold, &without), FreeChar);
+  AUTO(char*, b, a ? Time(ordered, runs, cold, &with) : NULL, FreeChar);
+  if (!a || !b) {
+    return false;
+  }
+  size_t records = 0;
+  CountRecords(&records, a, strlen(a));
+  if (records != expected) {
+    MustPrintf(stderr, "FAILED: expected %zu records, got %zu\n", expected,
+               records);
+    return false;
+  }
+  if (strcmp(a, b)) {
+    MustPrintf(stderr, "FAILED: -O printed different records\n");
+    return false;
+  }
+  MustPrintf(stdout, "%s  %10.1f  %8.1f\n", cold ? "cold" : "warm",
+             (double)without / 1e6, (double)with / 1e6);
+  return true;
+}
+
+int main(int count, char** arguments) {
+  Arguments as = ParseCLI(&cli, count, arguments);
+  if (FindOptionValue(cli.options, 'h')->b || as.count > 1) {
+    PrintHelpAndExit(&cli, as.count > 1, true);
+  }
+  const size_t directories = FindOptionValue(cli.options, 'd')->z;
+  const size_t files = FindOptionValue(cli.options, 'f')->z;
+  const size_t runs = FindOptionValue(cli.options, 'r')->z;
+  char* walk = FindOptionValue(cli.options, 'w')->s;
+
+  char root[PATH_MAX];
+  MustFormat(root, sizeof(root), "%s/inodes_test.XXXXXX",
+             as.count ? as.values[0] : "/tmp");
+  if (!mkdtemp(root)) {
+    Die(errno, "mkdtemp");
+  }
+  BuildTree(root, directories, files);
+
+  MustPrintf(stdout,
+             "%zu files\n"
+             "      without -O   with -O  (ms)\n",
+             directories * files);
+  bool ok = true;
+  if (DropCaches()) {
+    ok = Compare(walk, root, runs, true, directories * files);
+  }
+  ok = ok && Compare(walk, root, runs, false, directories * files);
+
+  RemoveAll(AT_FDCWD, root);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -6,6 +6,7 @@
 #include <dirent.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <grp.h>
 #include <pwd.h>
 #include <stdbool.h>
@@ -17,6 +18,7 @@
 #include <unistd.h>
 
 #include "cli.h"
+#include "status.h"
 #include "utils.h"
 
 // clang-format off
@@ -27,7 +29,7 @@ static char description[] = "print names and properties of files\n"
 static Option options[] = {
   {
     .flag = 'A',
-    .description = "print the status of hidden files, too",
+    .description = "print the status of hidden files, too (. and .. first)",
     .value = { .type = OptionTypeBool }
   },
   {
@@ -45,6 +47,11 @@ static Option options[] = {
     .description = "shuffle in memory (uses more memory but the shuffle is faster)",
     .value = { .type = OptionTypeBool }
   },
+  {
+    .flag = 'q',
+    .description = "number of file status requests to keep in flight (can help on slow or network filesystems)",
+    .value = { .type = OptionTypeSize, .z = 1 }
+  },
 };
 
 static CLI cli = {
@@ -57,28 +64,50 @@ static CLI cli = {
 typedef struct tm* Time2Tm(const time_t* clock);
 static Time2Tm* time2tm = localtime;
 
-static void PrintStatus(const char* pathname) {
-  struct stat status;
-  if (lstat(pathname, &status)) {
-    Warn(errno, "%s", pathname);
-    return;
-  }
-
-  const struct tm* t = time2tm(&status.st_mtime);
+// The most recent user or group name looked up. The files in a listing usually
+// share an owner, and `getpwuid` and `getgrgid` can be slow.
+typedef struct Name {
+  bool valid;
+  unsigned id;
+  char value[64];
+} Name;
 
-  const struct passwd* u = getpwuid(status.st_uid);
-  char u_buffer[13] = {0};
-  if (!u) {
-    MustFormat(u_buffer, sizeof(u_buffer), "%u", (unsigned)status.st_uid);
+static const char* GetUserName(uid_t uid) {
+  static Name cache;
+  if (!cache.valid || cache.id != uid) {
+    const struct passwd* u = getpwuid(uid);
+    if (u) {
+      Format(cache.value, sizeof(cache.value), "%s", u->pw_name);
+    } else {
+      Format(cache.value, sizeof(cache.value), "%u", (unsigned)uid);
+    }
+    cache.valid = true;
+    cache.id = uid;
   }
+  return cache.value;
+}
 
-  const struct group* g = getgrgid(status.st_gid);
-  char g_buffer[13] = {0};
-  if (!g) {
-    MustFormat(g_buffer, sizeof(g_buffer), "%u", (unsigned)status.st_gid);
+static const char* GetGroupName(gid_t gid) {
+  static Name cache;
+  if (!cache.valid || cache.id != gid) {
+    const struct group* g = getgrgid(gid);
+    if (g) {
+      Format(cache.value, sizeof(cache.value), "%s", g->gr_name);
+    } else {
+      Format(cache.value, sizeof(cache.value), "%u", (unsigned)gid);
+    }
+    cache.valid = true;
+    cache.id = gid;
   }
+  return cache.value;
+}
+
+static void PrintStatus(Output* o,
+                        const char* pathname,
+                        const struct stat* status) {
+  const struct tm* t = time2tm(&status->st_mtime);
 
-  const mode_t m = status.st_mode;
+  const mode_t m = status->st_mode;
   char type = '-';
   const char arrow[] = " → ";
   char target[sizeof(arrow) + PATH_MAX + 1] = {0};
@@ -88,7 +117,7 @@ static void PrintStatus(const char* pathname) {
     type = 'l';
     strncpy(target, arrow, strlen(arrow));
     const ssize_t r = readlink(pathname, target + strlen(arrow),
-                               sizeof(target) - strlen(arrow));
+                               sizeof(target) - strlen(arrow) - 1);
     if (r == -1) {
       Warn(errno, "readlink(%s)", pathname);
       target[0] = '\0';
@@ -97,28 +126,92 @@ static void PrintStatus(const char* pathname) {
     type = '-';
   }
 
-  char mode[11];
-  MustFormat(
-      mode, sizeof(mode), "%c%c%c%c%c%c%c%c%c%c", type, m & S_IRUSR ? 'r' : '-',
-      m & S_IWUSR ? 'w' : '-', m & S_IXUSR ? 'x' : '-', m & S_IRGRP ? 'r' : '-',
-      m & S_IWGRP ? 'w' : '-', m & S_IXGRP ? 'x' : '-', m & S_IROTH ? 'r' : '-',
-      m & S_IWOTH ? 'w' : '-', m & S_IXOTH ? 'x' : '-');
+  char mode[11] = {
+      type,
+      m & S_IRUSR ? 'r' : '-',
+      m & S_IWUSR ? 'w' : '-',
+      m & S_IXUSR ? 'x' : '-',
+      m & S_IRGRP ? 'r' : '-',
+      m & S_IWGRP ? 'w' : '-',
+      m & S_IXGRP ? 'x' : '-',
+      m & S_IROTH ? 'r' : '-',
+      m & S_IWOTH ? 'w' : '-',
+      m & S_IXOTH ? 'x' : '-',
+      '\0',
+  };
   mode[3] = m & S_ISUID ? 's' : mode[3];
   mode[6] = m & S_ISGID ? 's' : mode[6];
   mode[9] = m & S_ISVTX ? 's' : mode[9];
 
   static bool printed_header = false;
   if (!printed_header) {
-    MustPrintf(stdout, "%-16s  %12s  %-12s  %-12s  %-10s  %s\n", "Modified",
-               "Size", "User", "Group", "Mode", "Name");
+    char header[128];
+    MustFormat(header, sizeof(header), "%-16s  %12s  %-12s  %-12s  %-10s  %s\n",
+               "Modified", "Size", "User", "Group", "Mode", "Name");
+    AppendString(o, header);
     printed_header = true;
   }
-  MustPrintf(stdout,
-             "%04d-%02d-%02d %02d:%02d  %12lld  %-12s  %-12s  %-10s  %s%s%s",
-             t->tm_year + 1900, t->tm_mon + 1, t->tm_mday, t->tm_hour,
-             t->tm_min, (long long)status.st_size, u ? u->pw_name : u_buffer,
-             g ? g->gr_name : g_buffer, mode, pathname,
-             target[0] == '\0' ? "" : target, ORS);
+
+  // The equivalent of
+  // "%04d-%02d-%02d %02d:%02d  %12lld  %-12s  %-12s  %-10s  %s%s%s", without
+  // parsing the format for every file.
+  AppendInteger(o, t->tm_year + 1900, 4, '0');
+  AppendChar(o, '-');
+  AppendInteger(o, t->tm_mon + 1, 2, '0');
+  AppendChar(o, '-');
+  AppendInteger(o, t->tm_mday, 2, '0');
+  AppendChar(o, ' ');
+  AppendInteger(o, t->tm_hour, 2, '0');
+  AppendChar(o, ':');
+  AppendInteger(o, t->tm_min, 2, '0');
+  AppendString(o, "  ");
+  AppendInteger(o, (int64_t)status->st_size, 12, ' ');
+  AppendString(o, "  ");
+  AppendPadded(o, GetUserName(status->st_uid), 12);
+  AppendString(o, "  ");
+  AppendPadded(o, GetGroupName(status->st_gid), 12);
+  AppendString(o, "  ");
+  AppendPadded(o, mode, 10);
+  AppendString(o, "  ");
+  AppendString(o, pathname);
+  AppendString(o, target);
+  AppendString(o, ORS);
+}
+
+// How many files' statuses to fetch at once.
+#define STATUS_BATCH 128
+
+typedef struct Batch {
+  size_t count;
+  StatusRequest requests[STATUS_BATCH];
+} Batch;
+
+static void PrintBatch(Output* o, StatusEngine* e, Batch* b) {
+  GetStatuses(e, b->requests, b->count);
+  for (size_t i = 0; i < b->count; i++) {
+    const StatusRequest* r = &b->requests[i];
+    if (r->error) {
+      Warn(r->error, "%s", r->name);
+    } else {
+      PrintStatus(o, r->name, &r->status);
+    }
+  }
+  b->count = 0;
+}
+
+// Queues up `name` (relative to `directory`) to be printed, and prints the
+// queue when it is full.
+static void PrintLater(Output* o,
+                       StatusEngine* e,
+                       Batch* b,
+                       int directory,
+                       const char* name) {
+  b->requests[b->count] = (StatusRequest){
+      .directory = directory, .name = name, .flags = AT_SYMLINK_NOFOLLOW};
+  b->count++;
+  if (b->count == STATUS_BATCH) {
+    PrintBatch(o, e, b);
+  }
 }
 
 int main(int count, char** arguments) {
@@ -127,19 +220,44 @@ int main(int count, char** arguments) {
   if (FindOptionValue(cli.options, 'h')->b) {
     PrintHelpAndExit(&cli, false, true);
   }
+
+  AUTO(StatusEngine*, engine,
+       NewStatusEngine(StatusFieldAll, FindOptionValue(cli.options, 'q')->z),
+       FreeStatusEngine);
+  static Batch batch;
+  static char buffer[64 * 1024];
+  AUTO(Output, output,
+       ((Output){.fd = STDOUT_FILENO,
+                 .capacity = sizeof(buffer),
+                 .values = buffer}),
+       CloseOutput);
+  AUTO(Entries, entries, (Entries){0}, FreeEntries);
   if (as.count == 0) {
-    AUTO(DIR*, cwd, opendir("."), CloseDir);
-    while (true) {
-      const struct dirent* e = readdir(cwd);
-      if (!e) {
-        break;
-      }
-      if (FindOptionValue(cli.options, 'A')->b || e->d_name[0] != '.') {
-        PrintStatus(e->d_name);
+    const int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd < 0) {
+      Die(errno, ".");
+    }
+    const int e = ReadEntries(cwd, &entries);
+    if (e) {
+      Warn(e, ".");
+    }
+    close(cwd);
+    const bool all = FindOptionValue(cli.options, 'A')->b;
+    if (all) {
+      // `ReadEntries` skips these, but they are hidden files, too. They come
+      // first, rather than wherever the directory happens to list them.
+      PrintLater(&output, engine, &batch, AT_FDCWD, ".");
+      PrintLater(&output, engine, &batch, AT_FDCWD, "..");
+    }
+    for (size_t i = 0; i < entries.count; i++) {
+      const char* name = entries.values[i].name;
+      if (all || name[0] != '.') {
+        PrintLater(&output, engine, &batch, AT_FDCWD, name);
       }
     }
   }
   for (size_t i = 0; i < as.count; i++) {
-    PrintStatus(as.values[i]);
+    PrintLater(&output, engine, &batch, AT_FDCWD, as.values[i]);
   }
+  PrintBatch(&output, engine, &batch);
 }
@@ -0,0 +1,182 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cli.h"
+#include "testing.h"
+#include "utils.h"
+
+// clang-format off
+static char description[] =
+"time `list` with 1 file status request in flight, and with many\n"
+"\n"
+"    list_test [options...] [directory]\n"
+"\n"
+"Lists the directory (default: a temporary one, holding files named `f` and a number) with `list -q 1` and `list -q` the given number, first with a cold cache and then with a warm one, and prints how long each took. Exits with an error if `list` fails, or if the 2 print different listings. Emptying the cache takes permission to write /proc/sys/vm/drop_caches (usually, only root's); without it, only the warm cache is timed. Then removes the temporary directory.";
+
+static Option options[] = {
+  {
+    .flag = 'h',
+    .description = "print help message",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'l',
+    .description = "run this `list` executable",
+    .value = { .type = OptionTypeString, .s = "./list" }
+  },
+  {
+    .flag = 'n',
+    .description = "make the temporary directory hold this many files",
+    .value = { .type = OptionTypeSize, .z = 10000 }
+  },
+  {
+    .flag = 'q',
+    .description = "compare `list -q 1` with `list -q` this many",
+    .value = { .type = OptionTypeSize, .z = 64 }
+  },
+};
+
+static CLI cli = {
+  .name = "list_test",
+  .description = description,
+  .options = {.count = COUNT(options), .values = options},
+};
+// clang-format on
+
+static void BuildDirectory(const char* root, size_t count) {
+  const int directory = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory < 0) {
+    Die(errno, "%s", root);
+  }
+  for (size_t i = 0; i < count; i++) {
+    char name[32];
+    MustFormat(name, sizeof(name), "f%zu", i);
+    CreateFile(directory, name);
+  }
+  close(directory);
+}
+
+static void RemoveDirectory(const char* root, size_t count) {
+  const int directory = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory < 0) {
+    Die(errno, "%s", root);
+  }
+  for (size_t i = 0; i < count; i++) {
+    char name[32];
+    MustFormat(name, sizeof(name), "f%zu", i);
+    if (unlinkat(directory, name, 0)) {
+      Die(errno, "%s", name);
+    }
+  }
+  close(directory);
+  if (rmdir(root)) {
+    Die(errno, "%s", root);
+  }
+}
+
+// Runs `list -q depth` in `directory`, and returns what it printed, which the
+// caller must free. Sets `*elapsed` to how long it took. Returns `NULL` if it
+// did not exit successfully.
+static char* RunList(char* list,
+                     const char* directory,
+                     size_t depth,
+                     int64_t* elapsed) {
+  char q[32];
+  MustFormat(q, sizeof(q), "%zu", depth);
+  char* const arguments[] = {list, "-q", q, NULL};
+  const int64_t start = GetEpochNanoseconds();
+  bool ok = true;
+  char* output = ReadProgram(arguments, directory, &ok);
+  *elapsed = GetEpochNanoseconds() - start;
+  if (!ok) {
+    free(output);
+    return NULL;
+  }
+  return output;
+}
+
+// Times `list -q 1` and `list -q depth` in `directory`, each after emptying the
+// caches if `cold`, and prints the times. Returns false if `list` failed or the
+// listings differ.
+static bool Compare(char* list,
+                    const char* directory,
+                    size_t depth,
+                    bool cold) {
+  const size_t depths[] = {1, depth};
+  char* outputs[COUNT(depths)] = {0};
+  int64_t elapsed[COUNT(depths)];
+  bool ok = true;
+  for (size_t i = 0; ok && i < COUNT(depths); i++) {
+    if (cold) {
+      DropCaches();
+    }
+    outputs[i] = RunList(list, directory, depths[i], &elapsed[i]);
+    if (!outputs[i]) {
+      MustPrintf(stderr, "FAILED: %s -q %zu did not exit successfully\n",
+                 list, depths[i]);
+      ok = false;
+    }
+  }
+  if (ok && strcmp(outputs[0], outputs[1])) {
+    MustPrintf(stderr, "FAILED: -q 1 and -q %zu printed different listings\n",
+               depth);
+    ok = false;
+  }
+  if (ok) {
+    MustPrintf(stdout, "%s  %8.3f  %8.3f\n", cold ? "cold" : "warm",
+               (double)elapsed[0] / 1e9, (double)elapsed[1] / 1e9);
+  }
+  for (size_t i = 0; i < COUNT(depths); i++) {
+    free(outputs[i]);
+  }
+  return ok;
+}
+
+int main(int count, char** arguments) {
+  Arguments as = ParseCLI(&cli, count, arguments);
+  if (FindOptionValue(cli.options, 'h')->b || as.count > 1) {
+    PrintHelpAndExit(&cli, as.count > 1, true);
+  }
+  const size_t files = FindOptionValue(cli.options, 'n')->z;
+  const size_t depth = FindOptionValue(cli.options, 'q')->z;
+  // `list` runs in the directory, so a relative pathname would not find it.
+  char list[PATH_MAX];
+  if (!realpath(FindOptionValue(cli.options, 'l')->s, list)) {
+    Die(errno, "%s", FindOptionValue(cli.options, 'l')->s);
+  }
+
+  char root[] = "/tmp/list_test.XXXXXX";
+  const char* directory = as.count ? as.values[0] : root;
+  if (!as.count) {
+    if (!mkdtemp(root)) {
+      Die(errno, "mkdtemp");
+    }
+    BuildDirectory(root, files);
+  }
+
+  MustPrintf(stdout, "%s\n      -q 1  -q %-6zu(seconds)\n", directory, depth);
+  bool ok = true;
+  if (DropCaches()) {
+    ok = Compare(list, directory, depth, true);
+  }
+  // The first run only warms the cache.
+  int64_t elapsed;
+  free(RunList(list, directory, 1, &elapsed));
+  ok = ok && Compare(list, directory, depth, false);
+
+  if (!as.count) {
+    RemoveDirectory(root, files);
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1632 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cli.h"
+#include "utils.h"
+
+#if defined(__MACH__)
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
+#endif
+
+// clang-format off
+static char description[] =
+"search a database of pathnames, or build it\n"
+"\n"
+"    locate [options...] pattern [...]\n"
+"    locate -u [options...] [pathnames...]\n"
+"\n"
+"Prints the pathnames that contain any of the patterns. With -u, walks the pathnames (default: $HOME), without crossing device boundaries, and replaces the database with the result. The database records when each directory last changed, so that the next update needs to read only the directories that have changed since; it copies the rest from the old database.\n"
+"\n"
+"The database stores pathnames front-coded, as in \"Finding Files Fast\" by James A. Woods (https://www2.eecs.berkeley.edu/Pubs/TechRpts/1983/CSD-83-148.pdf), in blocks that can be searched in parallel. With -t, locate also keeps an index of which blocks contain each 3-byte sequence, and searches only the blocks that contain all of a pattern's.";
+
+static Option options[] = {
+  {
+    .flag = '0',
+    .description = "delimit output records with NUL instead of newline",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'A',
+    .description = "when building, include hidden files too",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'd',
+    .description = "pathname of the database (default: $HOME/.locate.db)",
+    .value = { .type = OptionTypeString }
+  },
+  {
+    .flag = 'f',
+    .description = "when updating, read every directory again, rather than only those that have changed since the last update",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'h',
+    .description = "print help message",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'i',
+    .description = "ignore case when matching",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'j',
+    .description = "number of threads to search with",
+    .value = { .type = OptionTypeSize }
+  },
+  {
+    .flag = 'r',
+    .description = "treat patterns as POSIX extended regular expressions; refer to re_format(7)",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 't',
+    .description = "when building, also build a trigram index, which makes most searches much faster",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'u',
+    .description = "update the database",
+    .value = { .type = OptionTypeBool }
+  },
+};
+
+static CLI cli = {
+  .name = "locate",
+  .description = description,
+  .options = {.count = COUNT(options), .values = options},
+};
+// clang-format on
+
+#define OVB(flag) FindOptionValue(cli.options, (flag))->b
+#define OVS(flag) FindOptionValue(cli.options, (flag))->s
+#define OVZ(flag) FindOptionValue(cli.options, (flag))->z
+
+// The database format, all integers little-endian:
+//
+//   header:  "LOCATEDB", u32 version, u32 block size, u64 record count,
+//            u64 index offset, u32 flags (see `DatabaseFlag`), u32 0
+//   blocks:  records of (varint shared prefix length, varint suffix length << 3
+//            | `RecordFlag`s, suffix bytes, and for directories, varint inode,
+//            varint mtime, varint ctime); the first record in each block
+//            shares nothing, so that each block can be decoded independently
+//   index:   u64 offset of each block
+static const char magic[8] = "LOCATEDB";
+#define VERSION 2
+#define HEADER_SIZE 40
+
+typedef enum DatabaseFlag {
+  // The database includes hidden files.
+  DatabaseFlagAll = 1 << 0,
+} DatabaseFlag;
+
+typedef enum RecordFlag {
+  // The record is followed by the directory's `Metadata`.
+  RecordFlagDirectory = 1 << 0,
+  // The record is not a search result. It is kept so that the next update can
+  // find it: a root, or a directory on another device.
+  RecordFlagHidden = 1 << 1,
+  // The record is a root given to `Build`, and starts its subtree.
+  RecordFlagRoot = 1 << 2,
+} RecordFlag;
+#define RECORD_FLAG_BITS 3
+
+// The number of pathnames per block. Larger blocks compress better, and smaller
+// blocks spread the work more evenly among threads.
+#define BLOCK_SIZE 256
+
+// The number of blocks a search thread claims at a time.
+#define CHUNK_SIZE 64
+
+static void PutU32(uint8_t* p, uint32_t n) {
+  for (size_t i = 0; i < 4; i++) {
+    p[i] = (uint8_t)(n >> (8 * i));
+  }
+}
+
+static void PutU64(uint8_t* p, uint64_t n) {
+  for (size_t i = 0; i < 8; i++) {
+    p[i] = (uint8_t)(n >> (8 * i));
+  }
+}
+
+static uint32_t GetU32(const uint8_t* p) {
+  uint32_t n = 0;
+  for (size_t i = 0; i < 4; i++) {
+    n |= (uint32_t)p[i] << (8 * i);
+  }
+  return n;
+}
+
+static uint64_t GetU64(const uint8_t* p) {
+  uint64_t n = 0;
+  for (size_t i = 0; i < 8; i++) {
+    n |= (uint64_t)p[i] << (8 * i);
+  }
+  return n;
+}
+
+static void WriteBytes(FILE* output, const void* bytes, size_t count) {
+  if (fwrite(bytes, 1, count, output) != count) {
+    Die(errno, "fwrite");
+  }
+}
+
+// Encodes `n` in LEB128 form into `buffer`, and returns how many bytes that
+// took.
+static size_t EncodeVarint(uint8_t buffer[static 10], uint64_t n) {
+  size_t i = 0;
+  do {
+    buffer[i] = (uint8_t)(n & 0x7F);
+    n >>= 7;
+    if (n) {
+      buffer[i] |= 0x80;
+    }
+    i++;
+  } while (n);
+  return i;
+}
+
+// Writes `n` in LEB128 form, and returns how many bytes that took.
+static size_t WriteVarint(FILE* output, uint64_t n) {
+  uint8_t buffer[10];
+  const size_t count = EncodeVarint(buffer, n);
+  WriteBytes(output, buffer, count);
+  return count;
+}
+
+// Decodes a varint from `*p`, not reading past `end`, and advances `*p`.
+// Returns false if the data is truncated.
+static bool ReadVarint(const uint8_t** p,
+                       const uint8_t* end,
+                       uint64_t* result) {
+  uint64_t n = 0;
+  for (unsigned shift = 0; *p < end && shift < 64; shift += 7) {
+    const uint8_t b = **p;
+    (*p)++;
+    n |= (uint64_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      *result = n;
+      return true;
+    }
+  }
+  return false;
+}
+
+// What an update compares to tell whether a directory has changed since the
+// last one. Times are in nanoseconds. A `ctime` of 0 means unknown, which
+// always counts as changed.
+typedef struct Metadata {
+  uint64_t inode;
+  uint64_t mtime;
+  uint64_t ctime;
+} Metadata;
+
+typedef struct Database {
+  const uint8_t* data;
+  size_t size;
+  uint64_t inode;
+  uint32_t flags;
+  uint64_t count;
+  uint64_t block_count;
+  const uint8_t* index;
+} Database;
+
+static void UnmapDatabase(Database* db) {
+  if (db->data) {
+    munmap((void*)(uintptr_t)db->data, db->size);
+  }
+}
+
+// Maps the database at `pathname` into `db`. Returns NULL, or a description of
+// the problem.
+static const char* TryMapDatabase(const char* pathname, Database* db) {
+  *db = (Database){0};
+  const int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return strerror(errno);
+  }
+  struct stat status;
+  if (fstat(fd, &status)) {
+    const int e = errno;
+    close(fd);
+    return strerror(e);
+  }
+  if (status.st_size < HEADER_SIZE) {
+    close(fd);
+    return "not a locate database";
+  }
+  void* data =
+      mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return strerror(errno);
+  }
+  db->data = data;
+  db->size = (size_t)status.st_size;
+  db->inode = (uint64_t)status.st_ino;
+
+  const uint8_t* h = db->data;
+  const char* problem = NULL;
+  if (memcmp(h, magic, sizeof(magic))) {
+    problem = "not a locate database";
+  } else if (GetU32(&h[8]) != VERSION) {
+    problem = "unsupported version; update the database with locate -u";
+  } else if (GetU32(&h[12]) != BLOCK_SIZE) {
+    problem = "unsupported block size";
+  }
+  db->count = GetU64(&h[16]);
+  db->block_count = (db->count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  const uint64_t index = GetU64(&h[24]);
+  db->flags = GetU32(&h[32]);
+  if (!problem &&
+      (index > db->size || (db->size - index) / 8 < db->block_count)) {
+    problem = "corrupt index";
+  }
+  if (problem) {
+    UnmapDatabase(db);
+    *db = (Database){0};
+    return problem;
+  }
+  db->index = &db->data[index];
+  return NULL;
+}
+
+static Database MapDatabase(const char* pathname) {
+  Database db;
+  const char* problem = TryMapDatabase(pathname, &db);
+  if (problem) {
+    Die(0, "%s: %s\n", pathname, problem);
+  }
+  (void)posix_madvise((void*)(uintptr_t)db.data, db.size,
+                      POSIX_MADV_WILLNEED);
+  return db;
+}
+
+// Decodes the record at `*p`, not reading past `end`, into `path`, `flags`,
+// and `m`, and advances `*p`.
+static void ReadRecord(const uint8_t** p,
+                       const uint8_t* end,
+                       Path* path,
+                       unsigned* flags,
+                       Metadata* m) {
+  uint64_t shared;
+  uint64_t length;
+  if (!ReadVarint(p, end, &shared) || !ReadVarint(p, end, &length) ||
+      shared > path->count) {
+    Die(0, "corrupt database\n");
+  }
+  *flags = (unsigned)(length & ((1 << RECORD_FLAG_BITS) - 1));
+  length >>= RECORD_FLAG_BITS;
+  if (length > (uint64_t)(end - *p)) {
+    Die(0, "corrupt database\n");
+  }
+  ReplacePathSuffix(path, (size_t)shared, (const char*)*p, (size_t)length);
+  *p += length;
+  if (*flags & RecordFlagDirectory &&
+      (!ReadVarint(p, end, &m->inode) || !ReadVarint(p, end, &m->mtime) ||
+       !ReadVarint(p, end, &m->ctime))) {
+    Die(0, "corrupt database\n");
+  }
+}
+
+// The trigram index format, all integers little-endian:
+//
+//   header:    "LOCATETG", u32 version, u32 trigram count, u64 inode of the
+//              database, u64 path count of the database, u64 index offset of
+//              the database
+//   table:     (u32 trigram, u32 posting count, u64 postings offset), sorted by
+//              trigram
+//   postings:  for each trigram, the numbers of the blocks that contain it, as
+//              ascending deltas in varints
+//
+// A trigram is 3 consecutive bytes of a pathname, ASCII-folded to lower case,
+// packed into the low 24 bits of a u32. Pathnames contain no NUL, so no
+// trigram is 0. The index names blocks rather than pathnames, which keeps it
+// small; `SearchBlock` checks each pathname in a candidate block anyway.
+//
+// The header identifies the database it was built with, and a reader ignores
+// an index that does not match its database.
+static const char trigram_magic[8] = "LOCATETG";
+#define TRIGRAM_VERSION 1
+#define TRIGRAM_HEADER_SIZE 40
+#define TRIGRAM_ENTRY_SIZE 16
+
+static uint32_t Fold(uint32_t c) {
+  return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+static uint32_t GetTrigram(const char* s) {
+  const uint8_t* b = (const uint8_t*)s;
+  return Fold(b[0]) << 16 | Fold(b[1]) << 8 | Fold(b[2]);
+}
+
+// The blocks that contain a trigram, delta-encoded into `bytes`.
+typedef struct Posting {
+  uint32_t trigram;
+  uint32_t count;
+  uint32_t last;
+  size_t size;
+  size_t capacity;
+  uint8_t* bytes;
+} Posting;
+
+// An open-addressed hash table of `Posting`s, keyed by trigram (0 marks an
+// empty slot).
+typedef struct Trigrams {
+  size_t count;
+  size_t capacity;
+  Posting* values;
+} Trigrams;
+
+static void FreeTrigrams(Trigrams* t) {
+  for (size_t i = 0; i < t->capacity; i++) {
+    free(t->values[i].bytes);
+  }
+  free(t->values);
+}
+
+static size_t HashTrigram(uint32_t trigram, size_t capacity) {
+  return (size_t)((trigram * UINT32_C(2654435761)) & (capacity - 1));
+}
+
+static Posting* FindPosting(Trigrams* t, uint32_t trigram) {
+  if (t->count * 2 >= t->capacity) {
+    Trigrams grown = {.count = t->count,
+                      .capacity = t->capacity ? t->capacity * 2 : 4096};
+    grown.values = calloc(grown.capacity, sizeof(Posting));
+    if (!grown.values) {
+      Die(errno, "calloc");
+    }
+    for (size_t i = 0; i < t->capacity; i++) {
+      const Posting* p = &t->values[i];
+      if (!p->trigram) {
+        continue;
+      }
+      size_t j = HashTrigram(p->trigram, grown.capacity);
+      while (grown.values[j].trigram) {
+        j = (j + 1) & (grown.capacity - 1);
+      }
+      grown.values[j] = *p;
+    }
+    free(t->values);
+    *t = grown;
+  }
+
+  size_t i = HashTrigram(trigram, t->capacity);
+  while (t->values[i].trigram && t->values[i].trigram != trigram) {
+    i = (i + 1) & (t->capacity - 1);
+  }
+  if (!t->values[i].trigram) {
+    t->values[i].trigram = trigram;
+    t->count++;
+  }
+  return &t->values[i];
+}
+
+static void AppendPosting(Posting* p, uint32_t block) {
+  if (p->capacity - p->size < 10) {
+    p->capacity = p->capacity ? p->capacity * 2 : 16;
+    uint8_t* bytes = realloc(p->bytes, p->capacity);
+    if (!bytes) {
+      Die(errno, "realloc");
+    }
+    p->bytes = bytes;
+  }
+  p->size +=
+      EncodeVarint(&p->bytes[p->size], p->count ? block - p->last : block);
+  p->last = block;
+  p->count++;
+}
+
+static int CompareU32(const void* a, const void* b) {
+  const uint32_t x = *(const uint32_t*)a;
+  const uint32_t y = *(const uint32_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+typedef struct Writer {
+  FILE* output;
+  uint64_t position;
+  uint64_t count;
+  Path previous;
+  size_t block_count;
+  size_t block_capacity;
+  uint64_t* blocks;
+
+  // If building a trigram index, its postings, and the trigrams seen so far in
+  // the current block.
+  Trigrams* trigrams;
+  size_t block_trigram_count;
+  size_t block_trigram_capacity;
+  uint32_t* block_trigrams;
+} Writer;
+
+// Adds the distinct trigrams of the current block to the postings.
+static void EndBlock(Writer* w) {
+  if (!w->block_count) {
+    return;
+  }
+  uint32_t* ts = w->block_trigrams;
+  if (w->block_trigram_count) {
+    qsort(ts, w->block_trigram_count, sizeof(uint32_t), CompareU32);
+  }
+  const uint32_t block = (uint32_t)(w->block_count - 1);
+  for (size_t i = 0; i < w->block_trigram_count; i++) {
+    if (i == 0 || ts[i] != ts[i - 1]) {
+      AppendPosting(FindPosting(w->trigrams, ts[i]), block);
+    }
+  }
+  w->block_trigram_count = 0;
+}
+
+// Collects the trigrams of `pathname` that do not lie entirely within the
+// first `shared` bytes, which the previous pathname already contributed.
+static void AddTrigrams(Writer* w,
+                        const char* pathname,
+                        size_t length,
+                        size_t shared) {
+  if (length < 3) {
+    return;
+  }
+  size_t i = shared > 2 ? shared - 2 : 0;
+  const size_t needed = w->block_trigram_count + length - 2 - i;
+  if (needed > w->block_trigram_capacity) {
+    size_t c = w->block_trigram_capacity ? w->block_trigram_capacity : 4096;
+    while (c < needed) {
+      c *= 2;
+    }
+    uint32_t* ts = realloc(w->block_trigrams, c * sizeof(uint32_t));
+    if (!ts) {
+      Die(errno, "realloc");
+    }
+    w->block_trigrams = ts;
+    w->block_trigram_capacity = c;
+  }
+  for (; i + 3 <= length; i++) {
+    w->block_trigrams[w->block_trigram_count] = GetTrigram(&pathname[i]);
+    w->block_trigram_count++;
+  }
+}
+
+// Writes a record for `pathname`, with `flags`, and if it is a directory, `m`.
+static void WritePath(Writer* w,
+                      const char* pathname,
+                      size_t length,
+                      unsigned flags,
+                      const Metadata* m) {
+  size_t shared = 0;
+  if (w->count % BLOCK_SIZE == 0) {
+    if (w->trigrams) {
+      EndBlock(w);
+    }
+    if (w->block_count == w->block_capacity) {
+      w->block_capacity = w->block_capacity ? w->block_capacity * 2 : 1024;
+      uint64_t* blocks =
+          realloc(w->blocks, w->block_capacity * sizeof(uint64_t));
+      if (!blocks) {
+        Die(errno, "realloc");
+      }
+      w->blocks = blocks;
+    }
+    w->blocks[w->block_count] = w->position;
+    w->block_count++;
+  } else {
+    const Path* p = &w->previous;
+    while (shared < length && shared < p->count &&
+           p->values[shared] == pathname[shared]) {
+      shared++;
+    }
+  }
+
+  w->position += WriteVarint(w->output, shared);
+  w->position +=
+      WriteVarint(w->output, (length - shared) << RECORD_FLAG_BITS | flags);
+  WriteBytes(w->output, &pathname[shared], length - shared);
+  w->position += length - shared;
+  if (flags & RecordFlagDirectory) {
+    w->position += WriteVarint(w->output, m->inode);
+    w->position += WriteVarint(w->output, m->mtime);
+    w->position += WriteVarint(w->output, m->ctime);
+  }
+  w->count++;
+
+  if (w->trigrams) {
+    AddTrigrams(w, pathname, length, shared);
+  }
+  ReplacePathSuffix(&w->previous, shared, &pathname[shared], length - shared);
+}
+
+static int CompareEntries(const void* a, const void* b) {
+  const Entry* x = a;
+  const Entry* y = b;
+  return strcmp(x->name, y->name);
+}
+
+static int OpenDirectory(int parent, const char* name) {
+  return openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+// Reads the records of an old database in order.
+typedef struct Cursor {
+  const Database* db;
+  const uint8_t* p;
+  uint64_t remaining;
+  bool valid;
+  Path path;
+  unsigned flags;
+  Metadata metadata;
+} Cursor;
+
+static void FreeCursor(Cursor* c) {
+  FreePath(&c->path);
+}
+
+static void Advance(Cursor* c) {
+  c->valid = c->remaining > 0;
+  if (c->valid) {
+    ReadRecord(&c->p, c->db->index, &c->path, &c->flags, &c->metadata);
+    c->remaining--;
+  }
+}
+
+// Reports whether the current record of `c` is in the subtree of the
+// directory named by the first `length` bytes of `parent`, and if `child`, is
+// an entry of that directory.
+static bool IsUnder(const Cursor* c,
+                    const char* parent,
+                    size_t length,
+                    bool child) {
+  if (!c || !c->valid || c->flags & RecordFlagRoot) {
+    return false;
+  }
+  const Path* p = &c->path;
+  return p->count > length + 1 && p->values[length] == '/' &&
+         memcmp(p->values, parent, length) == 0 &&
+         !(child &&
+           memchr(&p->values[length + 1], '/', p->count - length - 1));
+}
+
+typedef struct Indexer {
+  Writer* writer;
+  bool all;
+  dev_t device;
+  // Directories changed at or after this time may change again within the
+  // resolution of their timestamps, so their `Metadata` is not trusted.
+  uint64_t recent;
+  // The old database, or NULL to read every directory.
+  Cursor* old;
+  Path skipped;
+} Indexer;
+
+// Moves the old database past its current record and that record's subtree.
+static void SkipEntry(Indexer* x) {
+  Cursor* c = x->old;
+  SetPath(&x->skipped, c->path.values);
+  Advance(c);
+  while (IsUnder(c, x->skipped.values, x->skipped.count, false)) {
+    Advance(c);
+  }
+}
+
+// Moves the old database past the entries of the directory named by the first
+// `length` bytes of `path` that sort before `path`, and reports whether the
+// next is `path` itself.
+static bool SeekEntry(Indexer* x, const Path* path, size_t length) {
+  Cursor* c = x->old;
+  while (IsUnder(c, path->values, length, true)) {
+    const int order = strcmp(c->path.values, path->values);
+    if (order >= 0) {
+      return order == 0;
+    }
+    SkipEntry(x);
+  }
+  return false;
+}
+
+static uint64_t Nanoseconds(struct timespec t) {
+  return (uint64_t)t.tv_sec * 1000000000 + (uint64_t)t.tv_nsec;
+}
+
+static Metadata GetMetadata(const Indexer* x, const struct stat* s) {
+  Metadata m = {.inode = (uint64_t)s->st_ino,
+                .mtime = Nanoseconds(s->st_mtim),
+                .ctime = Nanoseconds(s->st_ctim)};
+  if (m.ctime >= x->recent) {
+    m.ctime = 0;
+  }
+  return m;
+}
+
+static bool SameMetadata(const Metadata* a, const Metadata* b) {
+  return a->ctime && a->inode == b->inode && a->mtime == b->mtime &&
+         a->ctime == b->ctime;
+}
+
+static void IndexDirectory(Indexer* x, Path* path, int directory, bool same);
+
+// Writes the record for the entry of `directory` named by `path` (whose first
+// `length` bytes name `directory`), and the records of its subtree. If `old`,
+// the old database is at the entry's old record.
+static void IndexEntry(Indexer* x,
+                       Path* path,
+                       size_t length,
+                       int directory,
+                       bool is_directory,
+                       bool old) {
+  const bool was_directory = old && x->old->flags & RecordFlagDirectory;
+  const Metadata before = old ? x->old->metadata : (Metadata){0};
+  if (old) {
+    if (is_directory && was_directory) {
+      Advance(x->old);
+    } else {
+      SkipEntry(x);
+    }
+  }
+  Writer* w = x->writer;
+  if (!is_directory) {
+    WritePath(w, path->values, path->count, 0, NULL);
+    return;
+  }
+
+  // Directories that cannot be read, or that are on other devices, get records
+  // with unknown `Metadata`, so that the next update looks at them again.
+  const Metadata unknown = {0};
+  const int d = OpenDirectory(directory, &path->values[length + 1]);
+  if (d < 0) {
+    Warn(errno, "%s", path->values);
+    WritePath(w, path->values, path->count, RecordFlagDirectory, &unknown);
+  } else {
+    struct stat status;
+    if (fstat(d, &status) || status.st_dev != x->device) {
+      WritePath(w, path->values, path->count,
+                RecordFlagDirectory | RecordFlagHidden, &unknown);
+    } else {
+      const Metadata m = GetMetadata(x, &status);
+      WritePath(w, path->values, path->count, RecordFlagDirectory, &m);
+      IndexDirectory(x, path, d, was_directory && SameMetadata(&m, &before));
+    }
+    close(d);
+  }
+  if (x->old) {
+    while (IsUnder(x->old, path->values, path->count, false)) {
+      Advance(x->old);
+    }
+  }
+}
+
+// Writes the records under `directory` (named by `path`) in depth-first order,
+// with the entries of each directory sorted by name. Sorting makes for longer
+// shared prefixes, and so a smaller database.
+//
+// If there is an old database, it is at the first record under `directory`. If
+// `same`, `directory` has not changed since the old database was built, and so
+// its entries are copied from there rather than read again; its
+// subdirectories are still checked, though.
+static void IndexDirectory(Indexer* x, Path* path, int directory, bool same) {
+  Cursor* c = x->old;
+  if (same) {
+    while (IsUnder(c, path->values, path->count, true)) {
+      const bool is_directory = c->flags & RecordFlagDirectory;
+      const size_t length =
+          AppendPath(path, &c->path.values[path->count + 1],
+                     c->path.count - path->count - 1);
+      IndexEntry(x, path, length, directory, is_directory, true);
+      TruncatePath(path, length);
+    }
+    return;
+  }
+
+  AUTO(Entries, entries, (Entries){0}, FreeEntries);
+  const int e = ReadEntries(directory, &entries);
+  if (e) {
+    Warn(e, "%s", path->values);
+  }
+  qsort(entries.values, entries.count, sizeof(Entry), CompareEntries);
+
+  for (size_t i = 0; i < entries.count; i++) {
+    const Entry* entry = &entries.values[i];
+    if (entry->name[0] == '.' && !x->all) {
+      continue;
+    }
+    const size_t length = AppendPath(path, entry->name, entry->length);
+    const bool old = c && SeekEntry(x, path, length);
+    IndexEntry(x, path, length, directory, entry->type == DT_DIR, old);
+    TruncatePath(path, length);
+  }
+  while (IsUnder(c, path->values, path->count, true)) {
+    SkipEntry(x);
+  }
+}
+
+static int ComparePostings(const void* a, const void* b) {
+  return CompareU32(&((const Posting*)a)->trigram,
+                    &((const Posting*)b)->trigram);
+}
+
+// Writes the index of `t` for the database with inode `inode` and header
+// `header`.
+static void WriteTrigrams(FILE* output,
+                          Trigrams* t,
+                          uint64_t inode,
+                          const uint8_t header[static HEADER_SIZE]) {
+  // Compact the table in place, and sort it by trigram.
+  size_t count = 0;
+  for (size_t i = 0; i < t->capacity; i++) {
+    if (t->values[i].trigram) {
+      Posting p = t->values[i];
+      t->values[i] = t->values[count];
+      t->values[count] = p;
+      count++;
+    }
+  }
+  if (count) {
+    qsort(t->values, count, sizeof(Posting), ComparePostings);
+  }
+
+  uint8_t h[TRIGRAM_HEADER_SIZE];
+  memcpy(h, trigram_magic, sizeof(trigram_magic));
+  PutU32(&h[8], TRIGRAM_VERSION);
+  PutU32(&h[12], (uint32_t)count);
+  PutU64(&h[16], inode);
+  memcpy(&h[24], &header[16], 16);
+  WriteBytes(output, h, sizeof(h));
+
+  uint64_t offset = TRIGRAM_HEADER_SIZE + count * TRIGRAM_ENTRY_SIZE;
+  for (size_t i = 0; i < count; i++) {
+    const Posting* p = &t->values[i];
+    uint8_t entry[TRIGRAM_ENTRY_SIZE];
+    PutU32(&entry[0], p->trigram);
+    PutU32(&entry[4], p->count);
+    PutU64(&entry[8], offset);
+    WriteBytes(output, entry, sizeof(entry));
+    offset += p->size;
+  }
+  for (size_t i = 0; i < count; i++) {
+    WriteBytes(output, t->values[i].bytes, t->values[i].size);
+  }
+}
+
+typedef struct Temporary {
+  char* pathname;
+  int fd;
+  FILE* file;
+} Temporary;
+
+// Creates a temporary file in the same directory as `destination`, so that
+// `CommitTemporary` can `rename` it into place.
+static Temporary CreateTemporary(const char* destination) {
+  const size_t length = strlen(destination);
+  Temporary t = {.pathname = malloc(length + 8)};
+  if (!t.pathname) {
+    Die(errno, "malloc");
+  }
+  memcpy(t.pathname, destination, length);
+  memcpy(&t.pathname[length], ".XXXXXX", 8);
+  t.fd = mkstemp(t.pathname);
+  if (t.fd < 0) {
+    Die(errno, "%s", t.pathname);
+  }
+  t.file = fdopen(t.fd, "wb");
+  if (!t.file) {
+    Die(errno, "%s", t.pathname);
+  }
+  if (setvbuf(t.file, NULL, _IOFBF, 1 << 20)) {
+    Die(errno, "setvbuf");
+  }
+  return t;
+}
+
+// Readers that have the old file open or mapped keep it; new readers see only
+// the complete new one.
+static void CommitTemporary(Temporary* t, const char* destination) {
+  if (fflush(t->file) || fsync(t->fd)) {
+    Die(errno, "%s", t->pathname);
+  }
+  MustCloseFile(&t->file);
+  if (rename(t->pathname, destination)) {
+    Die(errno, "%s", destination);
+  }
+  free(t->pathname);
+}
+
+static char* IndexPathname(const char* database) {
+  const size_t size = strlen(database) + sizeof(".trigrams");
+  char* pathname = malloc(size);
+  if (!pathname) {
+    Die(errno, "malloc");
+  }
+  MustFormat(pathname, size, "%s.trigrams", database);
+  return pathname;
+}
+
+// Builds the database at `database` from the `count` `roots`.
+//
+// If `incremental` and there is an old database built the same way, reads only
+// the directories that have changed since, and copies the entries of the rest
+// from the old database. Roots are matched with the old database's in order.
+static void Build(const char* database,
+                  size_t count,
+                  char** roots,
+                  bool all,
+                  bool trigrams,
+                  bool incremental) {
+  AUTO(Database, old, (Database){0}, UnmapDatabase);
+  if (incremental && !TryMapDatabase(database, &old) &&
+      (bool)(old.flags & DatabaseFlagAll) != all) {
+    UnmapDatabase(&old);
+    old = (Database){0};
+  }
+  AUTO(Cursor, cursor, (Cursor){.db = &old}, FreeCursor);
+  if (old.data) {
+    (void)posix_madvise((void*)(uintptr_t)old.data, old.size,
+                        POSIX_MADV_SEQUENTIAL);
+    cursor.p = &old.data[HEADER_SIZE];
+    cursor.remaining = old.count;
+    Advance(&cursor);
+  }
+
+  Temporary t = CreateTemporary(database);
+  FILE* output = t.file;
+  uint8_t header[HEADER_SIZE] = {0};
+  WriteBytes(output, header, sizeof(header));
+
+  AUTO(Trigrams, index, (Trigrams){0}, FreeTrigrams);
+  Writer w = {.output = output,
+              .position = HEADER_SIZE,
+              .trigrams = trigrams ? &index : NULL};
+  Indexer x = {
+      .writer = &w,
+      .all = all,
+      .recent = (uint64_t)GetEpochNanoseconds() - 1000000000,
+      .old = old.data ? &cursor : NULL,
+  };
+  AUTO(Path, path, (Path){0}, FreePath);
+  struct stat status;
+  for (size_t i = 0; i < count; i++) {
+    const int d = open(roots[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (d < 0 || fstat(d, &status)) {
+      Warn(errno, "%s", roots[i]);
+      if (d >= 0) {
+        close(d);
+      }
+      continue;
+    }
+    SetPath(&path, roots[i]);
+    x.device = status.st_dev;
+    const Metadata m = GetMetadata(&x, &status);
+    bool same = false;
+    if (x.old) {
+      while (cursor.valid && !(cursor.flags & RecordFlagRoot)) {
+        Advance(&cursor);
+      }
+      if (cursor.valid && StringEquals(cursor.path.values, roots[i])) {
+        same = SameMetadata(&m, &cursor.metadata);
+        Advance(&cursor);
+      }
+    }
+    WritePath(&w, path.values, path.count,
+              RecordFlagDirectory | RecordFlagHidden | RecordFlagRoot, &m);
+    IndexDirectory(&x, &path, d, same);
+    close(d);
+  }
+  FreePath(&x.skipped);
+  if (w.trigrams) {
+    EndBlock(&w);
+  }
+
+  const uint64_t block_index = w.position;
+  for (size_t i = 0; i < w.block_count; i++) {
+    uint8_t offset[8];
+    PutU64(offset, w.blocks[i]);
+    WriteBytes(output, offset, sizeof(offset));
+  }
+  memcpy(header, magic, sizeof(magic));
+  PutU32(&header[8], VERSION);
+  PutU32(&header[12], BLOCK_SIZE);
+  PutU64(&header[16], w.count);
+  PutU64(&header[24], block_index);
+  PutU32(&header[32], all ? DatabaseFlagAll : 0);
+  if (fseek(output, 0, SEEK_SET)) {
+    Die(errno, "%s", t.pathname);
+  }
+  WriteBytes(output, header, sizeof(header));
+  free(w.blocks);
+  FreePath(&w.previous);
+  free(w.block_trigrams);
+
+  // Replace the index first, so that it is never newer than the database. A
+  // reader that sees a mismatched pair ignores the index.
+  AUTO(char*, index_pathname, IndexPathname(database), FreeChar);
+  if (trigrams) {
+    if (fstat(t.fd, &status)) {
+      Die(errno, "%s", t.pathname);
+    }
+    Temporary it = CreateTemporary(index_pathname);
+    WriteTrigrams(it.file, &index, (uint64_t)status.st_ino, header);
+    CommitTemporary(&it, index_pathname);
+  } else if (unlink(index_pathname) && errno != ENOENT) {
+    Warn(errno, "%s", index_pathname);
+  }
+  CommitTemporary(&t, database);
+}
+
+typedef struct TrigramIndex {
+  const uint8_t* data;
+  size_t size;
+  uint32_t count;
+} TrigramIndex;
+
+static void UnmapTrigrams(TrigramIndex* t) {
+  if (t->data) {
+    munmap((void*)(uintptr_t)t->data, t->size);
+  }
+}
+
+// Maps the index at `pathname`, if there is one and it was built with `db`.
+// Otherwise, returns an empty index.
+static TrigramIndex MapTrigrams(const char* pathname, const Database* db) {
+  TrigramIndex t = {0};
+  const int fd = open(pathname, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      Warn(errno, "%s", pathname);
+    }
+    return t;
+  }
+  struct stat status;
+  if (fstat(fd, &status) || status.st_size < TRIGRAM_HEADER_SIZE) {
+    close(fd);
+    return t;
+  }
+  void* data =
+      mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    Warn(errno, "%s", pathname);
+    return t;
+  }
+  t.data = data;
+  t.size = (size_t)status.st_size;
+
+  const uint8_t* h = t.data;
+  t.count = GetU32(&h[12]);
+  if (memcmp(h, trigram_magic, sizeof(trigram_magic)) ||
+      GetU32(&h[8]) != TRIGRAM_VERSION || GetU64(&h[16]) != db->inode ||
+      memcmp(&h[24], &db->data[16], 16) ||
+      (t.size - TRIGRAM_HEADER_SIZE) / TRIGRAM_ENTRY_SIZE < t.count) {
+    UnmapTrigrams(&t);
+    return (TrigramIndex){0};
+  }
+  return t;
+}
+
+// A vector of block numbers or trigrams.
+typedef struct U32s {
+  size_t count;
+  size_t capacity;
+  uint32_t* values;
+} U32s;
+
+static void AppendU32(U32s* v, uint32_t n) {
+  if (v->count == v->capacity) {
+    v->capacity = v->capacity ? v->capacity * 2 : 64;
+    uint32_t* values = realloc(v->values, v->capacity * sizeof(uint32_t));
+    if (!values) {
+      Die(errno, "realloc");
+    }
+    v->values = values;
+  }
+  v->values[v->count] = n;
+  v->count++;
+}
+
+static void FreeU32s(U32s* v) {
+  free(v->values);
+}
+
+// Returns the position of `trigram` in the table of `t`, or `SIZE_MAX`.
+static size_t FindTrigram(const TrigramIndex* t, uint32_t trigram) {
+  const uint8_t* table = &t->data[TRIGRAM_HEADER_SIZE];
+  size_t lo = 0;
+  size_t hi = t->count;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const uint32_t m = GetU32(&table[mid * TRIGRAM_ENTRY_SIZE]);
+    if (m == trigram) {
+      return mid;
+    } else if (m < trigram) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return SIZE_MAX;
+}
+
+static uint32_t PostingCount(const TrigramIndex* t, size_t i) {
+  return GetU32(&t->data[TRIGRAM_HEADER_SIZE + i * TRIGRAM_ENTRY_SIZE + 4]);
+}
+
+// Replaces the contents of `result` with the blocks in posting `i` of `t`.
+static void DecodePosting(const TrigramIndex* t, size_t i, U32s* result) {
+  const uint8_t* entry = &t->data[TRIGRAM_HEADER_SIZE + i * TRIGRAM_ENTRY_SIZE];
+  const uint32_t count = GetU32(&entry[4]);
+  const uint64_t offset = GetU64(&entry[8]);
+  if (offset > t->size) {
+    Die(0, "corrupt trigram index\n");
+  }
+  const uint8_t* p = &t->data[offset];
+  const uint8_t* end = &t->data[t->size];
+  result->count = 0;
+  uint64_t block = 0;
+  for (uint32_t j = 0; j < count; j++) {
+    uint64_t delta;
+    if (!ReadVarint(&p, end, &delta) || delta > UINT32_MAX - block) {
+      Die(0, "corrupt trigram index\n");
+    }
+    block += delta;
+    AppendU32(result, (uint32_t)block);
+  }
+}
+
+static void AppendTrigrams(U32s* result, const char* run, size_t length) {
+  for (size_t i = 0; i + 3 <= length; i++) {
+    AppendU32(result, GetTrigram(&run[i]));
+  }
+}
+
+// Returns the position just past the bracket expression at `pattern[i]`.
+static size_t SkipBracket(const char* pattern, size_t i) {
+  i++;
+  if (pattern[i] == '^') {
+    i++;
+  }
+  if (pattern[i] == ']') {
+    i++;
+  }
+  while (pattern[i] && pattern[i] != ']') {
+    const char c = pattern[i + 1];
+    if (pattern[i] == '[' && (c == ':' || c == '.' || c == '=')) {
+      for (i += 2; pattern[i] && !(pattern[i] == c && pattern[i + 1] == ']');
+           i++) {
+      }
+      i += pattern[i] ? 2 : 0;
+    } else {
+      i++;
+    }
+  }
+  return pattern[i] ? i + 1 : i;
+}
+
+// Returns the position just past the group at `pattern[i]`.
+static size_t SkipGroup(const char* pattern, size_t i) {
+  size_t depth = 0;
+  while (pattern[i]) {
+    switch (pattern[i]) {
+      case '\\':
+        i += pattern[i + 1] ? 2 : 1;
+        continue;
+      case '[':
+        i = SkipBracket(pattern, i);
+        continue;
+      case '(':
+        depth++;
+        break;
+      case ')':
+        depth--;
+        if (!depth) {
+          return i + 1;
+        }
+        break;
+    }
+    i++;
+  }
+  return i;
+}
+
+// Appends to `result` trigrams that any string matching the extended regular
+// expression `pattern` must contain. This finds runs of plain characters at the
+// top level and takes no chances with anything else: it skips groups, bracket
+// expressions, and optional characters, and gives up on alternation. Returns
+// false if it found no trigrams.
+static bool RegexTrigrams(const char* pattern, U32s* result) {
+  const size_t start = result->count;
+  AUTO(char*, run, malloc(strlen(pattern) + 1), FreeChar);
+  if (!run) {
+    Die(errno, "malloc");
+  }
+  size_t length = 0;
+  size_t i = 0;
+  while (pattern[i]) {
+    char c = pattern[i];
+    bool literal = false;
+    switch (c) {
+      case '|':
+        result->count = start;
+        return false;
+      case '\\':
+        // Only an escaped metacharacter is plain; others, like `\<` and `\b`,
+        // are anchors or classes in some libcs.
+        if (pattern[i + 1] && strchr(".[]()*+?{}|^$\\", pattern[i + 1])) {
+          c = pattern[i + 1];
+          literal = true;
+        }
+        i += pattern[i + 1] ? 2 : 1;
+        break;
+      case '[':
+        i = SkipBracket(pattern, i);
+        break;
+      case '(':
+        i = SkipGroup(pattern, i);
+        break;
+      case '{':
+        while (pattern[i] && pattern[i] != '}') {
+          i++;
+        }
+        i += pattern[i] ? 1 : 0;
+        break;
+      case '.':
+      case '^':
+      case '$':
+      case '*':
+      case '+':
+      case '?':
+      case ')':
+        i++;
+        break;
+      default:
+        literal = true;
+        i++;
+    }
+
+    const char next = pattern[i];
+    if (literal && next != '*' && next != '?' && next != '{') {
+      run[length] = c;
+      length++;
+      if (next != '+') {
+        continue;
+      }
+    }
+    AppendTrigrams(result, run, length);
+    length = 0;
+  }
+  AppendTrigrams(result, run, length);
+  return result->count > start;
+}
+
+typedef uint8_t Bytes16 __attribute__((vector_size(16)));
+
+// A substring to search for. If `fold`, `bytes` has been lower-cased, and
+// matching ignores ASCII case.
+typedef struct Needle {
+  const uint8_t* bytes;
+  size_t length;
+  bool fold;
+  Bytes16 first;
+  Bytes16 last;
+} Needle;
+
+static bool EqualAt(const uint8_t* haystack, const Needle* n) {
+  if (!n->fold) {
+    return memcmp(haystack, n->bytes, n->length) == 0;
+  }
+  for (size_t i = 0; i < n->length; i++) {
+    if (Fold(haystack[i]) != n->bytes[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reports whether `n` occurs in the `count` bytes of `haystack`. It compares
+// 16 positions at a time against the needle's first and last bytes, and
+// checks the whole needle only where both match. (When folding, setting bit
+// 0x20 lower-cases letters; it can make other bytes alias, but those are
+// weeded out by `EqualAt`.)
+static bool Contains(const uint8_t* haystack, size_t count, const Needle* n) {
+  if (n->length == 0) {
+    return true;
+  } else if (n->length > count) {
+    return false;
+  }
+  const size_t last = n->length - 1;
+  const Bytes16 fold = n->fold ? (Bytes16){0} + 0x20 : (Bytes16){0};
+  size_t i = 0;
+  for (; i + last + sizeof(Bytes16) <= count; i += sizeof(Bytes16)) {
+    Bytes16 a;
+    Bytes16 b;
+    memcpy(&a, &haystack[i], sizeof(a));
+    memcpy(&b, &haystack[i + last], sizeof(b));
+    const Bytes16 candidates =
+        (Bytes16)((a | fold) == n->first) & (Bytes16)((b | fold) == n->last);
+    uint64_t halves[2];
+    memcpy(halves, &candidates, sizeof(halves));
+    if (!(halves[0] | halves[1])) {
+      continue;
+    }
+    for (size_t j = 0; j < sizeof(Bytes16); j++) {
+      if (candidates[j] && EqualAt(&haystack[i + j], n)) {
+        return true;
+      }
+    }
+  }
+  for (; i + n->length <= count; i++) {
+    if (EqualAt(&haystack[i], n)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static Needle NewNeedle(const char* pattern, bool fold) {
+  const size_t length = strlen(pattern);
+  uint8_t* bytes = malloc(length + 1);
+  if (!bytes) {
+    Die(errno, "malloc");
+  }
+  for (size_t i = 0; i <= length; i++) {
+    const uint8_t c = (uint8_t)pattern[i];
+    bytes[i] = fold ? (uint8_t)Fold(c) : c;
+  }
+  Needle n = {.bytes = bytes, .length = length, .fold = fold};
+  if (length) {
+    // With folding, `Contains` ORs 0x20 into the haystack; do the same here so
+    // that non-letters compare equal to themselves.
+    const uint8_t f = fold ? 0x20 : 0;
+    n.first = (Bytes16){0} + (uint8_t)(bytes[0] | f);
+    n.last = (Bytes16){0} + (uint8_t)(bytes[length - 1] | f);
+  }
+  return n;
+}
+
+typedef struct Query {
+  size_t count;
+  bool regex;
+  Needle* needles;
+  Regex* regexes;
+} Query;
+
+static bool Matches(const Query* q, const char* pathname, size_t length) {
+  for (size_t i = 0; i < q->count; i++) {
+    if (q->regex ? MatchRegex(&q->regexes[i], pathname)
+                 : Contains((const uint8_t*)pathname, length, &q->needles[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+typedef struct Search {
+  const Database* db;
+  const Query* query;
+  char ors;
+  // If not `NULL`, the only blocks that can hold matches.
+  const U32s* candidates;
+  size_t chunk_count;
+  atomic_size_t next;
+  // The matches from each chunk, to be printed in order.
+  Chars* results;
+} Search;
+
+static void AppendResult(Chars* r, size_t* capacity, const char* s, size_t n) {
+  if (*capacity - r->count < n) {
+    size_t c = *capacity ? *capacity : 4096;
+    while (c - r->count < n) {
+      c *= 2;
+    }
+    char* values = realloc(r->values, c);
+    if (!values) {
+      Die(errno, "realloc");
+    }
+    r->values = values;
+    *capacity = c;
+  }
+  memcpy(&r->values[r->count], s, n);
+  r->count += n;
+}
+
+static void SearchBlock(const Search* s,
+                        uint64_t block,
+                        Path* path,
+                        Chars* result,
+                        size_t* capacity) {
+  const Database* db = s->db;
+  const uint8_t* p = &db->data[GetU64(&db->index[block * 8])];
+  const uint8_t* end = db->index;
+  const uint64_t first = block * BLOCK_SIZE;
+  const uint64_t count =
+      db->count - first < BLOCK_SIZE ? db->count - first : BLOCK_SIZE;
+  if (p < db->data + HEADER_SIZE || p > end) {
+    Die(0, "corrupt database\n");
+  }
+
+  for (uint64_t i = 0; i < count; i++) {
+    unsigned flags;
+    Metadata m;
+    ReadRecord(&p, end, path, &flags, &m);
+    if (!(flags & RecordFlagHidden) &&
+        Matches(s->query, path->values, path->count)) {
+      AppendResult(result, capacity, path->values, path->count);
+      AppendResult(result, capacity, &s->ors, 1);
+    }
+  }
+}
+
+static void* RunSearch(void* context) {
+  Search* s = context;
+  AUTO(Path, path, (Path){0}, FreePath);
+  while (true) {
+    const size_t chunk = atomic_fetch_add(&s->next, 1);
+    if (chunk >= s->chunk_count) {
+      return NULL;
+    }
+    Chars* result = &s->results[chunk];
+    size_t capacity = 0;
+    const uint64_t start = (uint64_t)chunk * CHUNK_SIZE;
+    const uint64_t end =
+        s->candidates ? s->candidates->count : s->db->block_count;
+    for (uint64_t b = start; b < end && b < start + CHUNK_SIZE; b++) {
+      SearchBlock(s, s->candidates ? s->candidates->values[b] : b, &path,
+                  result, &capacity);
+    }
+  }
+}
+
+static void SearchDatabase(const Database* db,
+                           const Query* q,
+                           const U32s* candidates,
+                           size_t thread_count,
+                           char ors) {
+  const uint64_t blocks = candidates ? candidates->count : db->block_count;
+  Search s = {
+      .db = db,
+      .query = q,
+      .ors = ors,
+      .candidates = candidates,
+      .chunk_count = (size_t)((blocks + CHUNK_SIZE - 1) / CHUNK_SIZE),
+  };
+  s.results = calloc(s.chunk_count ? s.chunk_count : 1, sizeof(Chars));
+  if (!s.results) {
+    Die(errno, "calloc");
+  }
+
+  if (thread_count > s.chunk_count) {
+    thread_count = s.chunk_count ? s.chunk_count : 1;
+  }
+  AUTO(char*, threads, calloc(thread_count, sizeof(pthread_t)), FreeChar);
+  pthread_t* ts = (pthread_t*)(void*)threads;
+  size_t started = 0;
+  for (size_t i = 1; i < thread_count; i++) {
+    const int e = pthread_create(&ts[i], NULL, RunSearch, &s);
+    if (e) {
+      Warn(e, "pthread_create");
+      break;
+    }
+    started++;
+  }
+  RunSearch(&s);
+  for (size_t i = 1; i <= started; i++) {
+    pthread_join(ts[i], NULL);
+  }
+
+  for (size_t i = 0; i < s.chunk_count; i++) {
+    Chars* r = &s.results[i];
+    if (r->count && fwrite(r->values, 1, r->count, stdout) != r->count) {
+      Die(errno, "fwrite");
+    }
+    free(r->values);
+  }
+  free(s.results);
+}
+
+static int CompareU64(const void* a, const void* b) {
+  const uint64_t x = *(const uint64_t*)a;
+  const uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Removes from sorted `a` the blocks that are not in sorted `b`.
+static void Intersect(U32s* a, const U32s* b) {
+  size_t count = 0;
+  for (size_t i = 0, j = 0; i < a->count && j < b->count;) {
+    if (a->values[i] < b->values[j]) {
+      i++;
+    } else if (a->values[i] > b->values[j]) {
+      j++;
+    } else {
+      a->values[count] = a->values[i];
+      count++;
+      i++;
+      j++;
+    }
+  }
+  a->count = count;
+}
+
+// Finds, using `t`, the blocks of `db` that can hold pathnames matching any of
+// the `patterns`, in ascending order. Returns false if the index cannot narrow
+// the search; i.e. if there is no index, or if any pattern yields no trigrams.
+static bool FindCandidates(const TrigramIndex* t,
+                           const Database* db,
+                           size_t count,
+                           char** patterns,
+                           bool regex,
+                           U32s* result) {
+  if (!t->data) {
+    return false;
+  }
+  AUTO(U32s, trigrams, (U32s){0}, FreeU32s);
+  AUTO(U32s, blocks, (U32s){0}, FreeU32s);
+  AUTO(U32s, posting, (U32s){0}, FreeU32s);
+  for (size_t i = 0; i < count; i++) {
+    trigrams.count = 0;
+    if (regex) {
+      if (!RegexTrigrams(patterns[i], &trigrams)) {
+        return false;
+      }
+    } else {
+      AppendTrigrams(&trigrams, patterns[i], strlen(patterns[i]));
+      if (!trigrams.count) {
+        return false;
+      }
+    }
+
+    // Intersect the postings shortest first, so that the intermediate results
+    // are as small as they can be. Each key is (posting count, table position).
+    AUTO(char*, buffer, calloc(trigrams.count, sizeof(uint64_t)), FreeChar);
+    uint64_t* keys = (uint64_t*)(void*)buffer;
+    if (!keys) {
+      Die(errno, "calloc");
+    }
+    bool absent = false;
+    for (size_t j = 0; j < trigrams.count && !absent; j++) {
+      const size_t position = FindTrigram(t, trigrams.values[j]);
+      absent = position == SIZE_MAX;
+      keys[j] =
+          absent ? 0 : (uint64_t)PostingCount(t, position) << 32 | position;
+    }
+    if (absent) {
+      continue;
+    }
+    qsort(keys, trigrams.count, sizeof(uint64_t), CompareU64);
+
+    DecodePosting(t, (size_t)(keys[0] & UINT32_MAX), &blocks);
+    for (size_t j = 1; j < trigrams.count && blocks.count; j++) {
+      if (keys[j] != keys[j - 1]) {
+        DecodePosting(t, (size_t)(keys[j] & UINT32_MAX), &posting);
+        Intersect(&blocks, &posting);
+      }
+    }
+    for (size_t j = 0; j < blocks.count; j++) {
+      AppendU32(result, blocks.values[j]);
+    }
+  }
+
+  if (result->count) {
+    qsort(result->values, result->count, sizeof(uint32_t), CompareU32);
+  }
+  size_t unique = 0;
+  for (size_t i = 0; i < result->count; i++) {
+    if (result->values[i] >= db->block_count) {
+      Die(0, "corrupt trigram index\n");
+    }
+    if (i == 0 || result->values[i] != result->values[i - 1]) {
+      result->values[unique] = result->values[i];
+      unique++;
+    }
+  }
+  result->count = unique;
+  return true;
+}
+
+static Query BuildQuery(size_t count, char** patterns, bool regex, bool fold) {
+  Query q = {.count = count, .regex = regex};
+  if (regex) {
+    q.regexes = calloc(count, sizeof(Regex));
+    if (!q.regexes) {
+      Die(errno, "calloc");
+    }
+    const int flags = REG_EXTENDED | REG_NOSUB | (fold ? REG_ICASE : 0);
+    for (size_t i = 0; i < count; i++) {
+      Regex* r = &q.regexes[i];
+      *r = CompileRegex(patterns[i], flags);
+      if (r->error) {
+        PrintRegexError(r->error, &r->value);
+        exit(EXIT_FAILURE);
+      }
+    }
+  } else {
+    q.needles = calloc(count, sizeof(Needle));
+    if (!q.needles) {
+      Die(errno, "calloc");
+    }
+    for (size_t i = 0; i < count; i++) {
+      q.needles[i] = NewNeedle(patterns[i], fold);
+    }
+  }
+  return q;
+}
+
+static void FreeQuery(Query* q) {
+  for (size_t i = 0; i < q->count; i++) {
+    if (q->regex) {
+      FreeRegex(&q->regexes[i]);
+    } else {
+      free((void*)(uintptr_t)q->needles[i].bytes);
+    }
+  }
+  free(q->regexes);
+  free(q->needles);
+}
+
+int main(int count, char** arguments) {
+  const long n = sysconf(_SC_NPROCESSORS_ONLN);
+  FindOptionValue(cli.options, 'j')->z = n > 0 ? (size_t)n : 1;
+
+  Arguments as = ParseCLI(&cli, count, arguments);
+  if (OVB('h')) {
+    PrintHelpAndExit(&cli, false, true);
+  }
+
+  char* home = getenv("HOME");
+  if (!home) {
+    Die(0, "HOME is not set\n");
+  }
+  AUTO(char*, default_database, NULL, FreeChar);
+  const char* database = OVS('d');
+  if (!OVB('d')) {
+    const size_t size = strlen(home) + sizeof("/.locate.db");
+    default_database = malloc(size);
+    if (!default_database) {
+      Die(errno, "malloc");
+    }
+    MustFormat(default_database, size, "%s/.locate.db", home);
+    database = default_database;
+  }
+
+  if (OVB('u')) {
+    if (as.count) {
+      Build(database, as.count, as.values, OVB('A'), OVB('t'), !OVB('f'));
+    } else {
+      Build(database, 1, &home, OVB('A'), OVB('t'), !OVB('f'));
+    }
+    return 0;
+  }
+
+  if (as.count == 0) {
+    PrintHelpAndExit(&cli, true, false);
+  }
+  if (access(database, F_OK)) {
+    Build(database, 1, &home, OVB('A'), false, false);
+  }
+  AUTO(Query, query, BuildQuery(as.count, as.values, OVB('r'), OVB('i')),
+       FreeQuery);
+  AUTO(Database, db, MapDatabase(database), UnmapDatabase);
+  AUTO(char*, index_pathname, IndexPathname(database), FreeChar);
+  AUTO(TrigramIndex, index, MapTrigrams(index_pathname, &db), UnmapTrigrams);
+  AUTO(U32s, candidates, (U32s){0}, FreeU32s);
+  const bool indexed = FindCandidates(&index, &db, as.count, as.values,
+                                      OVB('r'), &candidates);
+  const size_t threads = OVZ('j') ? OVZ('j') : 1;
+  SearchDatabase(&db, &query, indexed ? &candidates : NULL, threads,
+                 OVB('0') ? '\0' : '\n');
+}
@@ -0,0 +1,171 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cli.h"
+#include "testing.h"
+#include "utils.h"
+
+// clang-format off
+static char description[] =
+"check that `locate -t` finds what `locate` does\n"
+"\n"
+"    locate_test [options...] [pattern...]\n"
+"\n"
+"Builds a small temporary tree, and 2 databases of it, 1 with a trigram index (-t) and 1 without. Then searches both for each pattern (default: a built-in set), as a regular expression, and exits with an error if the results ever differ, or if `\\<hel` does not find lt/t/c/hello-world. Then removes the tree and the databases.";
+
+static Option options[] = {
+  {
+    .flag = 'h',
+    .description = "print help message",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'l',
+    .description = "run this `locate` executable",
+    .value = { .type = OptionTypeString, .s = "./locate" }
+  },
+};
+
+static CLI cli = {
+  .name = "locate_test",
+  .description = description,
+  .options = {.count = COUNT(options), .values = options},
+};
+// clang-format on
+
+static char* default_patterns[] = {
+    "\\<hel",
+    "lo\\>",
+    "\\bworld",
+    "\\Bllo",
+    "\\`/",
+    "world\\'",
+    "a\\.b",
+    "x\\(y\\)",
+    "hel+o",
+    "hello|help",
+    "c/hello",
+    "(say)-hel",
+    "[ab]\\.b",
+    "lt/t/x\\(",
+    "^/.*/help$",
+};
+
+// Relative to the root, parents before children.
+static const char* directories[] = {"lt", "lt/t", "lt/t/c"};
+static const char* files[] = {"lt/t/c/hello-world", "lt/t/c/say-hello",
+                              "lt/t/a.b", "lt/t/x(y)", "lt/t/help"};
+
+static void BuildTree(const char* root) {
+  const int directory = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory < 0) {
+    Die(errno, "%s", root);
+  }
+  for (size_t i = 0; i < COUNT(directories); i++) {
+    if (mkdirat(directory, directories[i], 0755)) {
+      Die(errno, "%s", directories[i]);
+    }
+  }
+  for (size_t i = 0; i < COUNT(files); i++) {
+    CreateFile(directory, files[i]);
+  }
+  close(directory);
+}
+
+static void RemoveTree(const char* root) {
+  const int directory = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory < 0) {
+    Die(errno, "%s", root);
+  }
+  for (size_t i = 0; i < COUNT(files); i++) {
+    if (unlinkat(directory, files[i], 0)) {
+      Die(errno, "%s", files[i]);
+    }
+  }
+  for (size_t i = COUNT(directories); i > 0; i--) {
+    if (unlinkat(directory, directories[i - 1], AT_REMOVEDIR)) {
+      Die(errno, "%s", directories[i - 1]);
+    }
+  }
+  close(directory);
+  if (rmdir(root)) {
+    Die(errno, "%s", root);
+  }
+}
+
+static void FreeOutput(char** output) {
+  free(*output);
+}
+
+int main(int count, char** arguments) {
+  Arguments as = ParseCLI(&cli, count, arguments);
+  if (FindOptionValue(cli.options, 'h')->b) {
+    PrintHelpAndExit(&cli, false, true);
+  }
+  if (!as.count) {
+    as.count = COUNT(default_patterns);
+    as.values = default_patterns;
+  }
+  char* locate = FindOptionValue(cli.options, 'l')->s;
+
+  char root[] = "/tmp/locate_test.XXXXXX";
+  if (!mkdtemp(root)) {
+    Die(errno, "mkdtemp");
+  }
+  BuildTree(root);
+  char plain[sizeof(root) + 16];
+  char indexed[sizeof(root) + 16];
+  char trigrams[sizeof(root) + 32];
+  MustFormat(plain, sizeof(plain), "%s.db", root);
+  MustFormat(indexed, sizeof(indexed), "%s.t.db", root);
+  MustFormat(trigrams, sizeof(trigrams), "%s.trigrams", indexed);
+
+  bool ok = true;
+  char* update[] = {locate, "-u", "-d", plain, root, NULL};
+  free(ReadProgram(update, NULL, &ok));
+  char* update_t[] = {locate, "-u", "-t", "-d", indexed, root, NULL};
+  free(ReadProgram(update_t, NULL, &ok));
+  if (!ok) {
+    MustPrintf(stderr, "FAILED: %s -u did not exit successfully\n", locate);
+  }
+
+  for (size_t i = 0; ok && i < as.count; i++) {
+    char* search[] = {locate, "-r", "-d", plain, as.values[i], NULL};
+    AUTO(char*, expected, ReadProgram(search, NULL, &ok), FreeOutput);
+    char* search_t[] = {locate, "-r", "-d", indexed, as.values[i], NULL};
+    AUTO(char*, actual, ReadProgram(search_t, NULL, &ok), FreeOutput);
+    if (!ok) {
+      MustPrintf(stderr, "FAILED: /%s/: %s did not exit successfully\n",
+                 as.values[i], locate);
+    } else if (strcmp(expected, actual)) {
+      MustPrintf(stderr, "FAILED: /%s/: expected\n%sgot\n%s", as.values[i],
+                 expected, actual);
+      ok = false;
+    } else if (!strcmp(as.values[i], "\\<hel") &&
+               !strstr(actual, "/lt/t/c/hello-world\n")) {
+      MustPrintf(stderr, "FAILED: /%s/ did not find lt/t/c/hello-world\n",
+                 as.values[i]);
+      ok = false;
+    }
+  }
+
+  RemoveTree(root);
+  if (unlink(plain) || unlink(indexed) || unlink(trigrams)) {
+    Die(errno, "unlink");
+  }
+  if (!ok) {
+    return EXIT_FAILURE;
+  }
+  MustPrintf(stdout, "%zu patterns: OK\n", as.count);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+#include "mounts.h"
+#include "utils.h"
+
+static int CompareStrings(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+#ifdef __linux__
+// Undoes the octal escapes (like \040 for space) of a mountinfo field, in
+// place.
+static void Unescape(char* s) {
+  char* out = s;
+  for (const char* in = s; *in; out++) {
+    if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] >= '0' &&
+        in[2] <= '7' && in[3] >= '0' && in[3] <= '7') {
+      *out =
+          (char)(((in[1] - '0') << 6) | ((in[2] - '0') << 3) | (in[3] - '0'));
+      in += 4;
+    } else {
+      *out = *in;
+      in++;
+    }
+  }
+  *out = '\0';
+}
+
+// Splits off the next space-separated field of `*line`.
+static char* NextField(char** line) {
+  return strsep(line, " ");
+}
+#endif
+
+int FindMountPoints(const char* root, dev_t device, MountPoints* result) {
+  *result = (MountPoints){0};
+#ifdef __linux__
+  char real[PATH_MAX];
+  if (!realpath(root, real)) {
+    return errno;
+  }
+  // Mount points beneath `real` start with `prefix`.
+  const size_t real_length = strlen(real);
+  const size_t prefix = real_length == 1 ? 1 : real_length + 1;
+  AUTO(FILE*, table, fopen("/proc/self/mountinfo", "re"), CloseFile);
+  if (!table) {
+    return errno;
+  }
+
+  const size_t root_length = strlen(root);
+  size_t capacity = 0;
+  AUTO(char*, line, NULL, FreeChar);
+  size_t line_capacity = 0;
+  while (getline(&line, &line_capacity, table) > 0) {
+    // ID, parent ID, major:minor, root, mount point, ...
+    char* rest = line;
+    NextField(&rest);
+    NextField(&rest);
+    const char* numbers = NextField(&rest);
+    NextField(&rest);
+    char* point = NextField(&rest);
+    unsigned major;
+    unsigned minor;
+    if (!point || sscanf(numbers, "%u:%u", &major, &minor) != 2 ||
+        makedev(major, minor) == device) {
+      continue;
+    }
+    Unescape(point);
+    const size_t length = strlen(point);
+    if (length <= prefix || memcmp(point, real, prefix - 1) ||
+        point[prefix - 1] != '/') {
+      continue;
+    }
+
+    if (result->count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      char** values = realloc(result->values, capacity * sizeof(char*));
+      if (!values) {
+        Die(errno, "realloc");
+      }
+      result->values = values;
+    }
+    // The walk names it `root`, '/', and the rest.
+    char* name = malloc(root_length + 1 + length - prefix + 1);
+    if (!name) {
+      Die(errno, "malloc");
+    }
+    memcpy(name, root, root_length);
+    name[root_length] = '/';
+    memcpy(&name[root_length + 1], &point[prefix], length - prefix + 1);
+    result->values[result->count] = name;
+    result->count++;
+  }
+  if (result->count) {
+    qsort(result->values, result->count, sizeof(char*), CompareStrings);
+  }
+  return 0;
+#else
+  (void)root;
+  (void)device;
+  return ENOTSUP;
+#endif
+}
+
+bool HasMountPoints(const MountPoints* m, const char* pathname, size_t length) {
+  // Find the first that sorts after `pathname` and '/'.
+  size_t low = 0;
+  size_t high = m->count;
+  while (low < high) {
+    const size_t middle = low + (high - low) / 2;
+    const char* v = m->values[middle];
+    const int c = strncmp(v, pathname, length);
+    if (c < 0 || (c == 0 && (unsigned char)v[length] < '/')) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  for (size_t i = low; i < m->count; i++) {
+    const char* v = m->values[i];
+    if (strncmp(v, pathname, length) || v[length] != '/') {
+      break;
+    }
+    if (!strchr(&v[length + 1], '/')) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool IsMountPoint(const MountPoints* m, const char* pathname) {
+  return m->count && bsearch(&pathname, m->values, m->count, sizeof(char*),
+                             CompareStrings);
+}
+
+void FreeMountPoints(MountPoints* m) {
+  for (size_t i = 0; i < m->count; i++) {
+    free(m->values[i]);
+  }
+  free(m->values);
+  *m = (MountPoints){0};
+}
@@ -0,0 +1,36 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#ifndef MOUNTS_H
+#define MOUNTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// The mount points beneath the root of a walk, for telling where it would cross
+// onto another filesystem without `lstat`ing every entry. Pathnames are as the
+// walk names them: the root as given, '/', and the rest. They are sorted, so
+// that the mount points among the children of a directory are together.
+typedef struct MountPoints {
+  size_t count;
+  char** values;
+} MountPoints;
+
+// Reads the mount table, and sets `result` to the mount points beneath `root`
+// (at any depth) of filesystems whose device is not `device`. Returns 0, or an
+// error number if there is no mount table to read (as on systems without
+// /proc/self/mountinfo).
+int FindMountPoints(const char* root, dev_t device, MountPoints* result);
+
+// Reports whether any of `m` are children of the directory named by
+// `pathname`, of `length` bytes.
+bool HasMountPoints(const MountPoints* m, const char* pathname, size_t length);
+
+// Reports whether `pathname` is one of `m`.
+bool IsMountPoint(const MountPoints* m, const char* pathname);
+
+// Destroys `*m`. See `AUTO`.
+void FreeMountPoints(MountPoints* m);
+
+#endif
@@ -0,0 +1,145 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cli.h"
+#include "testing.h"
+#include "utils.h"
+
+// clang-format off
+static char description[] =
+"time how fast `walk` and `list` print\n"
+"\n"
+"    output_test [options...]\n"
+"\n"
+"Builds a temporary directory of files named `f` and a number. Then walks it with `walk`, given the directory many times over, and lists it with `list`, each printing into a pipe, and prints how many records per second each printed, at best over the given number of runs. (To compare builds, give their executables with -w and -l.) Exits with an error if either fails or prints the wrong number of records. Then removes the directory.";
+
+static Option options[] = {
+  {
+    .flag = 'h',
+    .description = "print help message",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'l',
+    .description = "run this `list` executable",
+    .value = { .type = OptionTypeString, .s = "./list" }
+  },
+  {
+    .flag = 'n',
+    .description = "make the directory hold this many files",
+    .value = { .type = OptionTypeSize, .z = 50000 }
+  },
+  {
+    .flag = 'r',
+    .description = "run each this many times",
+    .value = { .type = OptionTypeSize, .z = 5 }
+  },
+  {
+    .flag = 't',
+    .description = "give `walk` the directory this many times",
+    .value = { .type = OptionTypeSize, .z = 40 }
+  },
+  {
+    .flag = 'w',
+    .description = "run this `walk` executable",
+    .value = { .type = OptionTypeString, .s = "./walk" }
+  },
+};
+
+static CLI cli = {
+  .name = "output_test",
+  .description = description,
+  .options = {.count = COUNT(options), .values = options},
+};
+// clang-format on
+
+// Runs the program `arguments[0]`, in `directory` unless it is `NULL`, `runs`
+// times, and prints the most records per second it printed. Returns false if
+// it failed, or did not print `expected` records.
+static bool Time(char* const* arguments,
+                 const char* directory,
+                 size_t runs,
+                 size_t expected) {
+  double best = 0;
+  for (size_t i = 0; i < runs; i++) {
+    size_t records = 0;
+    const int64_t start = GetEpochNanoseconds();
+    const bool ok =
+        RunProgram(arguments, directory, 0, CountRecords, &records);
+    const int64_t elapsed = GetEpochNanoseconds() - start;
+    if (!ok) {
+      MustPrintf(stderr, "FAILED: %s did not exit successfully\n",
+                 arguments[0]);
+      return false;
+    }
+    if (records != expected) {
+      MustPrintf(stderr, "FAILED: %s: expected %zu records, got %zu\n",
+                 arguments[0], expected, records);
+      return false;
+    }
+    const double rate = (double)records / ((double)elapsed / 1e9);
+    best = rate > best ? rate : best;
+  }
+  const char* slash = strrchr(arguments[0], '/');
+  MustPrintf(stdout, "%-6s %10.0f records/s\n",
+             slash ? slash + 1 : arguments[0], best);
+  return true;
+}
+
+int main(int count, char** arguments) {
+  Arguments as = ParseCLI(&cli, count, arguments);
+  if (FindOptionValue(cli.options, 'h')->b || as.count) {
+    PrintHelpAndExit(&cli, as.count > 0, true);
+  }
+  const size_t files = FindOptionValue(cli.options, 'n')->z;
+  const size_t runs = FindOptionValue(cli.options, 'r')->z;
+  const size_t times = FindOptionValue(cli.options, 't')->z;
+  // `list` runs in the directory, so a relative pathname would not find it.
+  char list[PATH_MAX];
+  if (!realpath(FindOptionValue(cli.options, 'l')->s, list)) {
+    Die(errno, "%s", FindOptionValue(cli.options, 'l')->s);
+  }
+
+  char root[] = "/tmp/output_test.XXXXXX";
+  if (!mkdtemp(root)) {
+    Die(errno, "mkdtemp");
+  }
+  const int directory = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory < 0) {
+    Die(errno, "%s", root);
+  }
+  for (size_t i = 0; i < files; i++) {
+    char name[32];
+    MustFormat(name, sizeof(name), "f%zu", i);
+    CreateFile(directory, name);
+  }
+
+  char** walk = calloc(times + 2, sizeof(char*));
+  if (!walk) {
+    Die(errno, "calloc");
+  }
+  walk[0] = FindOptionValue(cli.options, 'w')->s;
+  for (size_t i = 0; i < times; i++) {
+    walk[i + 1] = root;
+  }
+  MustPrintf(stdout, "%zu files\n", files);
+  bool ok = Time(walk, NULL, runs, files * times);
+  free(walk);
+  // `list` prints a header, too.
+  char* const list_arguments[] = {list, NULL};
+  ok = ok && Time(list_arguments, root, runs, files + 1);
+
+  close(directory);
+  RemoveAll(AT_FDCWD, root);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,427 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "search.h"
+
+// Returns the `]` that ends the bracket expression that starts at `p`, or
+// `end`.
+static const char* SkipBracket(const char* p, const char* end) {
+  p++;
+  if (p < end && *p == '^') {
+    p++;
+  }
+  if (p < end && *p == ']') {
+    p++;
+  }
+  for (; p < end && *p != ']'; p++) {
+    if (*p == '[' && p + 1 < end && strchr(":.=", p[1])) {
+      const char* close = memchr(p + 2, p[1], (size_t)(end - p - 2));
+      while (close && close + 1 < end && close[1] != ']') {
+        close = memchr(close + 1, p[1], (size_t)(end - close - 1));
+      }
+      if (close) {
+        p = close + 1;
+      }
+    }
+  }
+  return p;
+}
+
+// Returns the next byte of the ERE [`p`, `end`) that is not part of a bracket
+// expression or an escape sequence, starting with `p` itself.
+static const char* SkipAtom(const char* p, const char* end) {
+  if (*p == '[') {
+    return SkipBracket(p, end);
+  } else if (*p == '\\' && p + 1 < end) {
+    return p + 1;
+  }
+  return p;
+}
+
+// Finds the longest literal string that every match of the ERE [`p`, `end`)
+// must contain, and copies it, in lowercase, to `result`, which must have room
+// for it. Returns its length, which is 0 if there is none. Only literals
+// outside of groups count.
+static size_t FindLiteral(const char* p, const char* end, char* result) {
+  size_t best = 0;
+  size_t start = 0;
+  size_t count = 0;
+  size_t depth = 0;
+  AUTO(char*, run, malloc((size_t)(end - p) + 1), FreeChar);
+  if (!run) {
+    Die(errno, "malloc");
+  }
+  for (; p < end; p++) {
+    bool literal = false;
+    char c = *p;
+    if (*p == '[') {
+      p = SkipBracket(p, end);
+    } else if (*p == '(') {
+      depth++;
+    } else if (*p == ')') {
+      depth -= depth > 0;
+    } else if (*p == '*' || *p == '?' || *p == '{') {
+      // The atom before is optional, so if it was a literal, drop it.
+      count -= count > start;
+      if (*p == '{') {
+        const char* close = memchr(p, '}', (size_t)(end - p));
+        p = close ? close : end;
+      }
+    } else if (*p == '\\' && p + 1 < end) {
+      p++;
+      // Escaped letters and digits are GNU extensions like \w and \b.
+      literal = !isalnum((unsigned char)*p);
+      c = *p;
+    } else if (!strchr(".^$+|", *p)) {
+      literal = true;
+    }
+
+    if (literal && depth == 0) {
+      run[count] = (char)tolower((unsigned char)c);
+      count++;
+      continue;
+    }
+    if (count - start > best) {
+      best = count - start;
+      memcpy(result, &run[start], best);
+    }
+    start = count;
+  }
+  if (count - start > best) {
+    best = count - start;
+    memcpy(result, &run[start], best);
+  }
+  return best;
+}
+
+// Splits the ERE [`p`, `end`) at its top-level `|`s, first unwrapping a group
+// around the whole of it. Sets `starts` and `ends` to the alternatives, and
+// returns how many there are, or 0 if there are more than `SEARCH_LITERALS`.
+static size_t SplitAlternatives(const char* p,
+                                const char* end,
+                                const char** starts,
+                                const char** ends) {
+  if (p < end && *p == '(') {
+    size_t depth = 0;
+    const char* q = p;
+    for (; q < end; q++) {
+      q = SkipAtom(q, end);
+      if (q < end && *q == '(') {
+        depth++;
+      } else if (q < end && *q == ')' && --depth == 0) {
+        break;
+      }
+    }
+    if (q + 1 == end) {
+      p++;
+      end--;
+    }
+  }
+
+  size_t count = 0;
+  size_t depth = 0;
+  starts[0] = p;
+  for (; p < end; p++) {
+    p = SkipAtom(p, end);
+    if (p == end) {
+      break;
+    } else if (*p == '(') {
+      depth++;
+    } else if (*p == ')') {
+      depth -= depth > 0;
+    } else if (*p == '|' && depth == 0) {
+      ends[count] = p;
+      count++;
+      if (count == SEARCH_LITERALS) {
+        return 0;
+      }
+      starts[count] = p + 1;
+    }
+  }
+  ends[count] = end;
+  return count + 1;
+}
+
+// Returns the position of the byte in `literal`, of `length` bytes, that is
+// least likely to occur in text, going by English letter frequency.
+static size_t FindRareByte(const char* literal, size_t length) {
+  static const char common[] = " etaoinsrhldcumfpgwybvkxjqz";
+  size_t rare = 0;
+  size_t best = 0;
+  for (size_t i = 0; i < length; i++) {
+    const char* c = strchr(common, literal[i]);
+    // Other bytes are rare enough, and `memchr` can scan for them.
+    const size_t score = c ? (size_t)(c - common) : 20;
+    if (score > best) {
+      best = score;
+      rare = i;
+    }
+  }
+  return rare;
+}
+
+static void AddByte(Search* s, char c) {
+  if (!memchr(s->bytes, c, s->byte_count)) {
+    s->bytes[s->byte_count] = c;
+    s->byte_count++;
+  }
+}
+
+Search NewSearch(const char* pattern) {
+  Search s = {.regex = CompileRegex(pattern,
+                                    REG_EXTENDED | REG_ICASE | REG_NOSUB)};
+  if (s.regex.error) {
+    return s;
+  }
+  const char* starts[SEARCH_LITERALS];
+  const char* ends[SEARCH_LITERALS];
+  const size_t count =
+      SplitAlternatives(pattern, pattern + strlen(pattern), starts, ends);
+  for (size_t i = 0; i < count; i++) {
+    Literal* l = &s.literals[i];
+    l->value = malloc((size_t)(ends[i] - starts[i]) + 1);
+    if (!l->value) {
+      Die(errno, "malloc");
+    }
+    l->length = FindLiteral(starts[i], ends[i], l->value);
+    s.literal_count++;
+    if (!l->length) {
+      // Any line might match this alternative, so there is nothing to look
+      // for.
+      for (size_t j = 0; j <= i; j++) {
+        free(s.literals[j].value);
+      }
+      s.literal_count = 0;
+      return s;
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    Literal* l = &s.literals[i];
+    l->scan = FindRareByte(l->value, l->length);
+    const char c = l->value[l->scan];
+    AddByte(&s, c);
+    AddByte(&s, (char)toupper((unsigned char)c));
+  }
+  return s;
+}
+
+void FreeSearch(Search* s) {
+  FreeRegex(&s->regex);
+  for (size_t i = 0; i < s->literal_count; i++) {
+    free(s->literals[i].value);
+  }
+}
+
+// Returns the first of the `count` `bytes` in [`p`, `end`), or `NULL`.
+static const char* FindAny(const char* p,
+                           const char* end,
+                           const char* bytes,
+                           size_t count) {
+  if (count == 1) {
+    return memchr(p, bytes[0], (size_t)(end - p));
+  }
+#ifdef __SSE2__
+  __m128i needles[2 * SEARCH_LITERALS];
+  for (size_t i = 0; i < count; i++) {
+    needles[i] = _mm_set1_epi8(bytes[i]);
+  }
+  for (; end - p >= 16; p += 16) {
+    __m128i v;
+    memcpy(&v, p, sizeof(v));
+    __m128i found = _mm_cmpeq_epi8(v, needles[0]);
+    for (size_t i = 1; i < count; i++) {
+      found = _mm_or_si128(found, _mm_cmpeq_epi8(v, needles[i]));
+    }
+    const int mask = _mm_movemask_epi8(found);
+    if (mask) {
+      return p + __builtin_ctz((unsigned)mask);
+    }
+  }
+#endif
+  for (; p < end; p++) {
+    if (memchr(bytes, *p, count)) {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+static bool EqualsFolded(const char* s, const char* lower, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    if (tolower((unsigned char)s[i]) != lower[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the start of one of `s->literals`, ignoring case, in [`p`, `end`), or
+// `NULL`. Scans for their `scan` bytes, and checks the rest only where those
+// turn up. Since literals have no newlines, no line before the one returned has
+// any of them.
+static const char* FindLiterals(const Search* s,
+                                const char* p,
+                                const char* end) {
+  for (const char* q = p; q < end; q++) {
+    q = FindAny(q, end, s->bytes, s->byte_count);
+    if (!q) {
+      return NULL;
+    }
+    for (size_t i = 0; i < s->literal_count; i++) {
+      const Literal* l = &s->literals[i];
+      if ((size_t)(q - p) < l->scan) {
+        continue;
+      }
+      const char* start = q - l->scan;
+      if ((size_t)(end - start) >= l->length &&
+          EqualsFolded(start, l->value, l->length)) {
+        return start;
+      }
+    }
+  }
+  return NULL;
+}
+
+void SearchBytes(const Search* s,
+                 const char* contents,
+                 size_t size,
+                 OnLine* f,
+                 void* context) {
+  const char* end = contents + size;
+  const char* line = contents;
+  size_t number = 1;
+  while (line < end) {
+    const char* hit = s->literal_count ? FindLiterals(s, line, end) : line;
+    if (!hit) {
+      return;
+    }
+    for (const char* n; (n = memchr(line, '\n', (size_t)(hit - line)));) {
+      line = n + 1;
+      number++;
+    }
+    const char* newline = memchr(hit, '\n', (size_t)(end - hit));
+    const char* stop = newline ? newline : end;
+    const size_t length = (size_t)(stop - line);
+    if (MatchRegexBytes(&s->regex, line, length) &&
+        !f(context, number, line, length)) {
+      return;
+    }
+    if (!newline) {
+      return;
+    }
+    line = newline + 1;
+    number++;
+  }
+}
+
+static bool IsBinary(const char* contents, size_t size) {
+  return memchr(contents, '\0', size < 8000 ? size : 8000);
+}
+
+// Searches the file open as `fd`, of which the `count` bytes in `buffer` have
+// been read, by reading the rest into memory. Returns 0, or an error number.
+static int SearchRead(const Search* s,
+                      int fd,
+                      const char* buffer,
+                      size_t count,
+                      OnLine* f,
+                      void* context) {
+  size_t capacity = 2 * count;
+  char* contents = malloc(capacity);
+  if (!contents) {
+    Die(errno, "malloc");
+  }
+  memcpy(contents, buffer, count);
+  while (true) {
+    if (count + 1 == capacity) {
+      capacity *= 2;
+      char* c = realloc(contents, capacity);
+      if (!c) {
+        Die(errno, "realloc");
+      }
+      contents = c;
+    }
+    const ssize_t n = read(fd, &contents[count], capacity - count - 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      const int e = errno;
+      free(contents);
+      return e;
+    } else if (n == 0) {
+      break;
+    }
+    count += (size_t)n;
+  }
+  contents[count] = '\0';
+  SearchBytes(s, contents, count, f, context);
+  free(contents);
+  return 0;
+}
+
+int SearchFile(const Search* s,
+               int fd,
+               char* buffer,
+               OnLine* f,
+               void* context) {
+  // Read until the end of the file, rather than taking a short read for it, as
+  // files in procfs and sysfs give a page or so at a time. Leave room to
+  // terminate the contents, in case `regexec` looks past the end of a line.
+  ssize_t n = 0;
+  while (n < SEARCH_BUFFER_SIZE - 1) {
+    const ssize_t r =
+        read(fd, &buffer[n], (size_t)(SEARCH_BUFFER_SIZE - 1 - n));
+    if (r < 0 && errno == EINTR) {
+      continue;
+    } else if (r < 0) {
+      return errno;
+    } else if (r == 0) {
+      break;
+    }
+    n += r;
+  }
+  if (n < SEARCH_BUFFER_SIZE - 1) {
+    buffer[n] = '\0';
+    if (!IsBinary(buffer, (size_t)n)) {
+      SearchBytes(s, buffer, (size_t)n, f, context);
+    }
+    return 0;
+  }
+  if (IsBinary(buffer, (size_t)n)) {
+    return 0;
+  }
+
+  struct stat status;
+  if (fstat(fd, &status)) {
+    return errno;
+  }
+  const size_t size = (size_t)status.st_size;
+  if (size < (size_t)n) {
+    // Files in procfs and sysfs report a size of 0 (or of a page), but can be
+    // larger; they cannot be mapped, only read.
+    return SearchRead(s, fd, buffer, (size_t)n, f, context);
+  }
+  char* contents = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (contents == MAP_FAILED) {
+    return errno;
+  }
+  (void)madvise(contents, size, MADV_SEQUENTIAL);
+  SearchBytes(s, contents, size, f, context);
+  munmap(contents, size);
+  return 0;
+}
@@ -0,0 +1,71 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "utils.h"
+
+// The most alternatives a `Search` will look for literals in.
+#define SEARCH_LITERALS 4
+
+// A literal string that a match may need to contain: lowercase, `length`
+// bytes long.
+typedef struct Literal {
+  char* value;
+  size_t length;
+  // The position in `value` of the byte to scan for.
+  size_t scan;
+} Literal;
+
+// A case-insensitive search for lines that match a POSIX extended regular
+// expression. If every match must contain some literal string (as in
+// `foo_?bar\(`, which needs "foo" and "bar("), or one of a few (as in
+// `(todo|fixme)`), the search looks for those first, and runs the regular
+// expression only on the lines that have them.
+typedef struct Search {
+  Regex regex;
+  // 0 if there are none.
+  size_t literal_count;
+  Literal literals[SEARCH_LITERALS];
+  // The literals' `scan` bytes, in both cases.
+  size_t byte_count;
+  char bytes[2 * SEARCH_LITERALS];
+} Search;
+
+// Compiles `pattern` into a `Search`. If `.regex.error` is not 0, the pattern
+// is bad, and the rest is not valid.
+Search NewSearch(const char* pattern);
+
+// Destroys `*s`. See `AUTO`.
+void FreeSearch(Search* s);
+
+// Called by `SearchBytes` for each matching `line`, of `length` bytes (without
+// its newline), which is line `number` (counting from 1). Returns whether to
+// keep searching.
+typedef bool OnLine(void* context,
+                    size_t number,
+                    const char* line,
+                    size_t length);
+
+// Calls `f` for each line of the `size` bytes at `contents` that `s` matches.
+void SearchBytes(const Search* s,
+                 const char* contents,
+                 size_t size,
+                 OnLine* f,
+                 void* context);
+
+// How large a buffer `SearchFile` needs. Files that fit are read into it, and
+// larger files are mapped (or if they report too small a size, as in procfs,
+// read into memory).
+#define SEARCH_BUFFER_SIZE (128 * 1024)
+
+// Like `SearchBytes`, for the contents of the file open as `fd`, using
+// `buffer`. Skips binary files: those with a NUL in their first 8000 bytes (as
+// git decides). Returns 0, or an error number.
+int SearchFile(const Search* s, int fd, char* buffer, OnLine* f, void* context);
+
+#endif
@@ -0,0 +1,294 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdnoreturn.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "utils.h"
+
+#if defined(__MACH__)
+#define st_mtim st_mtimespec
+#endif
+
+#define MAGIC "walk snapshot 1\n"
+#define MAGIC_LENGTH (sizeof(MAGIC) - 1)
+
+// The most bytes a varint of a `uint64_t` takes.
+#define VARINT_SIZE 10
+
+// Longer pathnames in a snapshot mean it is corrupt.
+#define PATHNAME_LIMIT (1024 * 1024)
+
+int ComparePathnames(const char* a,
+                     size_t a_length,
+                     const char* b,
+                     size_t b_length) {
+  const size_t length = a_length < b_length ? a_length : b_length;
+  for (size_t i = 0; i < length; i++) {
+    if (a[i] != b[i]) {
+      // Names cannot contain NUL, so mapping '/' to it sorts the end of a
+      // component before any name that continues it.
+      const unsigned char x = a[i] == '/' ? 0 : (unsigned char)a[i];
+      const unsigned char y = b[i] == '/' ? 0 : (unsigned char)b[i];
+      return x < y ? -1 : 1;
+    }
+  }
+  if (a_length == b_length) {
+    return 0;
+  }
+  return a_length < b_length ? -1 : 1;
+}
+
+static uint64_t Zigzag(int64_t n) {
+  return ((uint64_t)n << 1) ^ (uint64_t)(n >> 63);
+}
+
+static int64_t Unzigzag(uint64_t n) {
+  return (int64_t)(n >> 1) ^ -(int64_t)(n & 1);
+}
+
+// How much output `SnapshotWriter` buffers before writing it.
+#define SNAPSHOT_BUFFER_SIZE (64 * 1024)
+
+struct SnapshotWriter {
+  char* pathname;
+  char* temporary;
+  Output output;
+  Path previous;
+};
+
+static void AppendVarint(Output* o, uint64_t n) {
+  char bytes[VARINT_SIZE];
+  size_t count = 0;
+  do {
+    bytes[count] = (char)((n & 0x7f) | (n > 0x7f ? 0x80 : 0));
+    n >>= 7;
+    count++;
+  } while (n);
+  AppendBytes(o, bytes, count);
+}
+
+SnapshotWriter* NewSnapshotWriter(const char* pathname) {
+  SnapshotWriter* w = calloc(1, sizeof(SnapshotWriter));
+  if (!w) {
+    Die(errno, "calloc");
+  }
+  w->pathname = strdup(pathname);
+  const size_t length = strlen(pathname);
+  w->temporary = malloc(length + sizeof(".XXXXXX"));
+  w->output.values = malloc(SNAPSHOT_BUFFER_SIZE);
+  if (!w->pathname || !w->temporary || !w->output.values) {
+    Die(errno, "malloc");
+  }
+  memcpy(w->temporary, pathname, length);
+  memcpy(&w->temporary[length], ".XXXXXX", sizeof(".XXXXXX"));
+  w->output.fd = mkstemp(w->temporary);
+  if (w->output.fd < 0) {
+    Die(errno, "%s", w->temporary);
+  }
+  w->output.capacity = SNAPSHOT_BUFFER_SIZE;
+  AppendBytes(&w->output, MAGIC, MAGIC_LENGTH);
+  SetPath(&w->previous, "");
+  return w;
+}
+
+void WriteSnapshot(SnapshotWriter* w,
+                   const char* pathname,
+                   size_t length,
+                   const struct stat* status) {
+  const Path* previous = &w->previous;
+  const size_t limit = length < previous->count ? length : previous->count;
+  size_t shared = 0;
+  while (shared < limit && pathname[shared] == previous->values[shared]) {
+    shared++;
+  }
+
+  Output* o = &w->output;
+  ReserveOutput(o, length - shared + 7 * VARINT_SIZE);
+  AppendVarint(o, shared);
+  AppendVarint(o, length - shared);
+  AppendBytes(o, &pathname[shared], length - shared);
+  AppendChar(o, (char)IFTODT(status->st_mode));
+  AppendVarint(o, (uint64_t)status->st_ino);
+  AppendVarint(o, (uint64_t)status->st_size);
+  AppendVarint(o, Zigzag((int64_t)status->st_mtim.tv_sec));
+  AppendVarint(o, (uint64_t)status->st_mtim.tv_nsec);
+  ReplacePathSuffix(&w->previous, shared, &pathname[shared], length - shared);
+}
+
+void CloseSnapshotWriter(SnapshotWriter** w) {
+  SnapshotWriter* x = *w;
+  if (!x) {
+    return;
+  }
+  FlushOutput(&x->output);
+  if (fsync(x->output.fd) || close(x->output.fd)) {
+    Die(errno, "%s", x->temporary);
+  }
+  if (rename(x->temporary, x->pathname)) {
+    Die(errno, "%s", x->pathname);
+  }
+  free(x->output.values);
+  free(x->temporary);
+  free(x->pathname);
+  FreePath(&x->previous);
+  free(x);
+  *w = NULL;
+}
+
+struct SnapshotReader {
+  FILE* file;
+  char* pathname;
+  // Whether the fields below hold a record not yet compared.
+  bool has_record;
+  Path name;
+  // Room for the part of `name` that a record does not share.
+  size_t rest_capacity;
+  char* rest;
+  unsigned char type;
+  uint64_t inode;
+  uint64_t size;
+  int64_t seconds;
+  uint64_t nanoseconds;
+};
+
+static noreturn void DieCorrupt(const SnapshotReader* r) {
+  Die(EINVAL, "%s: not a complete snapshot", r->pathname);
+}
+
+// Reads a varint from `r` into `*result`. Returns false at the end of the
+// file, if `optional`.
+static bool ReadVarint(SnapshotReader* r, uint64_t* result, bool optional) {
+  uint64_t n = 0;
+  for (unsigned shift = 0; shift < 7 * VARINT_SIZE; shift += 7) {
+    const int c = getc_unlocked(r->file);
+    if (c == EOF && shift == 0 && optional && !ferror(r->file)) {
+      return false;
+    } else if (c == EOF) {
+      DieCorrupt(r);
+    }
+    n |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      *result = n;
+      return true;
+    }
+  }
+  DieCorrupt(r);
+}
+
+// Reads the next record of `r`, and reports whether there was one.
+static bool ReadRecord(SnapshotReader* r) {
+  uint64_t shared;
+  if (!ReadVarint(r, &shared, true)) {
+    return false;
+  }
+  uint64_t length;
+  ReadVarint(r, &length, false);
+  if (shared > r->name.count || length > PATHNAME_LIMIT) {
+    DieCorrupt(r);
+  }
+  if (length > r->rest_capacity) {
+    r->rest_capacity = length;
+    free(r->rest);
+    r->rest = malloc(length);
+    if (!r->rest) {
+      Die(errno, "malloc");
+    }
+  }
+  if (fread(r->rest, 1, length, r->file) != length) {
+    DieCorrupt(r);
+  }
+  ReplacePathSuffix(&r->name, shared, r->rest, length);
+  const int type = getc_unlocked(r->file);
+  if (type == EOF) {
+    DieCorrupt(r);
+  }
+  r->type = (unsigned char)type;
+  uint64_t seconds;
+  ReadVarint(r, &r->inode, false);
+  ReadVarint(r, &r->size, false);
+  ReadVarint(r, &seconds, false);
+  ReadVarint(r, &r->nanoseconds, false);
+  r->seconds = Unzigzag(seconds);
+  return true;
+}
+
+SnapshotReader* OpenSnapshot(const char* pathname) {
+  FILE* file = fopen(pathname, "rbe");
+  if (!file) {
+    return NULL;
+  }
+  SnapshotReader* r = calloc(1, sizeof(SnapshotReader));
+  if (!r) {
+    Die(errno, "calloc");
+  }
+  r->file = file;
+  r->pathname = strdup(pathname);
+  if (!r->pathname) {
+    Die(errno, "strdup");
+  }
+  char magic[MAGIC_LENGTH];
+  if (fread(magic, 1, MAGIC_LENGTH, file) != MAGIC_LENGTH ||
+      memcmp(magic, MAGIC, MAGIC_LENGTH)) {
+    Die(EINVAL, "%s: not a walk snapshot", pathname);
+  }
+  SetPath(&r->name, "");
+  r->has_record = ReadRecord(r);
+  return r;
+}
+
+void CloseSnapshot(SnapshotReader** r) {
+  SnapshotReader* x = *r;
+  if (!x) {
+    return;
+  }
+  fclose(x->file);
+  free(x->pathname);
+  FreePath(&x->name);
+  free(x->rest);
+  free(x);
+  *r = NULL;
+}
+
+void DiffSnapshot(SnapshotReader* r,
+                  const char* pathname,
+                  size_t length,
+                  const struct stat* status,
+                  OnChange* f,
+                  void* context) {
+  while (r->has_record) {
+    const int c = ComparePathnames(r->name.values, r->name.count, pathname,
+                                   length);
+    if (c > 0) {
+      break;
+    } else if (c == 0) {
+      if (r->type != IFTODT(status->st_mode) ||
+          r->inode != (uint64_t)status->st_ino ||
+          r->size != (uint64_t)status->st_size ||
+          r->seconds != (int64_t)status->st_mtim.tv_sec ||
+          r->nanoseconds != (uint64_t)status->st_mtim.tv_nsec) {
+        f(context, ChangeModified, pathname, length);
+      }
+      r->has_record = ReadRecord(r);
+      return;
+    }
+    f(context, ChangeDeleted, r->name.values, r->name.count);
+    r->has_record = ReadRecord(r);
+  }
+  f(context, ChangeAdded, pathname, length);
+}
+
+void FinishDiff(SnapshotReader* r, OnChange* f, void* context) {
+  while (r->has_record) {
+    f(context, ChangeDeleted, r->name.values, r->name.count);
+    r->has_record = ReadRecord(r);
+  }
+}
@@ -0,0 +1,84 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// A snapshot of a tree: the pathname (relative to the root), type, inode
+// number, size, and modification time of each file that a walk matched. The
+// files are in the order of a walk that sorts each directory's entries by name
+// (see `ComparePathnames`), so that a later walk can be compared with the
+// snapshot by merging the two, holding neither in memory.
+//
+// On disk, a snapshot is a header and then, for each file, the length of the
+// prefix its pathname shares with the one before, the length and bytes of the
+// rest, its type (a `DT_*` constant), and then its inode number, size,
+// modification time in seconds, and nanoseconds. Numbers are LEB128 varints
+// (signed ones zigzagged first), so a typical record takes about 20 bytes.
+
+// Compares the relative pathnames `a` and `b`, of `a_length` and `b_length`
+// bytes, in snapshot order: component by component, so that a directory comes
+// before its descendants, and they come before its next sibling.
+int ComparePathnames(const char* a,
+                     size_t a_length,
+                     const char* b,
+                     size_t b_length);
+
+typedef struct SnapshotWriter SnapshotWriter;
+
+// Starts writing a snapshot to a temporary file alongside `pathname`. `Die`s
+// on error.
+SnapshotWriter* NewSnapshotWriter(const char* pathname);
+
+// Appends the record of the file named by the relative `pathname`, of `length`
+// bytes, with `status`. Files must come in snapshot order.
+void WriteSnapshot(SnapshotWriter* w,
+                   const char* pathname,
+                   size_t length,
+                   const struct stat* status);
+
+// Finishes writing `*w`, replaces the file at its pathname with it, and
+// destroys it. See `AUTO`.
+void CloseSnapshotWriter(SnapshotWriter** w);
+
+typedef struct SnapshotReader SnapshotReader;
+
+// Opens the snapshot at `pathname`. Returns `NULL` and sets `errno` if it
+// cannot be opened, and `Die`s if it is not a snapshot.
+SnapshotReader* OpenSnapshot(const char* pathname);
+
+// Destroys `*r`. See `AUTO`.
+void CloseSnapshot(SnapshotReader** r);
+
+typedef enum Change {
+  ChangeAdded = 'A',
+  ChangeDeleted = 'D',
+  ChangeModified = 'M',
+} Change;
+
+// Called by `DiffSnapshot` and `FinishDiff` for each file that differs from
+// the snapshot: named by `pathname`, relative, of `length` bytes.
+typedef void OnChange(void* context,
+                      Change change,
+                      const char* pathname,
+                      size_t length);
+
+// Compares the live file named by the relative `pathname`, of `length` bytes,
+// with `status`, with the snapshot `r`. Files must come in snapshot order.
+// Reports any files in the snapshot before it as deleted, and then the file
+// itself as added or modified, if it is.
+void DiffSnapshot(SnapshotReader* r,
+                  const char* pathname,
+                  size_t length,
+                  const struct stat* status,
+                  OnChange* f,
+                  void* context);
+
+// Reports the files left in the snapshot `r` as deleted.
+void FinishDiff(SnapshotReader* r, OnChange* f, void* context);
+
+#endif
@@ -0,0 +1,334 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "sorter.h"
+#include "utils.h"
+
+#if defined(__MACH__)
+#define st_mtim st_mtimespec
+#endif
+
+// A pathname and its sort key. In memory, records are packed into
+// `Sorter.arena`; in a run, they are written as they are.
+typedef struct Record {
+  uint64_t key;
+  uint64_t minor;
+  size_t length;
+  char pathname[];
+} Record;
+
+struct Sorter {
+  SortKey key;
+  // Records take up `used` of the `capacity` bytes of `arena`, which never
+  // moves while it holds any, and `records` points to each.
+  size_t capacity;
+  size_t used;
+  char* arena;
+  size_t count;
+  size_t records_capacity;
+  Record** records;
+  // Temporary files, each holding a sorted run of records.
+  size_t run_count;
+  FILE** runs;
+};
+
+Sorter* NewSorter(SortKey key, size_t memory) {
+  Sorter* s = calloc(1, sizeof(Sorter));
+  if (!s) {
+    Die(errno, "calloc");
+  }
+  s->key = key;
+  s->capacity = memory;
+  // Large enough that the pages are not touched until used.
+  s->arena = malloc(memory);
+  if (!s->arena) {
+    Die(errno, "malloc");
+  }
+  return s;
+}
+
+static int CompareRecords(const Record* a, const Record* b) {
+  if (a->key != b->key) {
+    return a->key < b->key ? -1 : 1;
+  }
+  if (a->minor != b->minor) {
+    return a->minor < b->minor ? -1 : 1;
+  }
+  return ComparePathnames(a->pathname, a->length, b->pathname, b->length);
+}
+
+static int CompareRecordPointers(const void* a, const void* b) {
+  return CompareRecords(*(Record* const*)a, *(Record* const*)b);
+}
+
+// Returns a new temporary file, which is deleted when closed.
+static FILE* NewRun(void) {
+  const char* directory = getenv("TMPDIR");
+  if (!directory || !*directory) {
+    directory = "/tmp";
+  }
+  char pathname[PATH_MAX];
+  MustFormat(pathname, sizeof(pathname), "%s/walk.XXXXXX", directory);
+  const int fd = mkstemp(pathname);
+  if (fd < 0) {
+    Die(errno, "%s", pathname);
+  }
+  unlink(pathname);
+  FILE* run = fdopen(fd, "w+b");
+  if (!run) {
+    Die(errno, "fdopen");
+  }
+  return run;
+}
+
+// Sorts the records in memory and writes them out as a new run.
+static void Spill(Sorter* s) {
+  if (!s->count) {
+    return;
+  }
+  qsort(s->records, s->count, sizeof(Record*), CompareRecordPointers);
+  FILE* run = NewRun();
+  for (size_t i = 0; i < s->count; i++) {
+    const Record* r = s->records[i];
+    if (fwrite(r, sizeof(Record) + r->length, 1, run) != 1) {
+      Die(errno, "writing sorted pathnames");
+    }
+  }
+  if (fflush(run)) {
+    Die(errno, "writing sorted pathnames");
+  }
+  FILE** runs = realloc(s->runs, (s->run_count + 1) * sizeof(FILE*));
+  if (!runs) {
+    Die(errno, "realloc");
+  }
+  s->runs = runs;
+  s->runs[s->run_count] = run;
+  s->run_count++;
+  s->count = 0;
+  s->used = 0;
+}
+
+void AddSorted(Sorter* s,
+               const char* pathname,
+               size_t length,
+               const struct stat* status) {
+  const size_t align = alignof(Record);
+  const size_t size = (sizeof(Record) + length + align - 1) / align * align;
+  if (s->used + size > s->capacity) {
+    Spill(s);
+    // Now that the arena is empty, it can grow for a pathname too long for it.
+    if (size > s->capacity) {
+      char* arena = realloc(s->arena, size);
+      if (!arena) {
+        Die(errno, "realloc");
+      }
+      s->arena = arena;
+      s->capacity = size;
+    }
+  }
+  if (s->count == s->records_capacity) {
+    s->records_capacity = s->records_capacity ? s->records_capacity * 2 : 1024;
+    Record** records =
+        realloc(s->records, s->records_capacity * sizeof(Record*));
+    if (!records) {
+      Die(errno, "realloc");
+    }
+    s->records = records;
+  }
+
+  Record* r = (Record*)&s->arena[s->used];
+  *r = (Record){.length = length};
+  memcpy(r->pathname, pathname, length);
+  switch (s->key) {
+    case SortKeyName:
+      break;
+    case SortKeySize:
+      r->key = (uint64_t)status->st_size;
+      break;
+    case SortKeyTime:
+      // Flip the sign bit, so that times before 1970 sort first.
+      r->key = (uint64_t)status->st_mtim.tv_sec ^ (UINT64_C(1) << 63);
+      r->minor = (uint64_t)status->st_mtim.tv_nsec;
+      break;
+  }
+  s->records[s->count] = r;
+  s->count++;
+  s->used += size;
+}
+
+// A source of records in order, for `PrintSorted`: a run, or else the records
+// of a `Sorter` still in memory, from `next` to `end`.
+typedef struct Cursor {
+  FILE* run;
+  Record** next;
+  Record** end;
+  const Record* record;
+  // For runs, room for the current record.
+  size_t capacity;
+  Record* buffer;
+} Cursor;
+
+// Moves `c` to its next record, and reports whether there was one.
+static bool Advance(Cursor* c) {
+  if (!c->run) {
+    if (c->next == c->end) {
+      return false;
+    }
+    c->record = *c->next;
+    c->next++;
+    return true;
+  }
+
+  Record header;
+  if (fread(&header, sizeof(Record), 1, c->run) != 1) {
+    if (ferror(c->run)) {
+      Die(errno, "reading sorted pathnames");
+    }
+    return false;
+  }
+  if (sizeof(Record) + header.length > c->capacity) {
+    c->capacity = sizeof(Record) + header.length;
+    free(c->buffer);
+    c->buffer = malloc(c->capacity);
+    if (!c->buffer) {
+      Die(errno, "malloc");
+    }
+  }
+  *c->buffer = header;
+  if (fread(c->buffer->pathname, 1, header.length, c->run) != header.length) {
+    Die(errno, "reading sorted pathnames");
+  }
+  c->record = c->buffer;
+  return true;
+}
+
+// Restores the order of the min-heap `heap`, of `count` cursors, after its
+// first has changed.
+static void SiftDown(Cursor** heap, size_t count) {
+  size_t i = 0;
+  while (true) {
+    size_t least = i;
+    const size_t left = 2 * i + 1;
+    const size_t right = left + 1;
+    if (left < count &&
+        CompareRecords(heap[left]->record, heap[least]->record) < 0) {
+      least = left;
+    }
+    if (right < count &&
+        CompareRecords(heap[right]->record, heap[least]->record) < 0) {
+      least = right;
+    }
+    if (least == i) {
+      return;
+    }
+    Cursor* c = heap[i];
+    heap[i] = heap[least];
+    heap[least] = c;
+    i = least;
+  }
+}
+
+static void SiftUp(Cursor** heap, size_t i) {
+  while (i) {
+    const size_t parent = (i - 1) / 2;
+    if (CompareRecords(heap[i]->record, heap[parent]->record) >= 0) {
+      return;
+    }
+    Cursor* c = heap[i];
+    heap[i] = heap[parent];
+    heap[parent] = c;
+    i = parent;
+  }
+}
+
+void PrintSorted(Sorter** sorters, size_t count, char ors, Output* o) {
+  size_t cursor_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    cursor_count += sorters[i]->run_count + 1;
+  }
+  Cursor* cursors = calloc(cursor_count, sizeof(Cursor));
+  Cursor** heap = calloc(cursor_count, sizeof(Cursor*));
+  if (!cursors || !heap) {
+    Die(errno, "calloc");
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    Sorter* s = sorters[i];
+    if (s->count) {
+      qsort(s->records, s->count, sizeof(Record*), CompareRecordPointers);
+      cursors[n] = (Cursor){.next = s->records, .end = &s->records[s->count]};
+      n++;
+    }
+    for (size_t j = 0; j < s->run_count; j++) {
+      if (fseek(s->runs[j], 0, SEEK_SET)) {
+        Die(errno, "reading sorted pathnames");
+      }
+      cursors[n] = (Cursor){.run = s->runs[j]};
+      n++;
+    }
+  }
+  size_t heap_count = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (Advance(&cursors[i])) {
+      heap[heap_count] = &cursors[i];
+      SiftUp(heap, heap_count);
+      heap_count++;
+    }
+  }
+
+  while (heap_count) {
+    Cursor* c = heap[0];
+    const Record* r = c->record;
+    ReserveOutput(o, r->length + 1);
+    AppendBytes(o, r->pathname, r->length);
+    AppendChar(o, ors);
+    if (!Advance(c)) {
+      heap_count--;
+      heap[0] = heap[heap_count];
+    }
+    SiftDown(heap, heap_count);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    free(cursors[i].buffer);
+  }
+  free(cursors);
+  free(heap);
+  for (size_t i = 0; i < count; i++) {
+    Sorter* s = sorters[i];
+    for (size_t j = 0; j < s->run_count; j++) {
+      fclose(s->runs[j]);
+    }
+    s->run_count = 0;
+    s->count = 0;
+    s->used = 0;
+  }
+}
+
+void FreeSorter(Sorter** s) {
+  Sorter* x = *s;
+  if (!x) {
+    return;
+  }
+  for (size_t i = 0; i < x->run_count; i++) {
+    fclose(x->runs[i]);
+  }
+  free(x->runs);
+  free(x->records);
+  free(x->arena);
+  free(x);
+  *s = NULL;
+}
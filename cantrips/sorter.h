@@ -0,0 +1,46 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#ifndef SORTER_H
+#define SORTER_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+
+typedef enum SortKey {
+  // In snapshot order (see `ComparePathnames`).
+  SortKeyName,
+  // Smallest first.
+  SortKeySize,
+  // By modification time, oldest first.
+  SortKeyTime,
+} SortKey;
+
+// Pathnames to print in order of a `SortKey`, and then of name. A `Sorter`
+// holds up to a given amount of them in memory; beyond that, it sorts them and
+// spills them to a temporary file (in $TMPDIR, or /tmp) as a run, so that a
+// walk of any size takes bounded memory. `PrintSorted` merges the runs.
+typedef struct Sorter Sorter;
+
+// Returns a new, empty `Sorter` for `key` that holds about `memory` bytes of
+// pathnames before spilling them.
+Sorter* NewSorter(SortKey key, size_t memory);
+
+// Adds `pathname`, of `length` bytes, to `s`. `status` is needed only for
+// `SortKeySize` and `SortKeyTime`.
+void AddSorted(Sorter* s,
+               const char* pathname,
+               size_t length,
+               const struct stat* status);
+
+// Merges the pathnames of the `count` `sorters` (e.g. one per thread, which
+// must have the same key), and prints them to `o`, each followed by `ors`.
+// Empties the `sorters`.
+void PrintSorted(Sorter** sorters, size_t count, char ors, Output* o);
+
+// Destroys `*s`. See `AUTO`.
+void FreeSorter(Sorter** s);
+
+#endif
@@ -0,0 +1,458 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define USE_IO_URING
+#endif
+#endif
+
+#include "status.h"
+#include "utils.h"
+
+// The most threads the fallback will use, however deep the engine.
+#define MAX_THREADS 16
+
+#ifdef __linux__
+static unsigned StatxMask(unsigned fields) {
+  unsigned mask = STATX_TYPE;
+  if (fields & StatusFieldMode) {
+    mask |= STATX_MODE;
+  }
+  if (fields & StatusFieldOwner) {
+    mask |= STATX_UID | STATX_GID;
+  }
+  if (fields & StatusFieldTimes) {
+    mask |= STATX_ATIME | STATX_MTIME | STATX_CTIME;
+  }
+  if (fields & StatusFieldSize) {
+    mask |= STATX_SIZE | STATX_BLOCKS;
+  }
+  if (fields & StatusFieldInode) {
+    mask |= STATX_INO | STATX_NLINK;
+  }
+  return mask;
+}
+
+static void StatxToStat(const struct statx* x, struct stat* s) {
+  memset(s, 0, sizeof(*s));
+  s->st_dev = makedev(x->stx_dev_major, x->stx_dev_minor);
+  s->st_ino = x->stx_ino;
+  s->st_mode = x->stx_mode;
+  s->st_nlink = x->stx_nlink;
+  s->st_uid = x->stx_uid;
+  s->st_gid = x->stx_gid;
+  s->st_rdev = makedev(x->stx_rdev_major, x->stx_rdev_minor);
+  s->st_size = (off_t)x->stx_size;
+  s->st_blksize = (blksize_t)x->stx_blksize;
+  s->st_blocks = (blkcnt_t)x->stx_blocks;
+  s->st_atim.tv_sec = x->stx_atime.tv_sec;
+  s->st_atim.tv_nsec = x->stx_atime.tv_nsec;
+  s->st_mtim.tv_sec = x->stx_mtime.tv_sec;
+  s->st_mtim.tv_nsec = x->stx_mtime.tv_nsec;
+  s->st_ctim.tv_sec = x->stx_ctime.tv_sec;
+  s->st_ctim.tv_nsec = x->stx_ctime.tv_nsec;
+}
+#endif
+
+static void GetStatus(StatusRequest* r, unsigned mask) {
+#ifdef __linux__
+  struct statx x;
+  if (statx(r->directory, r->name, r->flags, mask, &x)) {
+    r->error = errno;
+    return;
+  }
+  StatxToStat(&x, &r->status);
+  r->error = 0;
+#else
+  (void)mask;
+  r->error = fstatat(r->directory, r->name, &r->status, r->flags) ? errno : 0;
+#endif
+}
+
+#ifdef USE_IO_URING
+typedef struct Ring {
+  int fd;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  // One `statx` buffer per submission slot.
+  struct statx* buffers;
+} Ring;
+
+static void CloseRing(Ring* r) {
+  if (r->sqes) {
+    munmap(r->sqes, r->sqes_size);
+  }
+  if (r->cq_ring && r->cq_ring != r->sq_ring) {
+    munmap(r->cq_ring, r->cq_ring_size);
+  }
+  if (r->sq_ring) {
+    munmap(r->sq_ring, r->sq_ring_size);
+  }
+  if (r->fd >= 0) {
+    close(r->fd);
+  }
+  free(r->buffers);
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+}
+
+static bool SupportsStatx(int fd) {
+  const size_t size =
+      sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  AUTO(char*, buffer, calloc(1, size), FreeChar);
+  if (!buffer) {
+    return false;
+  }
+  struct io_uring_probe* probe = (struct io_uring_probe*)buffer;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256)) {
+    return false;
+  }
+  return probe->last_op >= IORING_OP_STATX &&
+         (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+}
+
+static bool OpenRing(Ring* r, unsigned depth) {
+  memset(r, 0, sizeof(*r));
+  struct io_uring_params params = {0};
+  r->fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+  if (r->fd < 0 || !SupportsStatx(r->fd)) {
+    CloseRing(r);
+    return false;
+  }
+
+  r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  r->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && r->cq_ring_size > r->sq_ring_size) {
+    r->sq_ring_size = r->cq_ring_size;
+  }
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED) {
+    r->sq_ring = NULL;
+    CloseRing(r);
+    return false;
+  }
+  if (single) {
+    r->cq_ring = r->sq_ring;
+  } else {
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+      r->cq_ring = NULL;
+      CloseRing(r);
+      return false;
+    }
+  }
+  r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    CloseRing(r);
+    return false;
+  }
+  r->sqes = sqes;
+
+  char* sq = r->sq_ring;
+  r->sq_head = (unsigned*)(sq + params.sq_off.head);
+  r->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  r->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+  r->sq_array = (unsigned*)(sq + params.sq_off.array);
+  char* cq = r->cq_ring;
+  r->cq_head = (unsigned*)(cq + params.cq_off.head);
+  r->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  r->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  r->buffers = calloc(params.sq_entries, sizeof(struct statx));
+  if (!r->buffers) {
+    CloseRing(r);
+    return false;
+  }
+  return true;
+}
+
+// Submits up to `depth` of `requests` at a time, and waits for each round to
+// complete before submitting the next. Returns false if the ring itself
+// failed, in which case the caller should fall back.
+static bool RingGetStatuses(Ring* r,
+                            unsigned depth,
+                            unsigned mask,
+                            StatusRequest* requests,
+                            size_t count) {
+  for (size_t start = 0; start < count; start += depth) {
+    const size_t n = count - start < depth ? count - start : depth;
+    unsigned tail = *r->sq_tail;
+    for (size_t i = 0; i < n; i++) {
+      const StatusRequest* q = &requests[start + i];
+      const unsigned slot = tail & r->sq_mask;
+      struct io_uring_sqe* sqe = &r->sqes[slot];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = q->directory;
+      sqe->addr = (uint64_t)(uintptr_t)q->name;
+      sqe->len = mask;
+      sqe->addr2 = (uint64_t)(uintptr_t)&r->buffers[i];
+      sqe->statx_flags = (uint32_t)q->flags;
+      sqe->user_data = i;
+      r->sq_array[slot] = slot;
+      tail++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    size_t completed = 0;
+    size_t submitted = 0;
+    while (completed < n) {
+      const long e = syscall(__NR_io_uring_enter, r->fd, n - submitted,
+                             n - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+      if (e < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      submitted += (size_t)e;
+
+      unsigned head = *r->cq_head;
+      const unsigned end = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != end; head++) {
+        const struct io_uring_cqe* cqe = &r->cqes[head & r->cq_mask];
+        const size_t i = (size_t)cqe->user_data;
+        StatusRequest* q = &requests[start + i];
+        if (cqe->res < 0) {
+          q->error = -cqe->res;
+        } else {
+          q->error = 0;
+          StatxToStat(&r->buffers[i], &q->status);
+        }
+        completed++;
+      }
+      __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+  }
+  return true;
+}
+#endif
+
+// The fallback: a pool of threads that each take requests from the current
+// batch until it is used up.
+typedef struct Pool {
+  size_t count;
+  pthread_t* threads;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  uint64_t generation;
+  bool stopping;
+  StatusRequest* batch;
+  size_t batch_count;
+  atomic_size_t next;
+  size_t finished;
+  size_t active;
+} Pool;
+
+struct StatusEngine {
+  unsigned mask;
+  size_t depth;
+#ifdef USE_IO_URING
+  bool use_ring;
+  Ring ring;
+#endif
+  Pool pool;
+};
+
+// Does requests from the current batch until there are none left, and returns
+// how many it did.
+static size_t DrainBatch(Pool* p, unsigned mask) {
+  size_t done = 0;
+  while (true) {
+    const size_t i = atomic_fetch_add(&p->next, 1);
+    if (i >= p->batch_count) {
+      return done;
+    }
+    GetStatus(&p->batch[i], mask);
+    done++;
+  }
+}
+
+static void* RunStatusThread(void* context) {
+  StatusEngine* e = context;
+  Pool* p = &e->pool;
+  uint64_t seen = 0;
+  pthread_mutex_lock(&p->lock);
+  while (true) {
+    while (!p->stopping && p->generation == seen) {
+      pthread_cond_wait(&p->start, &p->lock);
+    }
+    if (p->stopping) {
+      pthread_mutex_unlock(&p->lock);
+      return NULL;
+    }
+    seen = p->generation;
+    p->active++;
+    pthread_mutex_unlock(&p->lock);
+
+    const size_t done = DrainBatch(p, e->mask);
+
+    pthread_mutex_lock(&p->lock);
+    p->finished += done;
+    p->active--;
+    if (p->active == 0) {
+      pthread_cond_signal(&p->done);
+    }
+  }
+}
+
+static void StartPool(StatusEngine* e) {
+  Pool* p = &e->pool;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start, NULL);
+  pthread_cond_init(&p->done, NULL);
+  // The calling thread works too, so it needs 1 fewer helper.
+  const size_t count = (e->depth < MAX_THREADS ? e->depth : MAX_THREADS) - 1;
+  p->threads = calloc(count ? count : 1, sizeof(pthread_t));
+  if (!p->threads) {
+    Die(errno, "calloc");
+  }
+  for (size_t i = 0; i < count; i++) {
+    const int error = pthread_create(&p->threads[i], NULL, RunStatusThread, e);
+    if (error) {
+      Warn(error, "pthread_create");
+      break;
+    }
+    p->count++;
+  }
+}
+
+static void PoolGetStatuses(StatusEngine* e,
+                            StatusRequest* requests,
+                            size_t count) {
+  Pool* p = &e->pool;
+  if (p->count == 0 || count == 1) {
+    for (size_t i = 0; i < count; i++) {
+      GetStatus(&requests[i], e->mask);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->batch = requests;
+  p->batch_count = count;
+  atomic_store(&p->next, 0);
+  p->finished = 0;
+  p->generation++;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+
+  const size_t done = DrainBatch(p, e->mask);
+
+  pthread_mutex_lock(&p->lock);
+  p->finished += done;
+  while (p->finished < count || p->active) {
+    pthread_cond_wait(&p->done, &p->lock);
+  }
+  p->batch = NULL;
+  p->batch_count = 0;
+  pthread_mutex_unlock(&p->lock);
+}
+
+StatusEngine* NewStatusEngine(unsigned fields, size_t depth) {
+  StatusEngine* e = calloc(1, sizeof(StatusEngine));
+  if (!e) {
+    Die(errno, "calloc");
+  }
+  e->depth = depth ? depth : 1;
+#ifdef __linux__
+  e->mask = StatxMask(fields);
+#else
+  (void)fields;
+#endif
+#ifdef USE_IO_URING
+  e->use_ring = e->depth > 1 && e->depth <= UINT32_MAX &&
+                OpenRing(&e->ring, (unsigned)e->depth);
+  if (e->use_ring) {
+    return e;
+  }
+#endif
+  StartPool(e);
+  return e;
+}
+
+void GetStatuses(StatusEngine* e, StatusRequest* requests, size_t count) {
+#ifdef USE_IO_URING
+  if (e->use_ring) {
+    if (count == 1) {
+      GetStatus(&requests[0], e->mask);
+      return;
+    }
+    if (RingGetStatuses(&e->ring, (unsigned)e->depth, e->mask, requests,
+                        count)) {
+      return;
+    }
+    // The ring itself failed; finish the job with threads from now on.
+    CloseRing(&e->ring);
+    e->use_ring = false;
+    StartPool(e);
+  }
+#endif
+  PoolGetStatuses(e, requests, count);
+}
+
+void FreeStatusEngine(StatusEngine** p) {
+  StatusEngine* e = *p;
+  if (!e) {
+    return;
+  }
+#ifdef USE_IO_URING
+  if (e->use_ring) {
+    CloseRing(&e->ring);
+    free(e);
+    *p = NULL;
+    return;
+  }
+#endif
+  Pool* pool = &e->pool;
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 0; i < pool->count; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->lock);
+  free(e);
+  *p = NULL;
+}
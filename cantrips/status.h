@@ -0,0 +1,50 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+// The fields of `struct stat` that a caller of `GetStatuses` needs. Asking for
+// fewer lets filesystems that can (notably network filesystems) skip work.
+// `st_dev` is always filled in.
+typedef enum StatusField {
+  StatusFieldType = 1 << 0,
+  StatusFieldMode = 1 << 1,
+  StatusFieldOwner = 1 << 2,
+  StatusFieldTimes = 1 << 3,
+  StatusFieldSize = 1 << 4,
+  StatusFieldInode = 1 << 5,
+  StatusFieldAll = (1 << 6) - 1,
+} StatusField;
+
+// One `fstatat` to be done by `GetStatuses`. The caller fills in `directory`
+// (or `AT_FDCWD`), `name`, and `flags` (e.g. `AT_SYMLINK_NOFOLLOW`), and
+// `GetStatuses` fills in `error` (0 or an error number) and `status`.
+typedef struct StatusRequest {
+  int directory;
+  const char* name;
+  int flags;
+  int error;
+  struct stat status;
+} StatusRequest;
+
+// Fetches file statuses in batches. On Linux, it submits `statx` requests
+// through an io_uring, so that a whole batch waits on the filesystem at once.
+// Where io_uring is unavailable, a pool of threads does the same with blocking
+// calls. An engine must be used by only 1 thread at a time.
+typedef struct StatusEngine StatusEngine;
+
+// Returns a new `StatusEngine` that fetches the `StatusField`s in `fields`,
+// with up to `depth` requests in flight at once.
+StatusEngine* NewStatusEngine(unsigned fields, size_t depth);
+
+// Completes all `count` `requests`, and returns when they are done.
+void GetStatuses(StatusEngine* e, StatusRequest* requests, size_t count);
+
+// Destroys `*e`. See `AUTO`.
+void FreeStatusEngine(StatusEngine** e);
+
+#endif
@@ -0,0 +1,150 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "testing.h"
+#include "utils.h"
+
+void CreateFile(int directory, const char* name) {
+  const int fd = openat(directory, name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0 || close(fd)) {
+    Die(errno, "%s", name);
+  }
+}
+
+void RemoveAll(int directory, const char* name) {
+  const int d =
+      openat(directory, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (d < 0) {
+    Die(errno, "%s", name);
+  }
+  AUTO(Entries, entries, (Entries){0}, FreeEntries);
+  const int e = ReadEntries(d, &entries);
+  if (e) {
+    Die(e, "%s", name);
+  }
+  for (size_t i = 0; i < entries.count; i++) {
+    const Entry* entry = &entries.values[i];
+    if (entry->type == DT_DIR) {
+      RemoveAll(d, entry->name);
+    } else if (unlinkat(d, entry->name, 0)) {
+      Die(errno, "%s", entry->name);
+    }
+  }
+  close(d);
+  if (unlinkat(directory, name, AT_REMOVEDIR)) {
+    Die(errno, "%s", name);
+  }
+}
+
+bool DropCaches(void) {
+  sync();
+  const int fd = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  const bool ok = write(fd, "3", 1) == 1;
+  close(fd);
+  return ok;
+}
+
+bool RunProgram(char* const* arguments,
+                const char* directory,
+                size_t file_limit,
+                OnOutput* f,
+                void* context) {
+  int fds[2];
+  if (pipe(fds)) {
+    Die(errno, "pipe");
+  }
+  const pid_t child = fork();
+  if (child < 0) {
+    Die(errno, "fork");
+  } else if (child == 0) {
+    if (file_limit) {
+      const struct rlimit limit = {.rlim_cur = file_limit,
+                                   .rlim_max = file_limit};
+      if (setrlimit(RLIMIT_NOFILE, &limit)) {
+        Die(errno, "setrlimit");
+      }
+    }
+    if (dup2(fds[1], STDOUT_FILENO) < 0) {
+      Die(errno, "dup2");
+    }
+    close(fds[0]);
+    close(fds[1]);
+    if (directory && chdir(directory)) {
+      Die(errno, "%s", directory);
+    }
+    execv(arguments[0], arguments);
+    Die(errno, "%s", arguments[0]);
+  }
+
+  close(fds[1]);
+  char buffer[64 * 1024];
+  while (true) {
+    const ssize_t count = read(fds[0], buffer, sizeof(buffer));
+    if (count < 0 && errno == EINTR) {
+      continue;
+    } else if (count < 0) {
+      Die(errno, "read");
+    } else if (count == 0) {
+      break;
+    }
+    f(context, buffer, (size_t)count);
+  }
+  close(fds[0]);
+
+  int status;
+  if (waitpid(child, &status, 0) < 0) {
+    Die(errno, "waitpid");
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void CountRecords(void* context, const char* bytes, size_t count) {
+  size_t* records = context;
+  for (size_t i = 0; i < count; i++) {
+    *records += bytes[i] == '\n';
+  }
+}
+
+typedef struct Collected {
+  size_t count;
+  size_t capacity;
+  char* values;
+} Collected;
+
+static void Collect(void* context, const char* bytes, size_t count) {
+  Collected* c = context;
+  if (c->count + count + 1 > c->capacity) {
+    while (c->count + count + 1 > c->capacity) {
+      c->capacity = c->capacity ? c->capacity * 2 : 4096;
+    }
+    char* values = realloc(c->values, c->capacity);
+    if (!values) {
+      Die(errno, "realloc");
+    }
+    c->values = values;
+  }
+  memcpy(&c->values[c->count], bytes, count);
+  c->count += count;
+}
+
+char* ReadProgram(char* const* arguments, const char* directory, bool* ok) {
+  Collected c = {0};
+  Collect(&c, "", 0);
+  if (!RunProgram(arguments, directory, 0, Collect, &c)) {
+    *ok = false;
+  }
+  c.values[c.count] = '\0';
+  return c.values;
+}
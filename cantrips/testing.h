@@ -0,0 +1,44 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#ifndef TESTING_H
+#define TESTING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Helpers shared by the `*_test` programs, which build temporary trees and run
+// the cantrips on them.
+
+// Creates the empty file `name` in the directory open as `directory`, or dies.
+void CreateFile(int directory, const char* name);
+
+// Removes `name`, in the directory open as `directory`, and everything under
+// it, or dies.
+void RemoveAll(int directory, const char* name);
+
+// Empties the page, dentry, and inode caches. Returns false if not permitted
+// (usually, to any but root).
+bool DropCaches(void);
+
+// Called by `RunProgram` with each piece of what the program prints.
+typedef void OnOutput(void* context, const char* bytes, size_t count);
+
+// Runs the program `arguments[0]` with `arguments` (ending with `NULL`), in
+// `directory` unless it is `NULL`, and if `file_limit` is not 0, allowed only
+// that many open files. Calls `f` with what it prints to stdout as it goes.
+// Reports whether it exited successfully.
+bool RunProgram(char* const* arguments,
+                const char* directory,
+                size_t file_limit,
+                OnOutput* f,
+                void* context);
+
+// An `OnOutput` that adds the number of newlines to the `size_t` `context`.
+void CountRecords(void* context, const char* bytes, size_t count);
+
+// Runs the program as `RunProgram` does, and returns all it printed, which the
+// caller must free. Sets `*ok` to false if it did not exit successfully.
+char* ReadProgram(char* const* arguments, const char* directory, bool* ok);
+
+#endif
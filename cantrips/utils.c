@@ -1,17 +1,27 @@
 // Copyright 2024 Chris Palmer, https://noncombatant.org/
 // SPDX-License-Identifier: MIT
 
+#define _DEFAULT_SOURCE
 #define _POSIX_C_SOURCE 200809L
 #define _XOPEN_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "dfa.h"
 #include "utils.h"
 
 size_t CountUTF8(const char* s, size_t count) {
@@ -66,6 +76,217 @@ void MustCloseProcess(FILE** p) {
   }
 }
 
+static void ReservePath(Path* p, size_t count) {
+  if (count <= p->capacity) {
+    return;
+  }
+  size_t capacity = p->capacity ? p->capacity : 256;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+  char* values = realloc(p->values, capacity);
+  if (!values) {
+    Die(errno, "realloc");
+  }
+  p->values = values;
+  p->capacity = capacity;
+}
+
+void SetPath(Path* p, const char* pathname) {
+  const size_t length = strlen(pathname);
+  ReservePath(p, length + 1);
+  memcpy(p->values, pathname, length + 1);
+  p->count = length;
+}
+
+size_t AppendPath(Path* p, const char* name, size_t length) {
+  const size_t old = p->count;
+  ReservePath(p, old + length + 2);
+  p->values[old] = '/';
+  memcpy(&p->values[old + 1], name, length);
+  p->count = old + length + 1;
+  p->values[p->count] = '\0';
+  return old;
+}
+
+void TruncatePath(Path* p, size_t length) {
+  p->count = length;
+  p->values[length] = '\0';
+}
+
+void ReplacePathSuffix(Path* p,
+                       size_t length,
+                       const char* suffix,
+                       size_t count) {
+  ReservePath(p, length + count + 1);
+  memcpy(&p->values[length], suffix, count);
+  p->count = length + count;
+  p->values[p->count] = '\0';
+}
+
+void FreePath(Path* p) {
+  free(p->values);
+  *p = (Path){0};
+}
+
+// The layout `getdents64` fills in. On other platforms, `ReadEntries` writes
+// the same layout itself, so that there is only one way to index the result.
+typedef struct RawEntry {
+  uint64_t inode;
+  int64_t offset;
+  uint16_t size;
+  unsigned char type;
+  char name[];
+} RawEntry;
+
+// How much space to offer each call to `getdents64`. Larger buffers mean fewer
+// system calls for large directories.
+#define READ_ENTRIES_SIZE (64 * 1024)
+
+static char* GrowEntries(Entries* e, size_t count) {
+  if (e->capacity - e->size < count) {
+    size_t capacity = e->capacity ? e->capacity : READ_ENTRIES_SIZE;
+    while (capacity - e->size < count) {
+      capacity *= 2;
+    }
+    char* buffer = realloc(e->buffer, capacity);
+    if (!buffer) {
+      Die(errno, "realloc");
+    }
+    e->buffer = buffer;
+    e->capacity = capacity;
+  }
+  return &e->buffer[e->size];
+}
+
+static bool IsDotOrDotDot(const char* name) {
+  return name[0] == '.' &&
+         (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+static unsigned char ModeToType(mode_t mode) {
+  if (S_ISREG(mode)) {
+    return DT_REG;
+  } else if (S_ISDIR(mode)) {
+    return DT_DIR;
+  } else if (S_ISLNK(mode)) {
+    return DT_LNK;
+  } else if (S_ISFIFO(mode)) {
+    return DT_FIFO;
+  } else if (S_ISSOCK(mode)) {
+    return DT_SOCK;
+  } else if (S_ISCHR(mode)) {
+    return DT_CHR;
+  } else if (S_ISBLK(mode)) {
+    return DT_BLK;
+  }
+  return DT_UNKNOWN;
+}
+
+#ifdef __linux__
+static int ReadRawEntries(int directory, Entries* result) {
+  while (true) {
+    // Offer whatever space is left, so long as it fits the largest possible
+    // entry. Insisting on a whole `READ_ENTRIES_SIZE` for the final call, which
+    // returns nothing, would double the buffer for every directory.
+    char* start = GrowEntries(result, sizeof(RawEntry) + NAME_MAX + 1);
+    const long n = syscall(SYS_getdents64, directory, start,
+                           result->capacity - result->size);
+    if (n < 0) {
+      return errno;
+    } else if (n == 0) {
+      return 0;
+    }
+    result->size += (size_t)n;
+  }
+}
+#else
+static int ReadRawEntries(int directory, Entries* result) {
+  const int d = dup(directory);
+  if (d < 0) {
+    return errno;
+  }
+  AUTO(DIR*, dir, fdopendir(d), CloseDir);
+  if (!dir) {
+    const int e = errno;
+    close(d);
+    return e;
+  }
+  while (true) {
+    errno = 0;
+    const struct dirent* e = readdir(dir);
+    if (!e) {
+      return errno;
+    }
+    const size_t length = strlen(e->d_name);
+    const size_t size =
+        (offsetof(RawEntry, name) + length + 1 + 7) & ~(size_t)7;
+    RawEntry* r = (RawEntry*)GrowEntries(result, size);
+    r->inode = (uint64_t)e->d_ino;
+    r->offset = 0;
+    r->size = (uint16_t)size;
+    r->type = e->d_type;
+    memcpy(r->name, e->d_name, length + 1);
+    result->size += size;
+  }
+}
+#endif
+
+int ReadEntries(int directory, Entries* result) {
+  result->size = 0;
+  result->count = 0;
+  const int error = ReadRawEntries(directory, result);
+
+  // A walk keeps the entries of every directory on its way down, so don't hold
+  // on to more than they need.
+  if (result->size && result->capacity - result->size >= 4096) {
+    char* buffer = realloc(result->buffer, result->size);
+    if (buffer) {
+      result->buffer = buffer;
+      result->capacity = result->size;
+    }
+  }
+
+  size_t count = 0;
+  for (size_t i = 0; i < result->size;) {
+    const RawEntry* r = (const RawEntry*)&result->buffer[i];
+    count++;
+    i += r->size;
+  }
+  Entry* values = realloc(result->values, (count ? count : 1) * sizeof(Entry));
+  if (!values) {
+    Die(errno, "realloc");
+  }
+  result->values = values;
+
+  for (size_t i = 0; i < result->size;) {
+    RawEntry* r = (RawEntry*)&result->buffer[i];
+    i += r->size;
+    if (IsDotOrDotDot(r->name)) {
+      continue;
+    }
+    if (r->type == DT_UNKNOWN) {
+      struct stat status;
+      if (fstatat(directory, r->name, &status, AT_SYMLINK_NOFOLLOW) == 0) {
+        r->type = ModeToType(status.st_mode);
+      }
+    }
+    Entry* e = &result->values[result->count];
+    e->name = r->name;
+    e->length = strlen(r->name);
+    e->inode = r->inode;
+    e->type = r->type;
+    result->count++;
+  }
+  return error;
+}
+
+void FreeEntries(Entries* e) {
+  free(e->values);
+  free(e->buffer);
+  *e = (Entries){0};
+}
+
 size_t LastIndex(const char* s, size_t length, char c) {
   for (size_t i = length; i > 0; i--) {
     const size_t j = i - 1;
@@ -95,6 +316,30 @@ VMustPrintf(FILE* output, const char* format, va_list arguments) {
   }
 }
 
+const char* FindGlobBracketEnd(const char* g, size_t length) {
+  const char* end = g + length;
+  g++;
+  if (g < end && (*g == '!' || *g == '^')) {
+    g++;
+  }
+  if (g < end && *g == ']') {
+    g++;
+  }
+  for (; g < end && *g != ']'; g++) {
+    if (g + 1 < end && g[0] == '[' && g[1] == ':') {
+      const char* c = g + 2;
+      while (c + 1 < end && !(c[0] == ':' && c[1] == ']')) {
+        c++;
+      }
+      if (c + 1 >= end) {
+        return NULL;
+      }
+      g = c + 1;
+    }
+  }
+  return g < end ? g : NULL;
+}
+
 size_t Format(char* result, size_t size, const char* format, ...) {
   va_list arguments;
   va_start(arguments, format);
@@ -141,16 +386,178 @@ void noreturn Die(int error, const char* format, ...) {
   _exit(error);
 }
 
+static void WriteAll(int fd, struct iovec* vectors, int count) {
+  while (count) {
+    const ssize_t r = writev(fd, vectors, count);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      Die(errno, "write");
+    }
+    // Skip past what was written, in case it was not everything.
+    size_t written = (size_t)r;
+    while (count && written >= vectors->iov_len) {
+      written -= vectors->iov_len;
+      vectors++;
+      count--;
+    }
+    if (count) {
+      vectors->iov_base = (char*)vectors->iov_base + written;
+      vectors->iov_len -= written;
+    }
+  }
+}
+
+// Writes out the contents of `o` and then the `count` `bytes`, together.
+static void WriteOutput(Output* o, const char* bytes, size_t count) {
+  struct iovec vectors[2];
+  int n = 0;
+  if (o->count) {
+    vectors[n] = (struct iovec){.iov_base = o->values, .iov_len = o->count};
+    n++;
+  }
+  if (count) {
+    vectors[n] =
+        (struct iovec){.iov_base = (void*)(uintptr_t)bytes, .iov_len = count};
+    n++;
+  }
+  if (o->lock) {
+    pthread_mutex_lock(o->lock);
+  }
+  WriteAll(o->fd, vectors, n);
+  if (o->lock) {
+    pthread_mutex_unlock(o->lock);
+  }
+  o->count = 0;
+}
+
+void FlushOutput(Output* o) {
+  if (o->count) {
+    WriteOutput(o, NULL, 0);
+  }
+}
+
+void CloseOutput(Output* o) {
+  FlushOutput(o);
+}
+
+void ReserveOutput(Output* o, size_t count) {
+  if (count > o->capacity - o->count) {
+    FlushOutput(o);
+  }
+}
+
+void AppendBytes(Output* o, const char* bytes, size_t count) {
+  if (count > o->capacity - o->count) {
+    if (count >= o->capacity) {
+      // It would not fit even in an empty buffer; write it straight from
+      // `bytes`.
+      WriteOutput(o, bytes, count);
+      return;
+    }
+    FlushOutput(o);
+  }
+  memcpy(&o->values[o->count], bytes, count);
+  o->count += count;
+}
+
+void AppendString(Output* o, const char* s) {
+  AppendBytes(o, s, strlen(s));
+}
+
+void AppendChar(Output* o, char c) {
+  if (o->count == o->capacity) {
+    FlushOutput(o);
+  }
+  o->values[o->count] = c;
+  o->count++;
+}
+
+void AppendPadded(Output* o, const char* s, size_t width) {
+  const size_t length = strlen(s);
+  AppendBytes(o, s, length);
+  for (size_t i = length; i < width; i++) {
+    AppendChar(o, ' ');
+  }
+}
+
+void AppendInteger(Output* o, int64_t n, size_t width, char pad) {
+  char digits[24];
+  size_t i = sizeof(digits);
+  uint64_t u = n < 0 ? -(uint64_t)n : (uint64_t)n;
+  do {
+    i--;
+    digits[i] = (char)('0' + u % 10);
+    u /= 10;
+  } while (u);
+  size_t length = sizeof(digits) - i;
+  if (n < 0) {
+    length++;
+    if (pad == '0') {
+      AppendChar(o, '-');
+    } else {
+      i--;
+      digits[i] = '-';
+    }
+  }
+  for (; length < width; length++) {
+    AppendChar(o, pad);
+  }
+  AppendBytes(o, &digits[i], sizeof(digits) - i);
+}
+
 Regex CompileRegex(const char* pattern, int flags) {
   Regex status = {0};
   status.error = regcomp(&status.value, pattern, flags);
+  if (!status.error) {
+    status.dfa = NewDfa(pattern, flags);
+  }
   return status;
 }
 
 void FreeRegex(Regex* r) {
   if (r && r->error == 0) {
     regfree(&r->value);
+    FreeDfa(&r->dfa);
+  }
+}
+
+bool MatchRegex(const Regex* r, const char* s) {
+  if (r->dfa) {
+    const DfaResult d = RunDfa(r->dfa, s);
+    if (d != DfaUnknown) {
+      return d == DfaMatch;
+    }
+  }
+  return regexec(&r->value, s, 0, NULL, 0) == 0;
+}
+
+bool MatchRegexBytes(const Regex* r, const char* s, size_t length) {
+  if (r->dfa) {
+    const DfaResult d = RunDfaBytes(r->dfa, s, length);
+    if (d != DfaUnknown) {
+      return d == DfaMatch;
+    }
+  }
+  regmatch_t bounds = {.rm_so = 0, .rm_eo = (regoff_t)length};
+  return regexec(&r->value, s, 1, &bounds, REG_STARTEND) == 0;
+}
+
+int FindRegex(const Regex* r, const char* s, regmatch_t* match) {
+  if (r->dfa) {
+    size_t start;
+    size_t end;
+    const DfaResult d = FindDfa(r->dfa, s, &start, &end);
+    if (d == DfaMatch) {
+      match->rm_so = (regoff_t)start;
+      match->rm_eo = (regoff_t)end;
+      return 0;
+    } else if (d == DfaNoMatch) {
+      return REG_NOMATCH;
+    }
   }
+  return regexec(&r->value, s, 1, match, 0);
 }
 
 void PrintRegexError(int error, const regex_t* regex) {
@@ -7,9 +7,11 @@
 #include <assert.h>
 #include <dirent.h>
 #include <limits.h>
+#include <pthread.h>
 #include <regex.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdnoreturn.h>
 #include <time.h>
 
@@ -83,10 +85,71 @@ typedef struct Chars {
   char* values;
 } Chars;
 
+// A growable pathname, extended and truncated in place one component at a
+// time as a walk descends and returns.
+typedef struct Path {
+  size_t count;
+  size_t capacity;
+  char* values;
+} Path;
+
+// Replaces the contents of `p` with the C string `pathname`.
+void SetPath(Path* p, const char* pathname);
+
+// Appends '/' and the first `length` bytes of `name` to `p`. Returns the length
+// `p` had before, to be passed to `TruncatePath` when done with `name`.
+size_t AppendPath(Path* p, const char* name, size_t length);
+
+// Restores `p` to its first `length` bytes.
+void TruncatePath(Path* p, size_t length);
+
+// Truncates `p` to its first `length` bytes, and then appends the first `count`
+// bytes of `suffix`, with no separator.
+void ReplacePathSuffix(Path* p,
+                       size_t length,
+                       const char* suffix,
+                       size_t count);
+
+// Destroys `*p`. See `AUTO`.
+void FreePath(Path* p);
+
+// A directory entry, as read by `ReadEntries`. `type` is one of the `DT_*`
+// constants; it is `DT_UNKNOWN` only if the entry could not be `fstatat`ed.
+typedef struct Entry {
+  const char* name;
+  size_t length;
+  uint64_t inode;
+  unsigned char type;
+} Entry;
+
+// A vector of `Entry`s. The names point into `buffer`, which holds `size`
+// bytes of raw entries and has room for `capacity`.
+typedef struct Entries {
+  size_t count;
+  Entry* values;
+  size_t size;
+  size_t capacity;
+  char* buffer;
+} Entries;
+
+// Reads all the entries (except "." and "..") of the directory open as
+// `directory` into `result`, replacing its contents. On Linux this reads in
+// bulk with `getdents64`. For filesystems that do not report entry types,
+// `fstatat`s just the affected entries. Returns 0, or an error number.
+int ReadEntries(int directory, Entries* result);
+
+// Destroys `*e`. See `AUTO`.
+void FreeEntries(Entries* e);
+
 // Returns the position of the last instance of `c` in the string `s`, of
 // `length` bytes, or `SIZE_MAX` to indicate not found.
 size_t LastIndex(const char* s, size_t length, char c);
 
+// Returns the `]` that ends the glob(7) bracket expression that starts at `g`,
+// of up to `length` bytes, or `NULL` if there is none (in which case the `[` is
+// literal).
+const char* FindGlobBracketEnd(const char* g, size_t length);
+
 // Formats the string specified by `format` into `result` (see `vsnprintf`),
 // writing no more than `size` characters. Always `NUL`-terminates `result`.
 // Returns the number of characters that would have been written into `result`
@@ -112,20 +175,79 @@ void Warn(int error, const char* format, ...)
 void noreturn Die(int error, const char* format, ...)
     __attribute__((__format__(__printf__, 2, 0)));
 
-// A result type for `regex_t`.
+// A buffer of output bound for the file descriptor `fd`, filled by the
+// `Append*` functions below without `stdio`'s locking and format parsing, and
+// written with a single `write` (or `writev`) when it fills and when it is
+// flushed. A record appended with a single call, or after `ReserveOutput`, is
+// never split between writes, unless it is larger than the buffer.
+//
+// The caller provides `values`, of `capacity` bytes. If `lock` is not `NULL`,
+// writes happen under it, so that several `Output`s (e.g. one per thread) can
+// share a file descriptor without their records interleaving.
+typedef struct Output {
+  int fd;
+  size_t count;
+  size_t capacity;
+  char* values;
+  pthread_mutex_t* lock;
+} Output;
+
+// Writes out and empties `o`. `Die`s on error.
+void FlushOutput(Output* o);
+
+// Flushes `*o`. See `AUTO`.
+void CloseOutput(Output* o);
+
+// Flushes `o` if it does not have room for `count` more bytes.
+void ReserveOutput(Output* o, size_t count);
+
+// Appends the `count` `bytes` to `o`, flushing it first if they do not fit.
+void AppendBytes(Output* o, const char* bytes, size_t count);
+
+// Appends the C string `s` to `o`.
+void AppendString(Output* o, const char* s);
+
+// Appends `c` to `o`.
+void AppendChar(Output* o, char c);
+
+// Appends `s` to `o`, followed by enough spaces to make `width` characters
+// (like `printf`'s `%-*s`).
+void AppendPadded(Output* o, const char* s, size_t width);
+
+// Appends `n` in decimal to `o`, preceded by enough `pad` characters to make
+// `width` characters (like `printf`'s `%*lld` or `%0*lld`).
+void AppendInteger(Output* o, int64_t n, size_t width, char pad);
+
+// A result type for `regex_t`. If `dfa` is not `NULL`, it matches the same
+// strings as `value`, much faster. See dfa.h.
 typedef struct Regex {
   int error;
   regex_t value;
+  struct Dfa* dfa;
 } Regex;
 
 // Attempts to compile `pattern` into a `regex_t`, with `flags`. If successful,
 // `Regex.error` will be 0 and `Regex.value` will be a valid RE; otherwise,
-// `.error` will indicate the error.
+// `.error` will indicate the error. If the pattern and `flags` are simple
+// enough, also builds a DFA for it.
 Regex CompileRegex(const char* pattern, int flags);
 
 // Destroys `*r`.
 void FreeRegex(Regex* r);
 
+// Reports whether `r` matches anywhere in `s`, like `regexec` with no
+// `regmatch_t`s.
+bool MatchRegex(const Regex* r, const char* s);
+
+// Like `MatchRegex`, but for the `length` bytes at `s`, which need not be
+// `NUL`-terminated (see `REG_STARTEND`).
+bool MatchRegexBytes(const Regex* r, const char* s, size_t length);
+
+// Like `regexec` with 1 `regmatch_t`: finds the leftmost-longest match of `r`
+// in `s` and stores its bounds in `*match`. Returns 0, `REG_NOMATCH`, or
+// another error.
+int FindRegex(const Regex* r, const char* s, regmatch_t* match);
+
 // Prints the `regex` `error` to `stderr`.
 void PrintRegexError(int error, const regex_t* regex);
 
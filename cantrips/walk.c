@@ -1,24 +1,46 @@
 // Copyright 2024 Chris Palmer, https://noncombatant.org/
 // SPDX-License-Identifier: MIT
 
-#define _DEFAULT_SOURCE
-#define _XOPEN_SOURCE
+#define _GNU_SOURCE
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
-#include <libgen.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <regex.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdnoreturn.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
+#include <sysexits.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#elif defined(__MACH__)
+#include <sys/resource.h>
+#endif
+
+#include "census.h"
 #include "cli.h"
+#include "dfa.h"
+#include "duplicates.h"
+#include "ignore.h"
+#include "inodes.h"
+#include "mounts.h"
+#include "search.h"
+#include "snapshot.h"
+#include "sorter.h"
+#include "status.h"
 #include "utils.h"
+#include "watch.h"
 
 // clang-format off
 static char description[] =
@@ -26,13 +48,37 @@ static char description[] =
 "\n"
 "    walk [options...] [pathnames...]\n"
 "\n"
-"Patterns are case-insensitive POSIX extended regular expressions; refer to re_format(7).\n"
+"Patterns are case-insensitive POSIX extended regular expressions; refer to re_format(7). Where the -m pattern can match nothing under a directory (as ^/usr/share rules out /usr/lib), walk does not read it.\n"
 "\n"
 "Date-times are in the format %Y-%m-%d %H:%M:%S, %Y-%m-%d, or %H:%M:%S; refer to strptime(3).\n"
 "\n"
-"File types is a string containing 1 or more of 'd'irectory, 'f'file, or 's'ymbolic link characters.\n"
+"Extensions is a comma-separated list of file name extensions, like c,h,go. Globs is a comma-separated list of shell patterns, like 'makefile,*.mk'; refer to glob(7). Both match only file names, case-insensitively, and are cheaper than patterns. Given both, files whose names match either match.\n"
+"\n"
+"File types is a string containing 1 or more of 'd'irectory, 'f'file, or 's'ymbolic link characters. With -L, symbolic links have the type of what they refer to, and only dangling ones are 's'.\n"
+"\n"
+"Sizes can be given in any base; refer to strtoll(3).\n"
+"\n"
+"An expression is made of tests, written as the options -n, -e, -m, -t, -S, -s, -a, and -b with their values; ! to negate a test; parentheses to group tests; and -o between tests, either of which must be true. Tests side by side must all be true, and the expression must be true as well as the other options. For example, -E '( -e c,h -o -n makefile ) ! -S 100000'. Values can be double-quoted to contain spaces. As it goes, walk runs first the tests that have most often decided the result for the least cost, so that most files are ruled out before their status is read, if ever.\n"
+"\n"
+"With -g, files that look binary (having a NUL byte in their first 8000) are skipped.\n"
+"\n"
+"With -C, walk prints a census of the matching files rather than their pathnames: records of a category, a label, a number of files, and their bytes, separated by tabs. Files are counted by type (file, directory, symlink, or other); regular files are also counted by extension (lowercased, or (none), with those beyond the given number counted together as (rest)), by size, and by age in days since modification. Sizes and ages are grouped by powers of 2, each labeled with its least value. With -j, each thread counts separately, and the counts are added up at the end. -C cannot be used with -u, -D, -U, -o, -c, -w, or -g.\n"
+"\n"
+"With -D, a directory's disk usage is that of the matching files and directories under it, at any depth, counting each hard-linked file once; -A -D n reports what du(1) would.\n"
+"\n"
+"With -U, files are compared by size, then by a hash of their first and last 4 KiB, and only then by a hash of their whole contents, so that most are never read in full. Empty files, and hard links to the same file, do not count as duplicates. Each group is followed by an empty record, and a summary of the space that deleting all but 1 file of each group would reclaim goes to stderr.\n"
 "\n"
-"Sizes can be given in any base; refer to strtoll(3).";
+"With -w, walk writes a snapshot of the matching files (their pathnames relative to the root, types, inode numbers, sizes, and modification times) to a file. With -c, it compares the tree with such a snapshot and prints the files added, deleted, or modified since, as A, D, or M, a tab, and the pathname. Given both, it compares with one snapshot and writes the next; they can be the same file. Either way, walk sorts each directory's entries as it goes, so that memory use does not grow with the size of the tree. Both runs should use the same root and tests, and neither can use -j, -u, -D, -U, or -g.\n"
+"\n"
+"With -o name, walk prints matches in order of pathname, as it would walk a tree whose directories were sorted: a directory, then what is under it, then its next sibling. (That is the order of sort(1) in the C locale, if '/' sorted before every other character.) With -o size or -o time, it prints them smallest or oldest first, and then by pathname. Sorting by size or time, or by name with -j, holds up to 64 MiB of pathnames in memory, and beyond that spills them to temporary files (in $TMPDIR, or /tmp) to merge at the end. -o cannot be used with -u, -D, -U, -c, -w, or -g.\n"
+"\n"
+"With -u, walk searches the directory and then each of its ancestors, nearest first. If -n gives only names, without wildcards, walk looks each up in each directory rather than reading it, so that the time taken does not grow with the size of the directories; they then match as the filesystem compares names (on most, case-sensitively).\n"
+"\n"
+"With -W, walk does not exit after walking, but waits for changes to the trees and tests only the files that changed, so that the cost is in proportion to the changes rather than to the size of the trees. Where permitted (usually, only to root), it watches whole filesystems with fanotify; otherwise, it watches each directory it walked with inotify, up to the limit in /proc/sys/fs/inotify/max_user_watches. A directory created or moved into a tree is walked in turn. Files are printed when closed after being written, when renamed, or when their status changes, and so can be printed more than once. -W works only on Linux, and cannot be used with -u, -L, -I, -D, -U, -o, -C, -c, or -w.\n"
+"\n"
+"With -x, walk finds where the tree crosses onto another device from the mount table, where there is one (/proc/self/mountinfo), rather than by checking the status of every file. It stops at mount points, without printing them. A directory on another device that has no entry of its own (as a btrfs subvolume) is found by its status when walk opens it, and so is not walked, but can be printed.\n"
+"\n"
+"To spare the other users of a busy system, -i idle (or low) does I/O at the idle (or lowest best-effort) priority, opens files without updating their access times where permitted, and drops the contents of files read by -g and -U from the page cache afterward. -r limits how many directories and file statuses walk reads per second (with -j, in total), and -v reports the rates achieved.";
 
 static Option options[] = {
   {
@@ -55,21 +101,106 @@ static Option options[] = {
     .description = "match files modified before",
     .value = { .type = OptionTypeDateTime }
   },
+  {
+    .flag = 'C',
+    .description = "instead of printing matches, print how many match and their bytes, by type, by extension (listing this many with the most bytes), by size, and by age",
+    .value = { .type = OptionTypeSize }
+  },
+  {
+    .flag = 'c',
+    .description = "instead of printing matches, compare them with this snapshot and print what changed",
+    .value = { .type = OptionTypeString }
+  },
+  {
+    .flag = 'D',
+    .description = "instead of printing matches, print the given number of directories whose matching files use the most disk space, in MiB, largest last",
+    .value = { .type = OptionTypeSize }
+  },
   {
     .flag = 'd',
     .description = "descend at most this many directory levels below the argument(s)",
     .value = { .type = OptionTypeInt }
   },
+  {
+    .flag = 'E',
+    .description = "match files for which this expression is true",
+    .value = { .type = OptionTypeString }
+  },
+  {
+    .flag = 'e',
+    .description = "match files whose names have one of these extensions",
+    .value = { .type = OptionTypeString }
+  },
+  {
+    .flag = 'f',
+    .description = "keep at most this many directories open, reopening the others as needed (can help with very deep trees)",
+    .value = { .type = OptionTypeSize, .z = 256 }
+  },
+  {
+    .flag = 'g',
+    .description = "instead of printing matching files, print their lines that match this pattern, as pathname:number<tab>line",
+    .value = { .type = OptionTypeString }
+  },
   {
     .flag = 'h',
     .description = "print help message",
     .value = { .type = OptionTypeBool }
   },
+  {
+    .flag = 'I',
+    .description = "skip what .gitignore and .ignore files say to ignore, and .git directories",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'i',
+    .description = "be gentle on a busy system, doing I/O at this priority: idle or low",
+    .value = { .type = OptionTypeString }
+  },
+  {
+    .flag = 'j',
+    .description = "number of threads to walk with (output order is then unspecified)",
+    .value = { .type = OptionTypeSize, .z = 1 }
+  },
+  {
+    .flag = 'L',
+    .description = "follow symbolic links, and walk each directory only once however many pathnames reach it",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'l',
+    .description = "with -u, stop after this many matches (1 finds the nearest)",
+    .value = { .type = OptionTypeSize }
+  },
   {
     .flag = 'm',
     .description = "match files whose pathnames match",
     .value = { .type = OptionTypeRegex }
   },
+  {
+    .flag = 'n',
+    .description = "match files whose names match one of these globs",
+    .value = { .type = OptionTypeString }
+  },
+  {
+    .flag = 'O',
+    .description = "fetch file statuses a directory at a time, in order of inode number (can help on disks that seek)",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'o',
+    .description = "print matches in order of this key: name, size, or time",
+    .value = { .type = OptionTypeString }
+  },
+  {
+    .flag = 'q',
+    .description = "number of file status requests to keep in flight (can help on slow or network filesystems)",
+    .value = { .type = OptionTypeSize, .z = 1 }
+  },
+  {
+    .flag = 'r',
+    .description = "read at most this many directories and file statuses per second",
+    .value = { .type = OptionTypeSize }
+  },
   {
     .flag = 'S',
     .description = "match files larger than this size",
@@ -85,11 +216,31 @@ static Option options[] = {
     .description = "match files of the given file types",
     .value = { .type = OptionTypeString }
   },
+  {
+    .flag = 'U',
+    .description = "instead of printing matches, print groups of matching regular files that have the same contents",
+    .value = { .type = OptionTypeBool }
+  },
   {
     .flag = 'u',
     .description = "search up the directory hierarchy rather than down",
     .value = { .type = OptionTypeBool }
   },
+  {
+    .flag = 'v',
+    .description = "when done, print to stderr how many directories were walked and file statuses read, and how fast (and with -L, how many directories were skipped, and the memory used to tell)",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'W',
+    .description = "after walking, keep watching the trees, and print files that come to match as they are created, modified, or moved in",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'w',
+    .description = "write a snapshot of the matching files to this file",
+    .value = { .type = OptionTypeString }
+  },
   {
     .flag = 'x',
     .description = "do not cross a device boundary when walking",
@@ -120,250 +271,2866 @@ typedef enum Type {
   TypeSymbolicLink = 4,
 } Type;
 
-typedef struct Predicate {
-  bool walk_all;
-  bool has_pattern;
-  regex_t pattern;
-  bool has_after;
-  time_t after;
-  bool has_before;
-  time_t before;
-  bool has_depth;
-  long long depth;
-  bool has_larger_than;
-  long long larger;
-  bool has_smaller_than;
-  long long smaller;
-  bool has_type;
-  Type type;
-  bool has_no_cross_device;
-  dev_t device;
-} Predicate;
-
-typedef enum Result {
-  ResultContinue = 0,
-  ResultStop = 1,
-} Result;
+// A set of file name extensions, in a perfect hash table: each extension has a
+// slot to itself, so looking a name up costs 1 hash and at most 1 comparison.
+typedef struct Extensions {
+  uint64_t seed;
+  size_t mask;
+  // Lowercase extensions, or `NULL` for empty slots.
+  char** slots;
+  size_t* lengths;
+} Extensions;
 
-static Result PrintIfMatch(const char* pathname,
-                           const struct dirent* entry,
-                           const Predicate* p) {
-  if (entry->d_name[0] == '.' && !p->walk_all) {
-    return ResultStop;
+static uint64_t HashExtension(const char* s, size_t length, uint64_t seed) {
+  uint64_t h = UINT64_C(14695981039346656037) ^ seed;
+  for (size_t i = 0; i < length; i++) {
+    h = (h ^ (uint64_t)tolower((unsigned char)s[i])) * UINT64_C(1099511628211);
   }
+  return h ^ h >> 29;
+}
 
-  // These tests are arranged such that the least expensive run first.
-  if (p->has_type) {
-    Type expected = TypeNone;
-    if (entry->d_type == DT_REG) {
-      expected = TypeFile;
-    } else if (entry->d_type == DT_DIR) {
-      expected = TypeDirectory;
-    } else if (entry->d_type == DT_LNK) {
-      expected = TypeSymbolicLink;
-    }
-    if ((p->type & expected) == 0) {
-      return ResultContinue;
+// Tries to place the `count` `extensions` in `x` without collisions, and
+// reports whether it could.
+static bool PlaceExtensions(Extensions* x, char** extensions, size_t count) {
+  memset(x->slots, 0, (x->mask + 1) * sizeof(char*));
+  for (size_t i = 0; i < count; i++) {
+    const size_t length = strlen(extensions[i]);
+    const size_t slot =
+        (size_t)HashExtension(extensions[i], length, x->seed) & x->mask;
+    if (x->slots[slot]) {
+      if (strcmp(x->slots[slot], extensions[i])) {
+        return false;
+      }
+      continue;  // A duplicate.
     }
+    x->slots[slot] = extensions[i];
+    x->lengths[slot] = length;
   }
+  return true;
+}
 
-  if (p->has_pattern && regexec(&p->pattern, pathname, 0, NULL, 0) != 0) {
-    return ResultContinue;
+// Parses the comma-separated `list` of extensions, which it modifies and which
+// must outlive the result.
+static Extensions NewExtensions(char* list) {
+  size_t count = 0;
+  char** extensions = malloc((strlen(list) / 2 + 1) * sizeof(char*));
+  if (!extensions) {
+    Die(errno, "malloc");
   }
-
-  if (p->has_after || p->has_before || p->has_larger_than ||
-      p->has_smaller_than || p->has_no_cross_device) {
-    struct stat status;
-    if (lstat(pathname, &status)) {
-      Warn(errno, "%s", pathname);
-      return ResultContinue;
+  char* state;
+  for (char* e = strtok_r(list, ",", &state); e;
+       e = strtok_r(NULL, ",", &state)) {
+    e += *e == '.';
+    for (char* c = e; *c; c++) {
+      *c = (char)tolower((unsigned char)*c);
     }
+    extensions[count] = e;
+    count++;
+  }
 
-    if (p->has_no_cross_device && p->device != status.st_dev) {
-      return ResultStop;
+  // With twice as many slots as extensions, a seed that works turns up in a
+  // few tries.
+  Extensions x = {.mask = 1};
+  while (x.mask + 1 < 2 * count) {
+    x.mask = x.mask << 1 | 1;
+  }
+  while (true) {
+    x.slots = calloc(x.mask + 1, sizeof(char*));
+    x.lengths = calloc(x.mask + 1, sizeof(size_t));
+    if (!x.slots || !x.lengths) {
+      Die(errno, "calloc");
     }
-
-    if ((p->has_after && status.st_mtime <= p->after) ||
-        (p->has_before && status.st_mtime >= p->before)) {
-      return ResultContinue;
+    for (x.seed = 0; x.seed < 64; x.seed++) {
+      if (PlaceExtensions(&x, extensions, count)) {
+        free(extensions);
+        return x;
+      }
     }
+    free(x.slots);
+    free(x.lengths);
+    x.mask = x.mask << 1 | 1;
+  }
+}
 
-    if ((p->has_larger_than && status.st_size <= p->larger) ||
-        (p->has_smaller_than && status.st_size >= p->smaller)) {
-      return ResultContinue;
+// Reports whether the file name `name`, of `length` bytes, has an extension in
+// `x`.
+static bool HasExtension(const Extensions* x, const char* name, size_t length) {
+  // A leading `.` marks a hidden file, not an extension.
+  size_t dot = length;
+  while (dot > 1 && name[dot - 1] != '.') {
+    dot--;
+  }
+  if (dot <= 1) {
+    return false;
+  }
+  const char* e = &name[dot];
+  const size_t n = length - dot;
+  const size_t slot = (size_t)HashExtension(e, n, x->seed) & x->mask;
+  return x->slots[slot] && x->lengths[slot] == n &&
+         strncasecmp(x->slots[slot], e, n) == 0;
+}
+
+// Compiles the comma-separated `globs` into a single regular expression that
+// matches the names that any of them match. A backslash quotes the next
+// character, including a comma.
+static Regex CompileGlobs(const char* globs) {
+  AUTO(char*, pattern, malloc(2 * strlen(globs) + 5), FreeChar);
+  if (!pattern) {
+    Die(errno, "malloc");
+  }
+  char* p = pattern;
+  p = stpcpy(p, "^(");
+  for (const char* g = globs; *g; g++) {
+    if (*g == ',') {
+      *p++ = '|';
+    } else if (*g == '*') {
+      p = stpcpy(p, ".*");
+    } else if (*g == '?') {
+      *p++ = '.';
+    } else if (*g == '[' && FindGlobBracketEnd(g, strlen(g))) {
+      // Copy the bracket expression, which ERE spells the same but for
+      // negation.
+      const char* end = FindGlobBracketEnd(g, strlen(g));
+      *p++ = *g++;
+      if (*g == '!' || *g == '^') {
+        *p++ = '^';
+        g++;
+      }
+      memcpy(p, g, (size_t)(end - g) + 1);
+      p += end - g + 1;
+      g = end;
+    } else {
+      if (*g == '\\' && g[1]) {
+        g++;
+      }
+      if (strchr(".[]^$()|*+?{}\\", *g)) {
+        *p++ = '\\';
+      }
+      *p++ = *g;
     }
   }
+  strcpy(p, ")$");
+  return CompileRegex(pattern, REG_EXTENDED | REG_ICASE | REG_NOSUB);
+}
 
-  MustPrintf(stdout, "%s%c", pathname, ors);
-  return ResultContinue;
+// Returns the `Type`s named in `s`, a string of file type characters.
+static Type ParseTypes(const char* s) {
+  Type type = TypeNone;
+  if (strchr(s, 'f')) {
+    type |= TypeFile;
+  }
+  if (strchr(s, 'd')) {
+    type |= TypeDirectory;
+  }
+  if (strchr(s, 's')) {
+    type |= TypeSymbolicLink;
+  }
+  return type;
 }
 
-static bool IsDotOrDotDot(const char* basename) {
-  return StringEquals(".", basename) || StringEquals("..", basename);
+// Returns the `Type` of a `DT_*` constant, or `TypeNone`.
+static Type GetType(unsigned char type) {
+  if (type == DT_REG) {
+    return TypeFile;
+  } else if (type == DT_DIR) {
+    return TypeDirectory;
+  } else if (type == DT_LNK) {
+    return TypeSymbolicLink;
+  }
+  return TypeNone;
 }
 
-static void Walk(const char* root, const Predicate* p, long depth) {
-  if (p->has_depth && depth > p->depth) {
-    return;
+typedef enum TestOp {
+  TestAnd,
+  TestOr,
+  TestNot,
+  TestType,
+  TestExtensions,
+  TestGlobs,
+  TestPattern,
+  TestLarger,
+  TestSmaller,
+  TestAfter,
+  TestBefore,
+} TestOp;
+
+// A node of a compiled -E expression. `TestAnd`, `TestOr`, and `TestNot` have
+// `count` children, listed in `Expression.children` from `first`.
+typedef struct Test {
+  TestOp op;
+  // A rough cost of running the test: more for regular expressions than for
+  // names, and most for tests that need the file's status, since they may cost
+  // a syscall. For operators, the sum of their children's.
+  unsigned cost;
+  size_t first;
+  size_t count;
+  union {
+    Type type;
+    Extensions extensions;
+    Regex regex;
+    long long size;
+    time_t time;
+  };
+} Test;
+
+// The -E expression, compiled into a tree of `Test`s. The children of each
+// operator start out in order of cost, so that the cheap tests run first.
+typedef struct Expression {
+  size_t count;
+  Test* tests;
+  size_t root;
+  size_t child_count;
+  size_t* children;
+  // The `StatusField`s the tests need, for the entries they cannot decide
+  // without.
+  unsigned status_fields;
+} Expression;
+
+typedef struct Parser {
+  char** tokens;
+  size_t count;
+  size_t next;
+  Expression* expression;
+} Parser;
+
+static noreturn void DieExpression(const char* message, const char* token) {
+  if (token) {
+    MustPrintf(stderr, "-E: %s: '%s'\n", message, token);
+  } else {
+    MustPrintf(stderr, "-E: %s at the end\n", message);
   }
-  AUTO(DIR*, d, opendir(root), CloseDir);
-  if (!d) {
-    Warn(errno, "%s", root);
-    return;
+  exit(EX_USAGE);
+}
+
+static size_t AddTest(Expression* e, Test t) {
+  Test* tests = realloc(e->tests, (e->count + 1) * sizeof(Test));
+  if (!tests) {
+    Die(errno, "realloc");
   }
+  e->tests = tests;
+  e->tests[e->count] = t;
+  e->count++;
+  return e->count - 1;
+}
 
-  while (true) {
-    const struct dirent* entry = readdir(d);
-    if (!entry) {
-      break;
-    }
-    if (IsDotOrDotDot(entry->d_name)) {
-      continue;
+// Adds an operator over the `count` tests in `children`, in order of cost.
+static size_t AddOperator(Expression* e,
+                          TestOp op,
+                          size_t* children,
+                          size_t count) {
+  for (size_t i = 1; i < count; i++) {
+    for (size_t j = i; j > 0 && e->tests[children[j - 1]].cost >
+                                    e->tests[children[j]].cost;
+         j--) {
+      const size_t t = children[j];
+      children[j] = children[j - 1];
+      children[j - 1] = t;
     }
+  }
+  size_t* all = realloc(e->children, (e->child_count + count) * sizeof(size_t));
+  if (!all) {
+    Die(errno, "realloc");
+  }
+  e->children = all;
+  Test t = {.op = op, .first = e->child_count, .count = count};
+  for (size_t i = 0; i < count; i++) {
+    all[e->child_count + i] = children[i];
+    t.cost += e->tests[children[i]].cost;
+  }
+  e->child_count += count;
+  return AddTest(e, t);
+}
 
-    char pathname[PATH_MAX + 1] = "";
-    const size_t length =
-        Format(pathname, sizeof(pathname), "%s/%s", root, entry->d_name);
-    if (length == SIZE_MAX) {
-      MustPrintf(stderr, "can't handle %s/%s\n", root, entry->d_name);
-      continue;
-    }
+static char* PeekToken(const Parser* q) {
+  return q->next < q->count ? q->tokens[q->next] : NULL;
+}
+
+static size_t ParseOr(Parser* q);
 
-    const Result r = PrintIfMatch(pathname, entry, p);
-    if (r != ResultStop && entry->d_type & DT_DIR) {
-      Walk(pathname, p, depth + 1);
+// Parses a test, written as the walk option for it, and its value.
+static size_t ParseTest(Parser* q) {
+  const char* flag = PeekToken(q);
+  if (!flag || flag[0] != '-' || !flag[1] || flag[2] ||
+      !strchr("abemnSst", flag[1])) {
+    DieExpression("expected a test", flag);
+  }
+  q->next++;
+  char* value = PeekToken(q);
+  if (!value) {
+    DieExpression("expected a value", flag);
+  }
+  q->next++;
+
+  Expression* e = q->expression;
+  Test t = {0};
+  char* end = NULL;
+  switch (flag[1]) {
+    case 'a':
+    case 'b': {
+      DateTime dt = ParseDateTime(value);
+      if (!dt.valid) {
+        DieExpression("bad date-time", value);
+      }
+      t = (Test){.op = flag[1] == 'a' ? TestAfter : TestBefore,
+                 .cost = 64,
+                 .time = mktime(&dt.value)};
+      e->status_fields |= StatusFieldTimes;
+      break;
     }
+    case 'e':
+      t = (Test){.op = TestExtensions,
+                 .cost = 2,
+                 .extensions = NewExtensions(value)};
+      break;
+    case 'm':
+      t = (Test){.op = TestPattern,
+                 .cost = 16,
+                 .regex = CompileRegex(value, REG_EXTENDED | REG_ICASE)};
+      break;
+    case 'n':
+      t = (Test){.op = TestGlobs, .cost = 8, .regex = CompileGlobs(value)};
+      break;
+    case 'S':
+    case 's':
+      t = (Test){.op = flag[1] == 'S' ? TestLarger : TestSmaller,
+                 .cost = 64,
+                 .size = strtoll(value, &end, 0)};
+      if (*end) {
+        DieExpression("bad size", value);
+      }
+      e->status_fields |= StatusFieldSize;
+      break;
+    case 't':
+      t = (Test){.op = TestType, .cost = 1, .type = ParseTypes(value)};
+      break;
+  }
+  if ((t.op == TestPattern || t.op == TestGlobs) && t.regex.error) {
+    PrintRegexError(t.regex.error, &t.regex.value);
+    exit(EX_USAGE);
   }
+  return AddTest(e, t);
 }
 
-static void WalkUp(char* pathname, const Predicate* p, long long depth) {
-  if (p->has_depth && depth > p->depth) {
-    return;
+// Parses a test, a negation, or a parenthesized expression.
+static size_t ParseFactor(Parser* q) {
+  const char* token = PeekToken(q);
+  if (token && StringEquals("!", token)) {
+    q->next++;
+    size_t child = ParseFactor(q);
+    return AddOperator(q->expression, TestNot, &child, 1);
   }
-  AUTO(DIR*, d, opendir(pathname), CloseDir);
-  if (!d) {
-    Warn(errno, "%s", pathname);
-    return;
+  if (token && StringEquals("(", token)) {
+    q->next++;
+    const size_t result = ParseOr(q);
+    token = PeekToken(q);
+    if (!token || !StringEquals(")", token)) {
+      DieExpression("expected ')'", token);
+    }
+    q->next++;
+    return result;
   }
+  return ParseTest(q);
+}
 
+// Parses factors side by side, all of which must be true, or `op` factors
+// separated by `-o`, any of which must be.
+static size_t ParseOperands(Parser* q, TestOp op) {
+  size_t* children = NULL;
+  size_t count = 0;
   while (true) {
-    const struct dirent* entry = readdir(d);
-    if (!entry) {
+    const char* token = PeekToken(q);
+    if (count && (!token || StringEquals(")", token) ||
+                  (op == TestAnd && StringEquals("-o", token)))) {
       break;
     }
-    if (IsDotOrDotDot(entry->d_name)) {
-      continue;
+    size_t* more = realloc(children, (count + 1) * sizeof(size_t));
+    if (!more) {
+      Die(errno, "realloc");
     }
-
-    char child[PATH_MAX + 1] = "";
-    const size_t length =
-        Format(child, sizeof(child), "%s/%s", pathname, entry->d_name);
-    if (length == SIZE_MAX) {
-      MustPrintf(stderr, "can't handle %s/%s\n", pathname, entry->d_name);
-      continue;
+    children = more;
+    children[count] =
+        op == TestAnd ? ParseFactor(q) : ParseOperands(q, TestAnd);
+    count++;
+    token = PeekToken(q);
+    if (op == TestOr) {
+      if (!token || !StringEquals("-o", token)) {
+        break;
+      }
+      q->next++;
     }
-    // TODO: Check return value.
-    PrintIfMatch(child, entry, p);
   }
+  const size_t result = count == 1
+                            ? children[0]
+                            : AddOperator(q->expression, op, children, count);
+  free(children);
+  return result;
+}
 
-  if (!StringEquals("/", pathname)) {
-    WalkUp(dirname(pathname), p, depth + 1);
-  }
+static size_t ParseOr(Parser* q) {
+  return ParseOperands(q, TestOr);
 }
 
-static int PopulateDevice(Predicate* p, const char* pathname) {
-  if (!p->has_no_cross_device) {
-    return 0;
+// Compiles `source`, which it modifies. Tokens are separated by white space,
+// and may be double-quoted to contain it. Exits with `EX_USAGE` if `source` is
+// not a valid expression.
+static Expression CompileExpression(char* source) {
+  char** tokens = NULL;
+  size_t count = 0;
+  char* s = source;
+  while (true) {
+    while (isspace((unsigned char)*s)) {
+      s++;
+    }
+    if (!*s) {
+      break;
+    }
+    char** more = realloc(tokens, (count + 1) * sizeof(char*));
+    if (!more) {
+      Die(errno, "realloc");
+    }
+    tokens = more;
+    if (*s == '"') {
+      s++;
+      tokens[count] = s;
+      s = strchr(s, '"');
+      if (!s) {
+        DieExpression("unterminated quote", tokens[count] - 1);
+      }
+    } else {
+      tokens[count] = s;
+      while (*s && !isspace((unsigned char)*s)) {
+        s++;
+      }
+    }
+    count++;
+    if (*s) {
+      *s = '\0';
+      s++;
+    }
   }
-  struct stat status;
-  if (lstat(pathname, &status)) {
-    return errno;
+
+  Expression e = {0};
+  Parser q = {.tokens = tokens, .count = count, .expression = &e};
+  e.root = ParseOr(&q);
+  if (q.next < count) {
+    DieExpression("unexpected", tokens[q.next]);
   }
-  p->device = status.st_dev;
-  return 0;
+  free(tokens);
+  return e;
 }
 
-int main(int count, char** arguments) {
-  Arguments as = ParseCLI(&cli, count, arguments);
-  if (OVB('h')) {
-    PrintHelpAndExit(&cli, false, true);
+// Destroys the parts of `*e` that it owns. See `AUTO`.
+static void FreeExpression(Expression* e) {
+  for (size_t i = 0; i < e->count; i++) {
+    Test* t = &e->tests[i];
+    if (t->op == TestGlobs || t->op == TestPattern) {
+      FreeRegex(&t->regex);
+    } else if (t->op == TestExtensions) {
+      free(t->extensions.slots);
+      free(t->extensions.lengths);
+    }
   }
+  free(e->tests);
+  free(e->children);
+  *e = (Expression){0};
+}
 
-  // Since finding options and values in `cli` takes linear time, and since we'd
-  // be looking them up for every pathname we try to match, we instead copy the
-  // options into the `Predicate` `struct` for constant-time lookup.
-  Predicate p = {0};
-  ors = OVB('0') ? '\0' : '\n';
-  p.walk_all = OVB('A');
-  bool up = OVB('u');
-  if (OVB('a')) {
-    p.after = OVDT('a');
-    p.has_after = true;
-  }
-  if (OVB('b')) {
-    p.before = OVDT('b');
-    p.has_before = true;
-  }
-  if (OVB('d')) {
-    p.depth = OVI('d');
-    p.has_depth = true;
+// How often each operator's children are put back in order.
+#define SCHEDULE_INTERVAL 1024
+
+// Each walker's own record of how an `Expression`'s tests fare, and the order
+// to run each operator's children in: those that most cheaply decide it (by
+// being false, under `TestAnd`, or true, under `TestOr`) first. Since which
+// tests those are depends on the tree, the order adapts as the walk goes.
+typedef struct Schedule {
+  const Expression* expression;
+  // Like `Expression.children`, but in the order to run them.
+  size_t* order;
+  // For each test, how many times it ran, and how many of those it decided
+  // its parent.
+  uint32_t* runs;
+  uint32_t* decisions;
+} Schedule;
+
+static Schedule* NewSchedule(const Expression* e) {
+  Schedule* s = malloc(sizeof(Schedule));
+  if (!s) {
+    Die(errno, "malloc");
   }
-  if (OVB('m')) {
-    p.pattern = OVRE('m');
-    p.has_pattern = true;
+  s->expression = e;
+  // An expression of 1 test has no children, and so nothing to order.
+  s->order = NULL;
+  if (e->child_count) {
+    s->order = calloc(e->child_count, sizeof(size_t));
+    if (!s->order) {
+      Die(errno, "calloc");
+    }
+    memcpy(s->order, e->children, e->child_count * sizeof(size_t));
   }
-  if (OVB('S')) {
-    p.larger = OVI('S');
-    p.has_larger_than = true;
+  s->runs = calloc(e->count, sizeof(uint32_t));
+  s->decisions = calloc(e->count, sizeof(uint32_t));
+  if (!s->runs || !s->decisions) {
+    Die(errno, "calloc");
   }
-  if (OVB('s')) {
-    p.smaller = OVI('s');
-    p.has_smaller_than = true;
+  return s;
+}
+
+static void FreeSchedule(Schedule** s) {
+  Schedule* x = *s;
+  if (!x) {
+    return;
   }
-  if (OVB('t')) {
-    const char* s = OVS('t');
-    if (strchr(s, 'f')) {
-      p.type |= TypeFile;
-    }
-    if (strchr(s, 'd')) {
-      p.type |= TypeDirectory;
-    }
-    if (strchr(s, 's')) {
-      p.type |= TypeSymbolicLink;
+  free(x->order);
+  free(x->runs);
+  free(x->decisions);
+  free(x);
+  *s = NULL;
+}
+
+// Returns the expected cost of running test `t` for each time it decides its
+// parent.
+static double GetCostPerDecision(const Schedule* s, size_t t) {
+  return s->expression->tests[t].cost * (s->runs[t] + 2.0) /
+         (s->decisions[t] + 1.0);
+}
+
+// Puts the children of `t` in order of cost per decision, and then halves
+// their counts, so that the order follows changes as the walk goes on.
+static void Reschedule(Schedule* s, const Test* t) {
+  size_t* children = &s->order[t->first];
+  for (size_t i = 1; i < t->count; i++) {
+    for (size_t j = i; j > 0 && GetCostPerDecision(s, children[j - 1]) >
+                                    GetCostPerDecision(s, children[j]);
+         j--) {
+      const size_t c = children[j];
+      children[j] = children[j - 1];
+      children[j - 1] = c;
     }
-    p.has_type = true;
   }
-  p.has_no_cross_device = OVB('x');
+  for (size_t i = 0; i < t->count; i++) {
+    s->runs[children[i]] /= 2;
+    s->decisions[children[i]] /= 2;
+  }
+}
 
-  if (as.count == 0) {
-    if (up) {
-      char cwd[PATH_MAX + 1] = "";
-      getcwd(cwd, sizeof(cwd));
-      const int e = PopulateDevice(&p, cwd);
-      if (e) {
-        MustPrintf(stderr, "%s: %s\n", cwd, strerror(e));
-        return errno;
+typedef enum Truth {
+  TruthFalse,
+  TruthTrue,
+  TruthUnknown,
+} Truth;
+
+// Evaluates test `t` for `entry`, a child of the directory named by `path`.
+// Without its `status`, tests that need it are unknown, and so may be the
+// result.
+static Truth Evaluate(Schedule* s,
+                      size_t t,
+                      Path* path,
+                      const Entry* entry,
+                      const struct stat* status) {
+  const Test* test = &s->expression->tests[t];
+  switch (test->op) {
+    case TestAnd:
+    case TestOr: {
+      if (s->runs[t] % SCHEDULE_INTERVAL == 0) {
+        Reschedule(s, test);
       }
-      WalkUp(cwd, &p, 0);
-    } else {
-      const int e = PopulateDevice(&p, ".");
-      if (e) {
-        MustPrintf(stderr, "./: %s\n", strerror(e));
-        return errno;
+      const Truth decisive = test->op == TestAnd ? TruthFalse : TruthTrue;
+      bool unknown = false;
+      for (size_t i = 0; i < test->count; i++) {
+        const size_t child = s->order[test->first + i];
+        s->runs[child]++;
+        const Truth r = Evaluate(s, child, path, entry, status);
+        if (r == decisive) {
+          s->decisions[child]++;
+          return decisive;
+        }
+        unknown |= r == TruthUnknown;
+      }
+      if (unknown) {
+        return TruthUnknown;
       }
-      Walk(".", &p, 0);
+      return test->op == TestAnd ? TruthTrue : TruthFalse;
     }
+    case TestNot: {
+      const Truth r = Evaluate(s, s->order[test->first], path, entry, status);
+      return r == TruthUnknown ? r : r == TruthFalse ? TruthTrue : TruthFalse;
+    }
+    case TestType:
+      return test->type & GetType(entry->type) ? TruthTrue : TruthFalse;
+    case TestExtensions:
+      return HasExtension(&test->extensions, entry->name, entry->length)
+                 ? TruthTrue
+                 : TruthFalse;
+    case TestGlobs:
+      return MatchRegex(&test->regex, entry->name) ? TruthTrue : TruthFalse;
+    case TestPattern: {
+      const size_t length = AppendPath(path, entry->name, entry->length);
+      const bool match = MatchRegex(&test->regex, path->values);
+      TruncatePath(path, length);
+      return match ? TruthTrue : TruthFalse;
+    }
+    default:
+      break;
   }
-  for (size_t i = 0; i < as.count; i++) {
-    const int e = PopulateDevice(&p, as.values[i]);
+  if (!status) {
+    return TruthUnknown;
+  }
+  bool match = false;
+  if (test->op == TestLarger) {
+    match = status->st_size > test->size;
+  } else if (test->op == TestSmaller) {
+    match = status->st_size < test->size;
+  } else if (test->op == TestAfter) {
+    match = status->st_mtime > test->time;
+  } else if (test->op == TestBefore) {
+    match = status->st_mtime < test->time;
+  }
+  return match ? TruthTrue : TruthFalse;
+}
+
+// Evaluates the whole expression of `s`. See `Evaluate`.
+static Truth EvaluateExpression(Schedule* s,
+                                Path* path,
+                                const Entry* entry,
+                                const struct stat* status) {
+  const size_t root = s->expression->root;
+  s->runs[root]++;
+  return Evaluate(s, root, path, entry, status);
+}
+
+typedef struct Predicate {
+  bool walk_all;
+  bool has_extensions;
+  Extensions extensions;
+  bool has_globs;
+  Regex globs;
+  // With -u, if every glob is a literal name, the names, so that each
+  // directory can be probed for them rather than read. They point into
+  // `name_buffer`.
+  bool has_names;
+  size_t name_count;
+  char** names;
+  char* name_buffer;
+  bool has_pattern;
+  Regex pattern;
+  bool has_content;
+  Search content;
+  bool has_after;
+  time_t after;
+  bool has_before;
+  time_t before;
+  bool has_depth;
+  long long depth;
+  bool has_larger_than;
+  long long larger;
+  bool has_smaller_than;
+  long long smaller;
+  bool has_type;
+  Type type;
+  bool has_expression;
+  Expression expression;
+  bool has_no_cross_device;
+  // With -x, whether `mount_points` holds the mount points beneath the root
+  // that lead to other devices. If not, every entry's device is compared.
+  bool has_mount_points;
+  MountPoints mount_points;
+  bool ignore;
+  // Whether to walk each directory's entries in order of name.
+  bool sorted;
+  bool has_sort;
+  SortKey sort;
+  bool follow;
+  // Whether to spare the page cache and access times (see -i).
+  bool gentle;
+  // The most directories and file statuses to read per second, or 0.
+  size_t rate;
+  // The most directories a single-threaded walk keeps open (see `Stack`).
+  size_t budget;
+  // How many entries' statuses to fetch at once, and whether in order of inode
+  // number (see `GetStatusesByInode`).
+  size_t batch;
+  bool inode_order;
+  dev_t device;
+  // `AT_SYMLINK_NOFOLLOW`, unless following symbolic links.
+  int status_flags;
+  // The `StatusField`s the tests need, or 0 if they need no `lstat`. (Those the
+  // -E expression needs are in `expression`, since it may not need them.)
+  unsigned status_fields;
+  size_t status_depth;
+} Predicate;
+
+// Destroys the parts of `*p` that it owns. See `AUTO`.
+static void FreePredicate(Predicate* p) {
+  if (p->has_extensions) {
+    free(p->extensions.slots);
+    free(p->extensions.lengths);
+  }
+  if (p->has_globs) {
+    FreeRegex(&p->globs);
+  }
+  if (p->has_names) {
+    free(p->names);
+    free(p->name_buffer);
+  }
+  if (p->has_content) {
+    FreeSearch(&p->content);
+  }
+  if (p->has_expression) {
+    FreeExpression(&p->expression);
+  }
+  FreeMountPoints(&p->mount_points);
+}
+
+typedef enum Result {
+  ResultContinue = 0,
+  ResultStop = 1,
+  ResultMatch = 2,
+  ResultNeedStatus = 3,
+} Result;
+
+// Applies the tests that need only the name and type of `entry`. These are
+// arranged such that the least expensive run first, and they run before the
+// entry's pathname is even assembled.
+static Result MatchEntry(const Entry* entry, const Predicate* p) {
+  if (entry->name[0] == '.' && !p->walk_all) {
+    return ResultStop;
+  }
+
+  if (p->has_type && (p->type & GetType(entry->type)) == 0) {
+    return ResultContinue;
+  }
+
+  if ((p->has_extensions || p->has_globs) &&
+      !(p->has_extensions &&
+        HasExtension(&p->extensions, entry->name, entry->length)) &&
+      !(p->has_globs && MatchRegex(&p->globs, entry->name))) {
+    return ResultContinue;
+  }
+
+  return ResultMatch;
+}
+
+// Returns the state of the DFA for -m after all of `path`, or 0 if there is
+// none to carry down the tree (see `DfaState`).
+static DfaState StartPattern(const Predicate* p, const Path* path) {
+  Dfa* d = p->has_pattern ? p->pattern.dfa : NULL;
+  return d ? AdvanceDfa(d, StartDfa(d), path->values, path->count) : 0;
+}
+
+// Returns the state of the DFA for -m after `path`, given `state`, its state
+// after the first `length` bytes. So matching a pathname costs only the bytes
+// its directory's pathname does not share.
+static DfaState AdvancePattern(const Predicate* p,
+                               DfaState state,
+                               const Path* path,
+                               size_t length) {
+  return state ? AdvanceDfa(p->pattern.dfa, state, &path->values[length],
+                            path->count - length)
+               : 0;
+}
+
+// Applies the tests that need the pathname of `entry`, a child of the
+// directory named by `path`, if it has passed `MatchEntry`, and as much of the
+// -E expression, scheduled by `s`, as can be without the entry's status.
+// `pattern` is the state of the DFA for -m after `path`, or 0 to match the
+// whole pathname.
+static Result MatchPathname(Path* path,
+                            DfaState pattern,
+                            Schedule* s,
+                            const Entry* entry,
+                            const Predicate* p) {
+  if (p->has_pattern) {
+    const size_t length = AppendPath(path, entry->name, entry->length);
+    const DfaState next = AdvancePattern(p, pattern, path, length);
+    const bool match = next ? EndDfa(p->pattern.dfa, next) == DfaMatch
+                            : MatchRegex(&p->pattern, path->values);
+    TruncatePath(path, length);
+    if (!match) {
+      return ResultContinue;
+    }
+  }
+  if (p->has_expression) {
+    const Truth t = EvaluateExpression(s, path, entry, NULL);
+    if (t == TruthFalse) {
+      return ResultContinue;
+    } else if (t == TruthUnknown) {
+      return ResultNeedStatus;
+    }
+  }
+  return p->status_fields ? ResultNeedStatus : ResultMatch;
+}
+
+// Applies the tests that need `status`, the status of `entry`, a child of the
+// directory named by `path`.
+static Result MatchStatus(Path* path,
+                          Schedule* s,
+                          const Entry* entry,
+                          const struct stat* status,
+                          const Predicate* p) {
+  if (p->has_no_cross_device && p->device != status->st_dev) {
+    return ResultStop;
+  }
+
+  if ((p->has_after && status->st_mtime <= p->after) ||
+      (p->has_before && status->st_mtime >= p->before)) {
+    return ResultContinue;
+  }
+
+  if ((p->has_larger_than && status->st_size <= p->larger) ||
+      (p->has_smaller_than && status->st_size >= p->smaller)) {
+    return ResultContinue;
+  }
+  if (p->expression.status_fields &&
+      EvaluateExpression(s, path, entry, status) != TruthTrue) {
+    return ResultContinue;
+  }
+  return ResultMatch;
+}
+
+// How much output each walker buffers before writing it.
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+static void PrintMatch(Output* o, const Path* pathname) {
+  // Keep each record in one write, so that records printed from concurrent
+  // walkers never interleave.
+  ReserveOutput(o, pathname->count + 1);
+  AppendBytes(o, pathname->values, pathname->count);
+  AppendChar(o, ors);
+}
+
+// Opens `name` in the directory open as `directory` with `flags`, and if `p` is
+// gentle, without updating its access time where permitted.
+static int OpenGently(const Predicate* p,
+                      int directory,
+                      const char* name,
+                      int flags) {
+#ifdef O_NOATIME
+  if (p->gentle) {
+    const int fd = openat(directory, name, flags | O_NOATIME);
+    // Only the owner of a file (or a privileged process) may use O_NOATIME.
+    if (fd >= 0 || errno != EPERM) {
+      return fd;
+    }
+  }
+#endif
+  return openat(directory, name, flags);
+}
+
+static int OpenDirectory(const Predicate* p, int parent, const char* name) {
+  return OpenGently(
+      p, parent, name,
+      O_RDONLY | O_DIRECTORY | O_CLOEXEC | (p->follow ? 0 : O_NOFOLLOW));
+}
+
+// Gives each symbolic link in `entries`, of the directory open as `directory`,
+// the type of what it refers to. Dangling links stay links.
+static void ResolveLinks(int directory, Entries* entries) {
+  for (size_t i = 0; i < entries->count; i++) {
+    Entry* entry = &entries->values[i];
+    struct stat status;
+    if (entry->type != DT_LNK || fstatat(directory, entry->name, &status, 0)) {
+      continue;
+    }
+    entry->type = S_ISDIR(status.st_mode)   ? DT_DIR
+                  : S_ISREG(status.st_mode) ? DT_REG
+                                            : DT_UNKNOWN;
+  }
+}
+
+// A directory and the disk space its subtree uses, in bytes.
+typedef struct Usage {
+  uint64_t bytes;
+  char* pathname;
+} Usage;
+
+// The `capacity` (at least 1) directories using the most disk space of those
+// offered so far, in a heap with the least of them on top, to be replaced by
+// the next one that uses more.
+typedef struct Largest {
+  size_t count;
+  size_t capacity;
+  Usage* values;
+} Largest;
+
+static Largest NewLargest(size_t capacity) {
+  Largest l = {.capacity = capacity, .values = calloc(capacity, sizeof(Usage))};
+  if (!l.values) {
+    Die(errno, "calloc");
+  }
+  return l;
+}
+
+static void SiftDown(Largest* l, size_t i) {
+  while (true) {
+    size_t least = i;
+    for (size_t c = 2 * i + 1; c <= 2 * i + 2 && c < l->count; c++) {
+      if (l->values[c].bytes < l->values[least].bytes) {
+        least = c;
+      }
+    }
+    if (least == i) {
+      return;
+    }
+    const Usage u = l->values[i];
+    l->values[i] = l->values[least];
+    l->values[least] = u;
+    i = least;
+  }
+}
+
+// Adds `pathname` to `l` if it is among the largest. Takes ownership of
+// `pathname` if `owned`, and otherwise copies it if need be.
+static void OfferUsage(Largest* l, uint64_t bytes, char* pathname, bool owned) {
+  if (l->count == l->capacity && bytes <= l->values[0].bytes) {
+    if (owned) {
+      free(pathname);
+    }
+    return;
+  }
+  if (!owned) {
+    pathname = strdup(pathname);
+    if (!pathname) {
+      Die(errno, "strdup");
+    }
+  }
+  const Usage u = {.bytes = bytes, .pathname = pathname};
+  if (l->count == l->capacity) {
+    free(l->values[0].pathname);
+    l->values[0] = u;
+    SiftDown(l, 0);
+    return;
+  }
+  size_t i = l->count;
+  l->count++;
+  while (i && l->values[(i - 1) / 2].bytes > bytes) {
+    l->values[i] = l->values[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  l->values[i] = u;
+}
+
+// Moves the contents of `*from` into `into`, and destroys `*from`.
+static void MergeLargest(Largest* into, Largest* from) {
+  for (size_t i = 0; i < from->count; i++) {
+    OfferUsage(into, from->values[i].bytes, from->values[i].pathname, true);
+  }
+  free(from->values);
+  *from = (Largest){0};
+}
+
+static int CompareUsage(const void* a, const void* b) {
+  const Usage* x = a;
+  const Usage* y = b;
+  if (x->bytes != y->bytes) {
+    return x->bytes < y->bytes ? -1 : 1;
+  }
+  return strcmp(x->pathname, y->pathname);
+}
+
+// Prints `l`, smallest first, with sizes in MiB rounded up (like `du -m`).
+static void PrintLargest(Output* o, Largest* l) {
+  qsort(l->values, l->count, sizeof(Usage), CompareUsage);
+  for (size_t i = 0; i < l->count; i++) {
+    const Usage* u = &l->values[i];
+    AppendInteger(o, (int64_t)((u->bytes + (1 << 20) - 1) >> 20), 0, ' ');
+    AppendChar(o, '\t');
+    AppendString(o, u->pathname);
+    AppendChar(o, ors);
+  }
+}
+
+// Destroys `*l`. See `AUTO`.
+static void FreeLargest(Largest* l) {
+  for (size_t i = 0; i < l->count; i++) {
+    free(l->values[i].pathname);
+  }
+  free(l->values);
+}
+
+// The directories a walk has been through, shared by all its threads.
+// `inodes` is `NULL` unless the walk follows symbolic links, in which case it
+// holds every directory walked, so that loops and subtrees reachable by more
+// than 1 pathname are walked once. Similarly, `links` is `NULL` unless the walk
+// adds up disk usage, in which case it holds the files with several links that
+// have been counted.
+//
+// If the walk is rate-limited, `tokens` is a bucket of reads, refilled at
+// `rate` per second up to `burst`, and taken from by `Throttle`.
+typedef struct Visited {
+  pthread_mutex_t lock;
+  InodeSet* inodes;
+  InodeSet* links;
+  size_t walked;
+  size_t skipped;
+  size_t statuses;
+  int64_t start;
+  double rate;
+  double burst;
+  double tokens;
+  int64_t refilled;
+} Visited;
+
+static int64_t GetMonotonicNanoseconds(void) {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (time.tv_sec * 1000000000LL) + time.tv_nsec;
+}
+
+static Visited* NewVisited(const Predicate* p,
+                           bool verbose,
+                           const Largest* largest) {
+  if (!p->follow && !verbose && !largest && !p->rate) {
+    return NULL;
+  }
+  Visited* v = calloc(1, sizeof(Visited));
+  if (!v) {
+    Die(errno, "calloc");
+  }
+  pthread_mutex_init(&v->lock, NULL);
+  v->inodes = p->follow ? NewInodeSet() : NULL;
+  v->links = largest ? NewInodeSet() : NULL;
+  v->start = GetMonotonicNanoseconds();
+  v->rate = (double)p->rate;
+  // Allow bursts of up to 0.1 s worth, so that the reads are spread out.
+  v->burst = v->rate / 10 < 1 ? 1 : v->rate / 10;
+  v->tokens = v->burst;
+  v->refilled = v->start;
+  return v;
+}
+
+// Counts `statuses` more file statuses to be read, and if the walk is
+// rate-limited, takes `count` reads' worth of tokens, sleeping as long as it
+// takes to refill them if there are not enough. The bucket goes into debt
+// rather than making threads wait in turn.
+static void Throttle(Visited* v, size_t count, size_t statuses) {
+  if (!v) {
+    return;
+  }
+  pthread_mutex_lock(&v->lock);
+  v->statuses += statuses;
+  double debt = 0;
+  if (v->rate) {
+    const int64_t now = GetMonotonicNanoseconds();
+    v->tokens += (double)(now - v->refilled) * v->rate / 1e9;
+    if (v->tokens > v->burst) {
+      v->tokens = v->burst;
+    }
+    v->refilled = now;
+    v->tokens -= (double)count;
+    debt = -v->tokens;
+  }
+  pthread_mutex_unlock(&v->lock);
+  if (debt > 0) {
+    const double seconds = debt / v->rate;
+    const struct timespec delay = {
+        .tv_sec = (time_t)seconds,
+        .tv_nsec = (long)((seconds - (double)(time_t)seconds) * 1e9)};
+    nanosleep(&delay, NULL);
+  }
+}
+
+// Prints the statistics in `*v` for the walk of `root` to `stderr` (if
+// `verbose`), and then destroys `*v`.
+static void FreeVisited(Visited** v, const char* root, bool verbose) {
+  Visited* x = *v;
+  *v = NULL;
+  if (!x) {
+    return;
+  }
+  if (verbose) {
+    const double seconds =
+        (double)(GetMonotonicNanoseconds() - x->start) / 1e9;
+    MustPrintf(stderr,
+               "%s: walked %zu directories and read %zu file statuses in %.2f "
+               "s (%.0f and %.0f per second)",
+               root, x->walked, x->statuses, seconds,
+               (double)x->walked / seconds, (double)x->statuses / seconds);
+    if (x->inodes) {
+      MustPrintf(stderr, ", skipped %zu already walked; %zu KiB for %zu inodes",
+                 x->skipped, SizeInodeSet(x->inodes) / 1024,
+                 CountInodes(x->inodes));
+    }
+    MustPrintf(stderr, "\n");
+  }
+  FreeInodeSet(&x->inodes);
+  FreeInodeSet(&x->links);
+  pthread_mutex_destroy(&x->lock);
+  free(x);
+}
+
+// A directory's disk usage, while it is being added up by several threads:
+// that of its own files, plus the totals of its subdirectories as they finish.
+// When the last part is in, the total is final, and goes to `parent`.
+typedef struct Tally {
+  atomic_uint_fast64_t bytes;
+  // 1 for the directory's own files, plus 1 per unfinished subdirectory.
+  atomic_size_t pending;
+  struct Tally* parent;
+  char* pathname;
+} Tally;
+
+static Tally* NewTally(Tally* parent, const char* pathname, uint64_t bytes) {
+  Tally* t = calloc(1, sizeof(Tally));
+  if (!t) {
+    Die(errno, "calloc");
+  }
+  atomic_init(&t->bytes, bytes);
+  atomic_init(&t->pending, 1);
+  t->pathname = strdup(pathname);
+  if (!t->pathname) {
+    Die(errno, "strdup");
+  }
+  if (parent) {
+    atomic_fetch_add(&parent->pending, 1);
+    t->parent = parent;
+  }
+  return t;
+}
+
+// Adds `bytes` to `t` and finishes 1 of its parts. If that was the last, offers
+// the total to `l` and passes it up; unless the directory was not `walked`, in
+// which case it counts for nothing.
+static void FinishTally(Tally* t, uint64_t bytes, bool walked, Largest* l) {
+  while (t) {
+    atomic_fetch_add(&t->bytes, bytes);
+    if (atomic_fetch_sub(&t->pending, 1) != 1) {
+      return;
+    }
+    bytes = walked ? atomic_load(&t->bytes) : 0;
+    Tally* parent = t->parent;
+    if (walked) {
+      OfferUsage(l, bytes, t->pathname, true);
+    } else {
+      free(t->pathname);
+    }
+    free(t);
+    t = parent;
+    walked = true;
+  }
+}
+
+// The state of comparing a walk with a snapshot, writing one, or both.
+typedef struct Snapshot {
+  SnapshotReader* reader;
+  SnapshotWriter* writer;
+  Output* output;
+  // The root of the walk. Pathnames in the snapshot are relative to it, and
+  // so lack their first `prefix` bytes: the root and a '/'.
+  const char* root;
+  size_t prefix;
+} Snapshot;
+
+static void PrintChange(void* context,
+                        Change change,
+                        const char* pathname,
+                        size_t length) {
+  const Snapshot* s = context;
+  Output* o = s->output;
+  ReserveOutput(o, s->prefix + length + 3);
+  AppendChar(o, (char)change);
+  AppendChar(o, '\t');
+  AppendBytes(o, s->root, s->prefix - 1);
+  AppendChar(o, '/');
+  AppendBytes(o, pathname, length);
+  AppendChar(o, ors);
+}
+
+typedef struct Walker Walker;
+
+// Called for each subdirectory, open as `directory`, that `WalkDirectory`
+// should descend into. The walker's `path` names the subdirectory. If adding
+// up disk usage, `bytes` is that of the subdirectory itself.
+typedef void Descend(Walker* w,
+                     int parent,
+                     const Entry* entry,
+                     long depth,
+                     uint64_t bytes);
+
+// The position of a `StatusRequest` in a window, and the inode number of its
+// entry.
+typedef struct InodeOrder {
+  uint64_t inode;
+  size_t index;
+} InodeOrder;
+
+// The state of one thread of a walk. Each directory is opened relative to its
+// parent, and `path` is extended and truncated in place as the walk descends
+// and returns, so that the kernel never re-resolves a whole pathname. (In a
+// pool, a queued directory holds its parent open for the same reason, unless
+// there are no file descriptors to spare.)
+//
+// If the tests need file status, `engine` fetches it for a window of entries
+// at a time, so that the walk waits on the filesystem once per window rather
+// than once per entry.
+//
+// If the walk obeys ignore files, `ignores` holds the rules of those in the
+// directory being walked and its ancestors.
+//
+// If the walk adds up disk usage, `bytes` is a running total of the matching
+// files walked, so that a directory's usage is the difference between its value
+// before and after the walk of the directory. (When walking in a pool, `tally`
+// is the directory's partial total.) `largest` keeps the largest.
+//
+// If the walk finds duplicates, the matching files go to `duplicates` rather
+// than being printed; and likewise to `snapshot`, if comparing with or writing
+// one.
+struct Walker {
+  const Predicate* predicate;
+  StatusEngine* engine;
+  Output* output;
+  Path path;
+  Ignores* ignores;
+  Visited* visited;
+  Largest* largest;
+  uint64_t bytes;
+  Tally* tally;
+  Duplicates* duplicates;
+  Snapshot* snapshot;
+  // For the -E expression, if any.
+  Schedule* schedule;
+  // `SEARCH_BUFFER_SIZE` bytes for `SearchFile`, if needed.
+  char* contents;
+  // With -O, room for a window of requests in order of inode number.
+  InodeOrder* order;
+  StatusRequest* sorted;
+  // With -o, where matches go to be printed in order, unless the walk itself
+  // is in order.
+  Sorter* sorter;
+  // With -C, where matches are counted instead.
+  Census* census;
+  // With -W, what watches the directories walked.
+  Watch* watch;
+  Descend* descend;
+  void* context;
+};
+
+// How many entries' statuses to fetch at once; with -O, at most.
+#define STATUS_BATCH 128
+#define INODE_BATCH 4096
+
+// Returns `w->ignores` with the rules of the ignore files among `entries`, of
+// the directory open as `directory`, on top. Looking for them among the
+// entries already read costs no system calls for the many directories that
+// have none.
+static Ignores* PushDirectoryIgnores(Walker* w,
+                                     int directory,
+                                     const Entries* entries) {
+  Ignores* s = RetainIgnores(w->ignores);
+  for (size_t n = 0; n < COUNT(ignore_file_names); n++) {
+    for (size_t i = 0; i < entries->count; i++) {
+      if (StringEquals(entries->values[i].name, ignore_file_names[n])) {
+        Ignores* t = PushIgnores(s, directory, ignore_file_names[n],
+                                 w->path.count, "");
+        ReleaseIgnores(&s);
+        s = t;
+        break;
+      }
+    }
+  }
+  return s;
+}
+
+// Reports whether the ignore rules say to skip `entry` (and if it is a
+// directory, everything in it).
+static bool IsIgnoredEntry(Walker* w, const Entry* entry) {
+  const bool is_directory = entry->type == DT_DIR;
+  if (is_directory && StringEquals(entry->name, ".git")) {
+    return true;
+  }
+  if (!w->ignores) {
+    return false;
+  }
+  const size_t length = AppendPath(&w->path, entry->name, entry->length);
+  const bool ignored = IsIgnored(w->ignores, w->path.values, is_directory);
+  TruncatePath(&w->path, length);
+  return ignored;
+}
+
+typedef struct Lines {
+  Output* output;
+  const Path* path;
+  bool print;
+  bool found;
+} Lines;
+
+static bool PrintLine(void* context,
+                      size_t number,
+                      const char* line,
+                      size_t length) {
+  Lines* l = context;
+  l->found = true;
+  if (!l->print) {
+    return false;
+  }
+  Output* o = l->output;
+  ReserveOutput(o, l->path->count + length + 24);
+  AppendBytes(o, l->path->values, l->path->count);
+  AppendChar(o, ':');
+  AppendInteger(o, (int64_t)number, 0, ' ');
+  AppendChar(o, '\t');
+  AppendBytes(o, line, length);
+  AppendChar(o, ors);
+  return true;
+}
+
+// Searches the contents of `entry`, in the directory open as `directory`, and
+// if `print`, prints the lines that match. Reports whether any did.
+static bool SearchEntry(Walker* w,
+                        int directory,
+                        const Entry* entry,
+                        bool print) {
+  if (entry->type != DT_REG) {
+    return false;
+  }
+  if (!w->contents) {
+    w->contents = malloc(SEARCH_BUFFER_SIZE);
+    if (!w->contents) {
+      Die(errno, "malloc");
+    }
+  }
+  const Predicate* p = w->predicate;
+  const size_t length = AppendPath(&w->path, entry->name, entry->length);
+  Lines lines = {.output = w->output, .path = &w->path, .print = print};
+  const int fd =
+      OpenGently(p, directory, entry->name,
+                 O_RDONLY | O_CLOEXEC | (p->follow ? 0 : O_NOFOLLOW));
+  if (fd < 0) {
+    Warn(errno, "%s", w->path.values);
+  } else {
+    const int e = SearchFile(&p->content, fd, w->contents, PrintLine, &lines);
+    if (e) {
+      Warn(e, "%s", w->path.values);
+    }
+    if (p->gentle) {
+      (void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    close(fd);
+  }
+  TruncatePath(&w->path, length);
+  return lines.found;
+}
+
+// Compares the file named by `w->path`, with `status`, with the snapshot, and
+// records it in the new one.
+static void TakeSnapshot(Walker* w, const struct stat* status) {
+  Snapshot* s = w->snapshot;
+  const char* pathname = &w->path.values[s->prefix];
+  const size_t length = w->path.count - s->prefix;
+  if (s->reader) {
+    DiffSnapshot(s->reader, pathname, length, status, PrintChange, s);
+  }
+  if (s->writer) {
+    WriteSnapshot(s->writer, pathname, length, status);
+  }
+}
+
+// Reports whether `entry`, in the directory named by `w->path`, is one of the
+// mount points that -x stops at.
+static bool IsMountEntry(Walker* w, const Entry* entry) {
+  const size_t length = AppendPath(&w->path, entry->name, entry->length);
+  const bool result = IsMountPoint(&w->predicate->mount_points, w->path.values);
+  TruncatePath(&w->path, length);
+  return result;
+}
+
+static int CompareEntries(const void* a, const void* b) {
+  return strcmp(((const Entry*)a)->name, ((const Entry*)b)->name);
+}
+
+// Tests `entry`, a child of the directory open as `directory`, and prints it
+// (or with -g, its matching lines) if it matches. If the caller already has
+// the entry's `status`, it is used rather than read again. Returns
+// `ResultMatch` if anything was printed.
+static Result PrintIfMatch(Walker* w,
+                           int directory,
+                           const Entry* entry,
+                           const struct stat* status) {
+  const Predicate* p = w->predicate;
+  Result r = MatchEntry(entry, p);
+  if (r != ResultMatch) {
+    return r;
+  }
+  r = MatchPathname(&w->path, 0, w->schedule, entry, p);
+  if (r == ResultContinue) {
+    return r;
+  }
+  if (r == ResultNeedStatus) {
+    struct stat s;
+    if (!status && fstatat(directory, entry->name, &s, p->status_flags)) {
+      const size_t length = AppendPath(&w->path, entry->name, entry->length);
+      Warn(errno, "%s", w->path.values);
+      TruncatePath(&w->path, length);
+      return ResultContinue;
+    }
+    r = MatchStatus(&w->path, w->schedule, entry, status ? status : &s, p);
+  }
+  if (r == ResultMatch && p->has_content) {
+    if (!SearchEntry(w, directory, entry, true)) {
+      r = ResultContinue;
+    }
+  } else if (r == ResultMatch) {
+    const size_t length = AppendPath(&w->path, entry->name, entry->length);
+    PrintMatch(w->output, &w->path);
+    TruncatePath(&w->path, length);
+  }
+  return r;
+}
+
+// Reports whether to walk the directory open as `directory`, named by
+// `w->path`: that is, unless following symbolic links, and it has already been
+// walked by some other pathname.
+static bool VisitDirectory(Walker* w, int directory) {
+  Visited* v = w->visited;
+  if (!v) {
+    return true;
+  }
+  struct stat status = {0};
+  if (v->inodes && fstat(directory, &status)) {
+    Warn(errno, "%s", w->path.values);
+    return false;
+  }
+  pthread_mutex_lock(&v->lock);
+  const bool fresh =
+      !v->inodes || AddInode(v->inodes, status.st_dev, status.st_ino);
+  if (fresh) {
+    v->walked++;
+  } else {
+    v->skipped++;
+  }
+  pthread_mutex_unlock(&v->lock);
+  return fresh;
+}
+
+// Returns the disk space `status` uses, or 0 if it is a file with several
+// links that the walk has already counted.
+static uint64_t CountUsage(Walker* w, const struct stat* status) {
+  const uint64_t bytes = (uint64_t)status->st_blocks * 512;
+  if (status->st_nlink < 2 || S_ISDIR(status->st_mode)) {
+    return bytes;
+  }
+  Visited* v = w->visited;
+  pthread_mutex_lock(&v->lock);
+  const bool fresh = AddInode(v->links, status->st_dev, status->st_ino);
+  pthread_mutex_unlock(&v->lock);
+  return fresh ? bytes : 0;
+}
+
+// A directory that the walk is partway through: its entries, and how far it
+// has got with them. They are tested a window at a time (so that their
+// statuses can be fetched together), and then finished in order, which is when
+// the walk descends. So a frame stops at each subdirectory, to be resumed when
+// the walk returns.
+typedef struct Frame {
+  // The directory, or -1 while it is closed to stay within the budget of open
+  // directories (see `Stack`).
+  int directory;
+  // Its identity, recorded when it is closed, to check it when reopened.
+  dev_t device;
+  ino_t inode;
+  long depth;
+  // The length of `Walker.path` when it names the directory.
+  size_t length;
+  // `Walker.bytes` before the directory was walked.
+  uint64_t bytes;
+  Entries entries;
+  Ignores* parent_ignores;
+  Ignores* ignores;
+  bool has_mount_points;
+  // The state of the DFA for -m after the directory's pathname.
+  DfaState pattern;
+  // The window of entries `results` and `requests` are for, and the next entry
+  // (and request) to finish.
+  size_t start;
+  size_t end;
+  size_t next;
+  size_t request;
+  Result* results;
+  StatusRequest* requests;
+} Frame;
+
+// Reports whether the directory open as `directory`, `depth` levels below the
+// root, is on another device than the root, for -x. Where the mount table
+// rules out entries, a filesystem without an entry of its own (like a btrfs
+// subvolume) would be crossed, so each directory's device is still checked;
+// that costs 1 status per directory, rather than 1 per entry.
+static bool IsOtherDevice(const Walker* w, int directory, long depth) {
+  const Predicate* p = w->predicate;
+  if (!p->has_mount_points || depth == 0) {
+    return false;
+  }
+  struct stat status;
+  return !fstat(directory, &status) && status.st_dev != p->device;
+}
+
+// Starts `f` on the directory open as `directory`, named by `w->path`, and
+// reports whether to walk it (see `VisitDirectory`). `pattern` is the state of
+// the DFA for -m after its pathname.
+static bool OpenFrame(Walker* w,
+                      Frame* f,
+                      int directory,
+                      long depth,
+                      DfaState pattern) {
+  if (!VisitDirectory(w, directory) || IsOtherDevice(w, directory, depth)) {
+    return false;
+  }
+  if (w->watch) {
+    WatchDirectory(w->watch, directory, w->path.values, depth == 0);
+  }
+  *f = (Frame){.directory = directory,
+               .depth = depth,
+               .length = w->path.count,
+               .parent_ignores = w->ignores,
+               .pattern = pattern};
+  Throttle(w->visited, 1, 0);
+  const int e = ReadEntries(directory, &f->entries);
+  if (e) {
+    Warn(e, "%s", w->path.values);
+  }
+
+  const Predicate* p = w->predicate;
+  Entries* entries = &f->entries;
+  if (p->follow) {
+    ResolveLinks(directory, entries);
+  }
+  if (p->sorted) {
+    qsort(entries->values, entries->count, sizeof(Entry), CompareEntries);
+  }
+  if (p->ignore) {
+    f->ignores = PushDirectoryIgnores(w, directory, entries);
+    w->ignores = f->ignores;
+  }
+
+  // Entries need checking against the mount table only where it has some.
+  f->has_mount_points =
+      p->has_mount_points &&
+      HasMountPoints(&p->mount_points, w->path.values, w->path.count);
+
+  if (entries->count) {
+    const size_t n = entries->count < p->batch ? entries->count : p->batch;
+    f->results = calloc(n, sizeof(Result));
+    f->requests = w->engine ? calloc(n, sizeof(StatusRequest)) : NULL;
+    if (!f->results || (w->engine && !f->requests)) {
+      Die(errno, "calloc");
+    }
+  }
+  return true;
+}
+
+// Destroys `*f`, and restores the ignore rules of its parent.
+static void CloseFrame(Walker* w, Frame* f) {
+  free(f->results);
+  free(f->requests);
+  FreeEntries(&f->entries);
+  ReleaseIgnores(&f->ignores);
+  w->ignores = f->parent_ignores;
+}
+
+static int CompareInodeOrders(const void* a, const void* b) {
+  const uint64_t x = ((const InodeOrder*)a)->inode;
+  const uint64_t y = ((const InodeOrder*)b)->inode;
+  return (x > y) - (x < y);
+}
+
+// Fetches the statuses of the `count` `requests`, whose entries' inode numbers
+// are in `w->order`, in order of inode number, which is usually the order of
+// the inodes on disk (on ext4, for example, in the inode tables of each block
+// group). So a disk that has to seek for them seeks less, and in one
+// direction. The `requests` stay in their order.
+static void GetStatusesByInode(Walker* w,
+                               StatusRequest* requests,
+                               size_t count) {
+  const InodeOrder* order = w->order;
+  qsort(w->order, count, sizeof(InodeOrder), CompareInodeOrders);
+  for (size_t i = 0; i < count; i++) {
+    w->sorted[i] = requests[order[i].index];
+  }
+  GetStatuses(w->engine, w->sorted, count);
+  for (size_t i = 0; i < count; i++) {
+    requests[order[i].index] = w->sorted[i];
+  }
+}
+
+// Applies the cheap tests to the next window of the entries of `f`, and then
+// fetches the statuses of those that pass them but need their status checked.
+static void TestWindow(Walker* w, Frame* f) {
+  const Predicate* p = w->predicate;
+  f->start = f->end;
+  f->end = f->entries.count - f->start < p->batch ? f->entries.count
+                                                   : f->start + p->batch;
+  f->next = f->start;
+  f->request = 0;
+  Result* results = f->results;
+  size_t count = 0;
+  for (size_t i = f->start; i < f->end; i++) {
+    const Entry* entry = &f->entries.values[i];
+    const size_t j = i - f->start;
+    if (f->has_mount_points && IsMountEntry(w, entry)) {
+      results[j] = ResultStop;
+      continue;
+    }
+    results[j] = MatchEntry(entry, p);
+    // Only entries that would be printed or descended into need checking.
+    if (p->ignore &&
+        (results[j] == ResultMatch ||
+         (results[j] == ResultContinue && entry->type == DT_DIR)) &&
+        IsIgnoredEntry(w, entry)) {
+      results[j] = ResultStop;
+    }
+    if (results[j] == ResultMatch) {
+      results[j] = MatchPathname(&w->path, f->pattern, w->schedule, entry, p);
+    }
+    if (results[j] == ResultNeedStatus) {
+      f->requests[count] = (StatusRequest){.directory = f->directory,
+                                           .name = entry->name,
+                                           .flags = p->status_flags};
+      if (w->order) {
+        w->order[count] = (InodeOrder){.inode = entry->inode, .index = count};
+      }
+      count++;
+    }
+  }
+  if (count) {
+    Throttle(w->visited, count, count);
+    if (w->order) {
+      GetStatusesByInode(w, f->requests, count);
+    } else {
+      GetStatuses(w->engine, f->requests, count);
+    }
+  }
+}
+
+// Finishes the tests of the entries of `f`, prints them, and so on, in order,
+// until one is a directory to descend into. Returns it, with `w->path` naming
+// it and `*bytes` set to the disk space it uses itself if adding that up; or
+// `NULL` when there are no more.
+static const Entry* NextDescent(Walker* w, Frame* f, uint64_t* bytes) {
+  const Predicate* p = w->predicate;
+  while (true) {
+    if (f->next == f->end) {
+      if (f->end == f->entries.count) {
+        return NULL;
+      }
+      TestWindow(w, f);
+    }
+    const Entry* entry = &f->entries.values[f->next];
+    Result r = f->results[f->next - f->start];
+    f->next++;
+    int error = 0;
+    const struct stat* status = NULL;
+    if (r == ResultNeedStatus) {
+      const StatusRequest* q = &f->requests[f->request];
+      f->request++;
+      error = q->error;
+      status = &q->status;
+      r = error ? ResultContinue
+                : MatchStatus(&w->path, w->schedule, entry, status, p);
+    }
+    if (r == ResultMatch && p->has_content) {
+      // Print the lines that match, rather than the pathname. With -D or -U,
+      // the file counts if it has any.
+      const bool tallied = w->largest || w->duplicates;
+      const bool found = SearchEntry(w, f->directory, entry, !tallied);
+      r = found && tallied ? ResultMatch : ResultContinue;
+    }
+    uint64_t usage = 0;
+    if (r == ResultMatch && w->largest && status) {
+      usage = CountUsage(w, status);
+      r = ResultContinue;
+    }
+    if (r == ResultMatch && w->duplicates && status) {
+      if (entry->type == DT_REG) {
+        const size_t length = AppendPath(&w->path, entry->name, entry->length);
+        AddCandidate(w->duplicates, w->path.values, status);
+        TruncatePath(&w->path, length);
+      }
+      r = ResultContinue;
+    }
+    if (r == ResultMatch && w->census && status) {
+      AddToCensus(w->census, entry->name, entry->length, status);
+      r = ResultContinue;
+    }
+    const bool descend = r != ResultStop && entry->type == DT_DIR;
+    if (!descend) {
+      w->bytes += usage;
+    }
+    if (!error && r != ResultMatch && !descend) {
+      continue;
+    }
+    const size_t length = AppendPath(&w->path, entry->name, entry->length);
+    if (error) {
+      Warn(error, "%s", w->path.values);
+    }
+    if (r == ResultMatch && w->snapshot && status) {
+      TakeSnapshot(w, status);
+    } else if (r == ResultMatch && w->sorter) {
+      AddSorted(w->sorter, w->path.values, w->path.count, status);
+    } else if (r == ResultMatch) {
+      PrintMatch(w->output, &w->path);
+    }
+    if (descend) {
+      *bytes = usage;
+      return entry;
+    }
+    TruncatePath(&w->path, length);
+  }
+}
+
+// Reports whether -m can match nothing at or under the directory named by
+// `w->path`, a child of `f`, so that it need not be opened. Sets `*pattern` to
+// the state of its DFA after the directory's pathname.
+static bool IsPruned(const Walker* w, const Frame* f, DfaState* pattern) {
+  *pattern = AdvancePattern(w->predicate, f->pattern, &w->path, f->length);
+  return DecideDfa(*pattern) == DfaNoMatch;
+}
+
+// Walks the directory open as `directory`, named by `w->path`, handing its
+// subdirectories to `w->descend`, and reports whether it did (see
+// `VisitDirectory`).
+static bool WalkDirectory(Walker* w, int directory, long depth) {
+  Frame f;
+  if (!OpenFrame(w, &f, directory, depth,
+                 StartPattern(w->predicate, &w->path))) {
+    return false;
+  }
+  uint64_t bytes;
+  for (const Entry* e; (e = NextDescent(w, &f, &bytes));) {
+    DfaState pattern;
+    if (IsPruned(w, &f, &pattern)) {
+      w->bytes += bytes;
+    } else {
+      w->descend(w, directory, e, depth + 1, bytes);
+    }
+    TruncatePath(&w->path, f.length);
+  }
+  CloseFrame(w, &f);
+  return true;
+}
+
+// Returns the disk space the directory `root` itself uses, if adding up disk
+// usage.
+static uint64_t GetRootUsage(const Walker* w, const char* root) {
+  struct stat status;
+  if (!w->largest || stat(root, &status)) {
+    return 0;
+  }
+  return (uint64_t)status.st_blocks * 512;
+}
+
+// The frames of the directories a single-threaded walk is partway through,
+// deepest last, so that the depth of the tree costs heap rather than stack.
+// Only the deepest `Predicate.budget` are kept open, from `open` on; the walk
+// closes the others as it descends, and reopens each (as ".." of its child) on
+// the way back up.
+typedef struct Stack {
+  size_t count;
+  size_t capacity;
+  Frame* values;
+  size_t open;
+} Stack;
+
+static void FreeStack(Stack* s) {
+  free(s->values);
+}
+
+// Closes the shallowest open frame of `s`, recording its identity.
+static void CloseOldestFrame(Stack* s) {
+  Frame* f = &s->values[s->open];
+  struct stat status;
+  if (fstat(f->directory, &status)) {
+    return;
+  }
+  f->device = status.st_dev;
+  f->inode = status.st_ino;
+  close(f->directory);
+  f->directory = -1;
+  s->open++;
+}
+
+// Pushes a frame for the directory open as `directory`, which itself uses
+// `bytes`, onto `s`, closing another if that would exceed the budget. Returns
+// false if not walking it, in which case the caller still owns `directory`.
+static bool PushFrame(Walker* w,
+                      Stack* s,
+                      int directory,
+                      long depth,
+                      uint64_t bytes,
+                      DfaState pattern) {
+  if (s->count == s->capacity) {
+    s->capacity = s->capacity ? s->capacity * 2 : 64;
+    Frame* values = realloc(s->values, s->capacity * sizeof(Frame));
+    if (!values) {
+      Die(errno, "realloc");
+    }
+    s->values = values;
+  }
+  const uint64_t start = w->bytes;
+  w->bytes += bytes;
+  if (!OpenFrame(w, &s->values[s->count], directory, depth, pattern)) {
+    w->bytes = start;
+    return false;
+  }
+  s->values[s->count].bytes = start;
+  s->count++;
+  if (s->count - s->open > w->predicate->budget) {
+    CloseOldestFrame(s);
+  }
+  return true;
+}
+
+// Reports whether `d` is open on the directory that `f` was.
+static bool IsFrameDirectory(const Frame* f, int d) {
+  struct stat status;
+  return d >= 0 && !fstat(d, &status) && status.st_dev == f->device &&
+         status.st_ino == f->inode;
+}
+
+// Reopens `f`, which was closed to stay within the budget, as ".." of its
+// child, open as `child`; or if that is not the same directory (as when the
+// walk followed a symbolic link to the child), by its pathname, `w->path`.
+// If neither works, the rest of its entries are skipped.
+static void ReopenFrame(Walker* w, Frame* f, int child) {
+  const Predicate* p = w->predicate;
+  const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+  int d = OpenGently(p, child, "..", flags);
+  if (!IsFrameDirectory(f, d)) {
+    if (d >= 0) {
+      close(d);
+    }
+    d = OpenGently(p, AT_FDCWD, w->path.values, flags);
+    if (d >= 0 && !IsFrameDirectory(f, d)) {
+      close(d);
+      d = -1;
+      errno = ENOENT;
+    }
+  }
+  if (d < 0) {
+    Warn(errno, "%s", w->path.values);
+    f->next = f->end = f->entries.count;
+    return;
+  }
+  f->directory = d;
+}
+
+// Finishes the deepest frame of `s`, offers its disk usage if adding that up,
+// and returns to its parent.
+static void PopFrame(Walker* w, Stack* s) {
+  Frame* f = &s->values[s->count - 1];
+  CloseFrame(w, f);
+  if (w->largest) {
+    OfferUsage(w->largest, w->bytes - f->bytes, w->path.values, false);
+  }
+  s->count--;
+  if (s->count) {
+    Frame* parent = &s->values[s->count - 1];
+    TruncatePath(&w->path, parent->length);
+    if (parent->directory < 0) {
+      ReopenFrame(w, parent, f->directory);
+      s->open--;
+    }
+  }
+  if (f->directory >= 0) {
+    close(f->directory);
+  }
+}
+
+// Walks the tree under the directory open as `directory`, named by `w->path`,
+// which is `level` levels below the root and itself uses `bytes`, depth-first,
+// and closes it.
+static void WalkTree(Walker* w, int directory, long level, uint64_t bytes) {
+  const Predicate* p = w->predicate;
+  AUTO(Stack, s, (Stack){0}, FreeStack);
+  if (!PushFrame(w, &s, directory, level, bytes, StartPattern(p, &w->path))) {
+    close(directory);
+    return;
+  }
+  while (s.count) {
+    Frame* f = &s.values[s.count - 1];
+    uint64_t usage;
+    const Entry* child = NextDescent(w, f, &usage);
+    if (!child) {
+      PopFrame(w, &s);
+      continue;
+    }
+    const long depth = f->depth + 1;
+    const size_t length = f->length;
+    DfaState pattern;
+    if ((p->has_depth && depth > p->depth) || IsPruned(w, f, &pattern)) {
+      w->bytes += usage;
+      TruncatePath(&w->path, length);
+      continue;
+    }
+    const int d = OpenDirectory(p, f->directory, child->name);
+    if (d < 0) {
+      Warn(errno, "%s", w->path.values);
+      w->bytes += usage;
+      TruncatePath(&w->path, length);
+    } else if (!PushFrame(w, &s, d, depth, usage, pattern)) {
+      close(d);
+      TruncatePath(&w->path, length);
+    }
+  }
+}
+
+static void WalkRoot(Walker* w, const char* root) {
+  SetPath(&w->path, root);
+  const int d = OpenGently(w->predicate, AT_FDCWD, root,
+                           O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (d < 0) {
+    Warn(errno, "%s", root);
+    return;
+  }
+  if (w->predicate->ignore) {
+    w->ignores = NewParentIgnores(root, w->path.count);
+  }
+  WalkTree(w, d, 0, GetRootUsage(w, root));
+  ReleaseIgnores(&w->ignores);
+}
+
+static void FreeWalker(Walker* w) {
+  FreePath(&w->path);
+  FreeStatusEngine(&w->engine);
+  FreeSchedule(&w->schedule);
+  free(w->contents);
+  free(w->order);
+  free(w->sorted);
+  FreeSorter(&w->sorter);
+}
+
+static StatusEngine* NewWalkerEngine(const Predicate* p) {
+  const unsigned fields = p->status_fields | p->expression.status_fields;
+  return fields ? NewStatusEngine(fields, p->status_depth) : NULL;
+}
+
+// Returns room for a window of `size`-byte items, if -O needs it, or `NULL`.
+static void* NewInodeScratch(const Predicate* p, size_t size) {
+  if (!p->inode_order) {
+    return NULL;
+  }
+  void* result = calloc(p->batch, size);
+  if (!result) {
+    Die(errno, "calloc");
+  }
+  return result;
+}
+
+// How much memory the `Sorter`s for -o may use, in total, before spilling.
+#define SORT_MEMORY (64 * 1024 * 1024)
+
+// Returns a `Sorter` for -o, for 1 of `count` walkers, unless a single walker
+// walks in order anyway.
+static Sorter* NewWalkerSorter(const Predicate* p, size_t count) {
+  if (!p->has_sort || (count == 1 && p->sorted)) {
+    return NULL;
+  }
+  return NewSorter(p->sort, SORT_MEMORY / count);
+}
+
+static Schedule* NewWalkerSchedule(const Predicate* p) {
+  return p->has_expression ? NewSchedule(&p->expression) : NULL;
+}
+
+static void Walk(const char* root,
+                 const Predicate* p,
+                 bool verbose,
+                 Largest* largest,
+                 Duplicates* duplicates,
+                 Snapshot* snapshot,
+                 Census* census,
+                 Watch* watch,
+                 Output* o) {
+  AUTO(Walker, w,
+       ((Walker){.predicate = p,
+                 .engine = NewWalkerEngine(p),
+                 .schedule = NewWalkerSchedule(p),
+                 .order = NewInodeScratch(p, sizeof(InodeOrder)),
+                 .sorted = NewInodeScratch(p, sizeof(StatusRequest)),
+                 .sorter = NewWalkerSorter(p, 1),
+                 .output = o,
+                 .visited = NewVisited(p, verbose, largest),
+                 .largest = largest,
+                 .duplicates = duplicates,
+                 .snapshot = snapshot,
+                 .census = census,
+                 .watch = watch}),
+       FreeWalker);
+  if (snapshot) {
+    snapshot->root = root;
+    snapshot->prefix = strlen(root) + 1;
+  }
+  WalkRoot(&w, root);
+  if (w.sorter) {
+    PrintSorted(&w.sorter, 1, ors, o);
+  }
+  FreeVisited(&w.visited, root, verbose);
+}
+
+// A directory whose subdirectories are waiting to be walked, held open until
+// they have all been opened, so that each is opened relative to it rather than
+// by its whole pathname.
+typedef struct Parent {
+  atomic_size_t references;
+  int fd;
+} Parent;
+
+// Returns a new `Parent` holding a duplicate of `directory`, or `NULL` if there
+// are no file descriptors to spare.
+static Parent* NewParent(int directory) {
+  const int fd = fcntl(directory, F_DUPFD_CLOEXEC, 0);
+  if (fd < 0) {
+    return NULL;
+  }
+  Parent* p = malloc(sizeof(Parent));
+  if (!p) {
+    Die(errno, "malloc");
+  }
+  atomic_init(&p->references, 1);
+  p->fd = fd;
+  return p;
+}
+
+static Parent* RetainParent(Parent* p) {
+  if (p) {
+    atomic_fetch_add(&p->references, 1);
+  }
+  return p;
+}
+
+static void ReleaseParent(Parent** p) {
+  Parent* x = *p;
+  if (x && atomic_fetch_sub(&x->references, 1) == 1) {
+    close(x->fd);
+    free(x);
+  }
+  *p = NULL;
+}
+
+// A directory waiting to be walked by a `Worker`. It is `name` in `parent`, or
+// if there is none, `pathname`.
+typedef struct Work {
+  char* pathname;
+  const char* name;
+  Parent* parent;
+  long depth;
+  Ignores* ignores;
+  Tally* tally;
+} Work;
+
+// A double-ended queue of `Work`. The owning `Worker` pushes and pops at the
+// tail, so that it walks depth-first and keeps its working set small; thieves
+// take from the head, where the oldest and likely largest subtrees are.
+typedef struct Deque {
+  pthread_mutex_t lock;
+  size_t capacity;
+  size_t head;
+  size_t tail;
+  Work* values;
+} Deque;
+
+typedef struct Pool Pool;
+
+typedef struct Worker {
+  Pool* pool;
+  size_t index;
+  pthread_t thread;
+  Deque deque;
+  Walker walker;
+  // The directory being walked, once it has a subdirectory to hand out.
+  Parent* parent;
+  Output output;
+  Largest largest;
+} Worker;
+
+struct Pool {
+  const Predicate* predicate;
+  size_t count;
+  Worker* workers;
+  // The number of `Work`s pushed but not yet finished. When it reaches 0, there
+  // is no more work and nothing running that could create more.
+  atomic_size_t pending;
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle;
+};
+
+static void PushWork(Worker* w, Work work) {
+  // Count the work before publishing it, so that a thief cannot finish it and
+  // bring `pending` to 0 while we are still running.
+  atomic_fetch_add(&w->pool->pending, 1);
+  Deque* d = &w->deque;
+  pthread_mutex_lock(&d->lock);
+  if (d->tail == d->capacity) {
+    // Reclaim the space thieves have vacated before growing.
+    const size_t count = d->tail - d->head;
+    if (d->head > d->capacity / 2) {
+      memmove(d->values, &d->values[d->head], count * sizeof(Work));
+      d->head = 0;
+      d->tail = count;
+    } else {
+      d->capacity = d->capacity ? d->capacity * 2 : 64;
+      Work* values = realloc(d->values, d->capacity * sizeof(Work));
+      if (!values) {
+        Die(errno, "realloc");
+      }
+      d->values = values;
+    }
+  }
+  d->values[d->tail] = work;
+  d->tail++;
+  pthread_mutex_unlock(&d->lock);
+  pthread_cond_signal(&w->pool->idle);
+}
+
+static bool PopWork(Deque* d, Work* result) {
+  pthread_mutex_lock(&d->lock);
+  const bool found = d->head < d->tail;
+  if (found) {
+    d->tail--;
+    *result = d->values[d->tail];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static bool StealWork(Deque* d, Work* result) {
+  pthread_mutex_lock(&d->lock);
+  const bool found = d->head < d->tail;
+  if (found) {
+    *result = d->values[d->head];
+    d->head++;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static bool FindWork(Worker* w, Work* result) {
+  if (PopWork(&w->deque, result)) {
+    return true;
+  }
+  const Pool* pool = w->pool;
+  for (size_t i = 1; i < pool->count; i++) {
+    Worker* victim = &pool->workers[(w->index + i) % pool->count];
+    if (StealWork(&victim->deque, result)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void DescendInPool(Walker* w,
+                          int parent,
+                          const Entry* entry,
+                          long depth,
+                          uint64_t bytes) {
+  const Predicate* p = w->predicate;
+  if (p->has_depth && depth > p->depth) {
+    w->bytes += bytes;
+    return;
+  }
+  char* copy = strdup(w->path.values);
+  if (!copy) {
+    Die(errno, "strdup");
+  }
+  Worker* worker = w->context;
+  Parent* q = NULL;
+  if (entry) {
+    if (!worker->parent) {
+      worker->parent = NewParent(parent);
+    }
+    q = RetainParent(worker->parent);
+  }
+  Tally* tally = w->largest ? NewTally(w->tally, copy, bytes) : NULL;
+  PushWork(worker,
+           (Work){.pathname = copy,
+                  .name = q ? &copy[w->path.count - entry->length] : copy,
+                  .parent = q,
+                  .depth = depth,
+                  .ignores = RetainIgnores(w->ignores),
+                  .tally = tally});
+}
+
+static void* RunWorker(void* context) {
+  Worker* w = context;
+  Pool* pool = w->pool;
+  while (true) {
+    Work work;
+    if (FindWork(w, &work)) {
+      SetPath(&w->walker.path, work.pathname);
+      w->walker.ignores = work.ignores;
+      w->walker.tally = work.tally;
+      w->walker.bytes = 0;
+      bool walked = true;
+      const int d = OpenGently(pool->predicate,
+                               work.parent ? work.parent->fd : AT_FDCWD,
+                               work.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      ReleaseParent(&work.parent);
+      if (d < 0) {
+        Warn(errno, "%s", work.pathname);
+      } else {
+        walked = WalkDirectory(&w->walker, d, work.depth);
+        ReleaseParent(&w->parent);
+        close(d);
+      }
+      FinishTally(work.tally, w->walker.bytes, walked, &w->largest);
+      w->walker.tally = NULL;
+      ReleaseIgnores(&w->walker.ignores);
+      free(work.pathname);
+      if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_cond_broadcast(&pool->idle);
+      }
+      continue;
+    }
+    if (atomic_load(&pool->pending) == 0) {
+      return NULL;
+    }
+
+    // Another worker is busy and may yet push work for us to steal. The
+    // timeout covers the race between our failed search and its push.
+    pthread_mutex_lock(&pool->idle_lock);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&pool->idle, &pool->idle_lock, &deadline);
+    pthread_mutex_unlock(&pool->idle_lock);
+  }
+}
+
+// Each worker buffers its own output, and they take turns writing it. If adding
+// up disk usage, each keeps its own largest directories, and they are merged
+// when done.
+static void WalkInPool(const char* root,
+                       const Predicate* p,
+                       size_t count,
+                       bool verbose,
+                       Largest* largest,
+                       Duplicates* duplicates,
+                       Census* census,
+                       Watch* watch,
+                       Output* o) {
+  FlushOutput(o);
+  Visited* visited = NewVisited(p, verbose, largest);
+  pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+  Pool pool = {.predicate = p, .count = count};
+  pthread_mutex_init(&pool.idle_lock, NULL);
+  pthread_cond_init(&pool.idle, NULL);
+  pool.workers = calloc(count, sizeof(Worker));
+  if (!pool.workers) {
+    Die(errno, "calloc");
+  }
+  for (size_t i = 0; i < count; i++) {
+    Worker* w = &pool.workers[i];
+    w->pool = &pool;
+    w->index = i;
+    pthread_mutex_init(&w->deque.lock, NULL);
+    w->output = (Output){.fd = o->fd,
+                         .capacity = OUTPUT_BUFFER_SIZE,
+                         .values = malloc(OUTPUT_BUFFER_SIZE),
+                         .lock = &output_lock};
+    if (!w->output.values) {
+      Die(errno, "malloc");
+    }
+    if (largest) {
+      w->largest = NewLargest(largest->capacity);
+    }
+    w->walker = (Walker){.predicate = p,
+                         .engine = NewWalkerEngine(p),
+                         .schedule = NewWalkerSchedule(p),
+                         .order = NewInodeScratch(p, sizeof(InodeOrder)),
+                         .sorted = NewInodeScratch(p, sizeof(StatusRequest)),
+                         .sorter = NewWalkerSorter(p, count),
+                         .output = &w->output,
+                         .visited = visited,
+                         .largest = largest ? &w->largest : NULL,
+                         .duplicates = duplicates,
+                         .census = census ? NewCensusLike(census) : NULL,
+                         .watch = watch,
+                         .descend = DescendInPool,
+                         .context = w};
+  }
+
+  Walker* first = &pool.workers[0].walker;
+  SetPath(&first->path, root);
+  if (p->ignore) {
+    first->ignores = NewParentIgnores(root, first->path.count);
+  }
+  DescendInPool(first, AT_FDCWD, NULL, 0, GetRootUsage(first, root));
+  ReleaseIgnores(&first->ignores);
+  for (size_t i = 0; i < count; i++) {
+    const int e = pthread_create(&pool.workers[i].thread, NULL, RunWorker,
+                                 &pool.workers[i]);
+    if (e) {
+      Die(e, "pthread_create");
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    pthread_join(pool.workers[i].thread, NULL);
+  }
+  if (p->has_sort) {
+    Sorter** sorters = calloc(count, sizeof(Sorter*));
+    if (!sorters) {
+      Die(errno, "calloc");
+    }
+    for (size_t i = 0; i < count; i++) {
+      sorters[i] = pool.workers[i].walker.sorter;
+    }
+    PrintSorted(sorters, count, ors, o);
+    free(sorters);
+  }
+  if (census) {
+    for (size_t i = 0; i < count; i++) {
+      MergeCensus(census, pool.workers[i].walker.census);
+      FreeCensus(&pool.workers[i].walker.census);
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    Worker* w = &pool.workers[i];
+    pthread_mutex_destroy(&w->deque.lock);
+    free(w->deque.values);
+    FreeWalker(&w->walker);
+    FlushOutput(&w->output);
+    free(w->output.values);
+    if (largest) {
+      MergeLargest(largest, &w->largest);
+    }
+  }
+  pthread_mutex_destroy(&output_lock);
+  free(pool.workers);
+  pthread_cond_destroy(&pool.idle);
+  pthread_mutex_destroy(&pool.idle_lock);
+  FreeVisited(&visited, root, verbose);
+}
+
+// Opens directories that are only probed, not read, as cheaply as the system
+// allows.
+#if defined(O_PATH)
+#define PROBE_FLAGS O_PATH
+#else
+#define PROBE_FLAGS O_RDONLY
+#endif
+
+// Prints the matching children of the directory open as `directory`, named by
+// `w->path`, up to `limit` of them, and returns how many. With literal names
+// (see `Predicate.names`), it looks each up, rather than reading the directory.
+static size_t PrintMatchesIn(Walker* w, int directory, size_t limit) {
+  const Predicate* p = w->predicate;
+  size_t found = 0;
+  if (p->has_names) {
+    for (size_t i = 0; i < p->name_count && found < limit; i++) {
+      const char* name = p->names[i];
+      struct stat status;
+      if (fstatat(directory, name, &status, p->status_flags)) {
+        if (errno != ENOENT) {
+          const size_t length = AppendPath(&w->path, name, strlen(name));
+          Warn(errno, "%s", w->path.values);
+          TruncatePath(&w->path, length);
+        }
+        continue;
+      }
+      const Entry entry = {.name = name,
+                           .length = strlen(name),
+                           .inode = status.st_ino,
+                           .type = (unsigned char)IFTODT(status.st_mode)};
+      found += PrintIfMatch(w, directory, &entry, &status) == ResultMatch;
+    }
+    return found;
+  }
+
+  AUTO(Entries, entries, (Entries){0}, FreeEntries);
+  const int e = ReadEntries(directory, &entries);
+  if (e) {
+    Warn(e, "%s", w->path.values);
+  }
+  for (size_t i = 0; i < entries.count && found < limit; i++) {
+    found +=
+        PrintIfMatch(w, directory, &entries.values[i], NULL) == ResultMatch;
+  }
+  return found;
+}
+
+// Searches the directory named by `pathname`, and then each of its ancestors
+// up to the root, nearest first, printing at most `limit` matches (or all, if
+// 0). Each directory is opened relative to the one before.
+static void WalkUp(const char* pathname,
+                   const Predicate* p,
+                   size_t limit,
+                   Output* o) {
+  char real[PATH_MAX];
+  if (!realpath(pathname, real)) {
+    Warn(errno, "%s", pathname);
+    return;
+  }
+  const int flags =
+      (p->has_names ? PROBE_FLAGS : O_RDONLY) | O_DIRECTORY | O_CLOEXEC;
+  int d = OpenGently(p, AT_FDCWD, real, flags);
+  AUTO(Walker, w,
+       ((Walker){.predicate = p,
+                 .output = o,
+                 .schedule = NewWalkerSchedule(p)}),
+       FreeWalker);
+  SetPath(&w.path, real);
+  size_t found = 0;
+  for (long long depth = 0; !p->has_depth || depth <= p->depth; depth++) {
+    if (d < 0) {
+      Warn(errno, "%s", w.path.values);
+      return;
+    }
+    found += PrintMatchesIn(&w, d, limit ? limit - found : SIZE_MAX);
+    if ((limit && found >= limit) || StringEquals("/", w.path.values)) {
+      break;
+    }
+    const int parent = OpenGently(p, d, "..", flags);
+    close(d);
+    d = parent;
+    const char* slash = strrchr(w.path.values, '/');
+    TruncatePath(&w.path, slash == w.path.values
+                              ? 1
+                              : (size_t)(slash - w.path.values));
+  }
+  if (d >= 0) {
+    close(d);
+  }
+}
+
+// Opens the directory `pathname`, a component at a time if it is too long to
+// open at once.
+static int OpenPathname(const char* pathname) {
+  const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+  int d = open(pathname, flags);
+  if (d >= 0 || errno != ENAMETOOLONG) {
+    return d;
+  }
+  d = open(pathname[0] == '/' ? "/" : ".", flags);
+  for (const char* c = pathname; d >= 0;) {
+    while (*c == '/') {
+      c++;
+    }
+    const char* end = strchrnul(c, '/');
+    const size_t length = (size_t)(end - c);
+    if (!length) {
+      break;
+    }
+    char name[NAME_MAX + 1];
+    if (length > NAME_MAX) {
+      close(d);
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    memcpy(name, c, length);
+    name[length] = '\0';
+    const int child = openat(d, name, flags);
+    close(d);
+    d = child;
+    c = end;
+  }
+  return d;
+}
+
+// Tests the entry that `e` reports changed, and prints it if it matches. If it
+// is a directory new to the tree, and its entries were not reported, walks it
+// too.
+static void PrintIfChanged(Walker* w, const WatchEvent* e) {
+  const Predicate* p = w->predicate;
+  // The depth of the directory below the root. Under a hidden directory, the
+  // entry would not have been walked (and with fanotify, it is not filtered
+  // out by not being watched).
+  long depth = 0;
+  for (const char* c = &e->directory[e->root]; *c; c++) {
+    if (*c != '/') {
+      continue;
+    } else if (c[1] == '.' && !p->walk_all) {
+      return;
+    }
+    depth++;
+  }
+  if (p->has_depth && depth > p->depth) {
+    return;
+  }
+  const int d = OpenPathname(e->directory);
+  if (d < 0) {
+    // Deleted or renamed since.
+    return;
+  }
+  struct stat status;
+  if (fstatat(d, e->name, &status, p->status_flags)) {
+    close(d);
+    return;
+  }
+  // A new file is printed when it is closed after being written, rather than
+  // while it is empty. New links to a file are printed now.
+  if (e->changes == WatchCreated && S_ISREG(status.st_mode) &&
+      status.st_nlink == 1) {
+    close(d);
+    return;
+  }
+
+  SetPath(&w->path, e->directory);
+  const Entry entry = {.name = e->name,
+                       .length = e->length,
+                       .inode = status.st_ino,
+                       .type = (unsigned char)IFTODT(status.st_mode)};
+  const Result r = PrintIfMatch(w, d, &entry, &status);
+  if (r != ResultStop && S_ISDIR(status.st_mode) && e->walk &&
+      !(p->has_depth && depth + 1 > p->depth)) {
+    AppendPath(&w->path, e->name, e->length);
+    if (DecideDfa(StartPattern(p, &w->path)) != DfaNoMatch) {
+      const int child = OpenDirectory(p, d, e->name);
+      if (child >= 0) {
+        WalkTree(w, child, depth + 1, 0);
+      }
+    }
+  }
+  close(d);
+}
+
+// With -W, after the trees have been walked, prints what comes to match in
+// them, until there is nothing left to watch.
+static void WatchTrees(Watch* watch, const Predicate* p, Output* o) {
+  AUTO(Walker, w,
+       ((Walker){.predicate = p,
+                 .engine = NewWalkerEngine(p),
+                 .schedule = NewWalkerSchedule(p),
+                 .order = NewInodeScratch(p, sizeof(InodeOrder)),
+                 .sorted = NewInodeScratch(p, sizeof(StatusRequest)),
+                 .output = o,
+                 .watch = watch}),
+       FreeWalker);
+  while (true) {
+    FlushOutput(o);
+    if (!ReadWatch(watch)) {
+      break;
+    }
+    for (WatchEvent e; NextWatchEvent(watch, &e);) {
+      PrintIfChanged(&w, &e);
+    }
+  }
+}
+
+// Sets the I/O priority of the process, and of threads it starts later, to the
+// idle class if `idle`, or else to the lowest of the best-effort class. Returns
+// 0, or an error number.
+static int SetIOPriority(bool idle) {
+#if defined(__linux__)
+  // From linux/ioprio.h, which is not always installed.
+  enum { who_process = 1, class_shift = 13, best_effort = 2, idle_class = 3 };
+  const int priority =
+      idle ? idle_class << class_shift : (best_effort << class_shift) | 7;
+  return syscall(SYS_ioprio_set, who_process, 0, priority) ? errno : 0;
+#elif defined(__MACH__)
+  return setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS,
+                        idle ? IOPOL_THROTTLE : IOPOL_UTILITY)
+             ? errno
+             : 0;
+#else
+  (void)idle;
+  return ENOTSUP;
+#endif
+}
+
+// With -u, sets `p->names` to the names in `globs` if none has a wildcard.
+// Those of hidden files are left out, unless walking them, since they could
+// never match.
+static void FindLiteralNames(Predicate* p, const char* globs) {
+  if (strpbrk(globs, "*?[\\/")) {
+    return;
+  }
+  p->name_buffer = strdup(globs);
+  p->names = calloc(strlen(globs) + 1, sizeof(char*));
+  if (!p->name_buffer || !p->names) {
+    Die(errno, "malloc");
+  }
+  char* rest = p->name_buffer;
+  for (char* name; (name = strsep(&rest, ","));) {
+    if (name[0] && !StringEquals(".", name) && !StringEquals("..", name) &&
+        (name[0] != '.' || p->walk_all)) {
+      p->names[p->name_count] = name;
+      p->name_count++;
+    }
+  }
+  p->has_names = true;
+}
+
+// Sets the device of the root named by `pathname`, for -x. If `scan_mounts`,
+// it finds the mount points beneath the root, so that only they need checking;
+// otherwise, or if there is no mount table, every entry's device is compared.
+static int PopulateDevice(Predicate* p,
+                          const char* pathname,
+                          bool scan_mounts) {
+  if (!p->has_no_cross_device) {
+    return 0;
+  }
+  struct stat status;
+  if (lstat(pathname, &status)) {
+    return errno;
+  }
+  p->device = status.st_dev;
+  FreeMountPoints(&p->mount_points);
+  p->has_mount_points =
+      scan_mounts &&
+      FindMountPoints(pathname, p->device, &p->mount_points) == 0;
+  if (!p->has_mount_points) {
+    p->status_fields |= StatusFieldType;
+  }
+  return 0;
+}
+
+int main(int count, char** arguments) {
+  Arguments as = ParseCLI(&cli, count, arguments);
+  if (OVB('h')) {
+    PrintHelpAndExit(&cli, false, true);
+  }
+
+  // Since finding options and values in `cli` takes linear time, and since we'd
+  // be looking them up for every pathname we try to match, we instead copy the
+  // options into the `Predicate` `struct` for constant-time lookup.
+  AUTO(Predicate, p, (Predicate){0}, FreePredicate);
+  char buffer[OUTPUT_BUFFER_SIZE];
+  AUTO(Output, output,
+       ((Output){.fd = STDOUT_FILENO,
+                 .capacity = sizeof(buffer),
+                 .values = buffer}),
+       CloseOutput);
+  ors = OVB('0') ? '\0' : '\n';
+  p.walk_all = OVB('A');
+  p.ignore = OVB('I');
+  p.follow = OVB('L');
+  p.status_flags = p.follow ? 0 : AT_SYMLINK_NOFOLLOW;
+  const bool verbose = OVB('v');
+  if (OVB('i')) {
+    const char* s = OVS('i');
+    if (!StringEquals(s, "idle") && !StringEquals(s, "low")) {
+      PrintHelpAndExit(&cli, true, false);
+    }
+    const int e = SetIOPriority(StringEquals(s, "idle"));
+    if (e) {
+      Warn(e, "could not set I/O priority");
+    }
+    p.gentle = true;
+  }
+  p.rate = OVB('r') ? OVZ('r') : 0;
+  p.budget = OVZ('f');
+  if (p.budget == 0) {
+    PrintHelpAndExit(&cli, true, false);
+  }
+  p.inode_order = OVB('O');
+  p.batch = p.inode_order ? INODE_BATCH : STATUS_BATCH;
+  bool up = OVB('u');
+  const size_t thread_count = OVZ('j');
+  if (thread_count == 0) {
+    PrintHelpAndExit(&cli, true, false);
+  }
+  if (OVB('a')) {
+    p.after = OVDT('a');
+    p.has_after = true;
+  }
+  if (OVB('b')) {
+    p.before = OVDT('b');
+    p.has_before = true;
+  }
+  if (OVB('d')) {
+    p.depth = OVI('d');
+    p.has_depth = true;
+  }
+  if (OVB('e')) {
+    p.extensions = NewExtensions(OVS('e'));
+    p.has_extensions = true;
+  }
+  if (OVB('n')) {
+    p.globs = CompileGlobs(OVS('n'));
+    if (p.globs.error) {
+      PrintRegexError(p.globs.error, &p.globs.value);
+      return EXIT_FAILURE;
+    }
+    p.has_globs = true;
+    if (up && !p.has_extensions) {
+      FindLiteralNames(&p, OVS('n'));
+    }
+  }
+  if (OVB('m')) {
+    p.pattern = OVRE('m');
+    p.has_pattern = true;
+  }
+  if (OVB('g')) {
+    p.content = NewSearch(OVS('g'));
+    if (p.content.regex.error) {
+      PrintRegexError(p.content.regex.error, &p.content.regex.value);
+      return EXIT_FAILURE;
+    }
+    p.has_content = true;
+  }
+  if (OVB('S')) {
+    p.larger = OVI('S');
+    p.has_larger_than = true;
+  }
+  if (OVB('s')) {
+    p.smaller = OVI('s');
+    p.has_smaller_than = true;
+  }
+  if (OVB('t')) {
+    p.type = ParseTypes(OVS('t'));
+    p.has_type = true;
+  }
+  if (OVB('E')) {
+    p.expression = CompileExpression(OVS('E'));
+    p.has_expression = true;
+  }
+  p.has_no_cross_device = OVB('x');
+  if (p.has_after || p.has_before) {
+    p.status_fields |= StatusFieldTimes;
+  }
+  if (p.has_larger_than || p.has_smaller_than) {
+    p.status_fields |= StatusFieldSize;
+  }
+  AUTO(Largest, largest, (Largest){0}, FreeLargest);
+  Largest* top = NULL;
+  if (OVB('D')) {
+    if (OVZ('D') == 0) {
+      PrintHelpAndExit(&cli, true, false);
+    }
+    largest = NewLargest(OVZ('D'));
+    top = &largest;
+    p.status_fields |= StatusFieldSize | StatusFieldInode;
+  }
+  AUTO(Duplicates*, duplicates, NULL, FreeDuplicates);
+  if (OVB('U')) {
+    if (top) {
+      PrintHelpAndExit(&cli, true, false);
+    }
+    duplicates = NewDuplicates(p.gentle);
+    p.status_fields |= StatusFieldSize | StatusFieldInode;
+  }
+  Snapshot snapshot = {.output = &output};
+  Snapshot* changes = NULL;
+  if (OVB('c') || OVB('w')) {
+    if (thread_count > 1 || up || top || duplicates || p.has_content ||
+        as.count > 1) {
+      PrintHelpAndExit(&cli, true, false);
+    }
+    if (OVB('c')) {
+      snapshot.reader = OpenSnapshot(OVS('c'));
+      if (!snapshot.reader) {
+        Die(errno, "%s", OVS('c'));
+      }
+    }
+    if (OVB('w')) {
+      snapshot.writer = NewSnapshotWriter(OVS('w'));
+    }
+    changes = &snapshot;
+    p.sorted = true;
+    p.status_fields |= StatusFieldType | StatusFieldSize | StatusFieldTimes |
+                       StatusFieldInode;
+  }
+  if (OVB('o')) {
+    const char* s = OVS('o');
+    if (up || top || duplicates || changes || p.has_content) {
+      PrintHelpAndExit(&cli, true, false);
+    } else if (StringEquals(s, "name")) {
+      p.sort = SortKeyName;
+      p.sorted = thread_count == 1;
+    } else if (StringEquals(s, "size")) {
+      p.sort = SortKeySize;
+      p.status_fields |= StatusFieldSize;
+    } else if (StringEquals(s, "time")) {
+      p.sort = SortKeyTime;
+      p.status_fields |= StatusFieldTimes;
+    } else {
+      PrintHelpAndExit(&cli, true, false);
+    }
+    p.has_sort = true;
+  }
+  AUTO(Census*, census, NULL, FreeCensus);
+  if (OVB('C')) {
+    if (up || top || duplicates || changes || p.has_sort || p.has_content) {
+      PrintHelpAndExit(&cli, true, false);
+    }
+    census = NewCensus(time(NULL));
+    p.status_fields |= StatusFieldType | StatusFieldSize | StatusFieldTimes;
+  }
+  AUTO(Watch*, watch, NULL, FreeWatch);
+  if (OVB('W')) {
+    if (up || p.follow || p.ignore || top || duplicates || changes ||
+        p.has_sort || census) {
+      PrintHelpAndExit(&cli, true, false);
+    }
+    watch = NewWatch();
+    if (!watch) {
+      Die(errno, "cannot watch for changes");
+    }
+  }
+  p.status_depth = OVZ('q');
+  size_t limit = 0;
+  if (OVB('l')) {
+    limit = OVZ('l');
+    if (!up || limit == 0) {
+      PrintHelpAndExit(&cli, true, false);
+    }
+  }
+
+  if (as.count == 0) {
+    if (up) {
+      char cwd[PATH_MAX + 1] = "";
+      getcwd(cwd, sizeof(cwd));
+      const int e = PopulateDevice(&p, cwd, false);
+      if (e) {
+        MustPrintf(stderr, "%s: %s\n", cwd, strerror(e));
+        return errno;
+      }
+      WalkUp(cwd, &p, limit, &output);
+    } else {
+      const int e = PopulateDevice(&p, ".", !p.follow);
+      if (e) {
+        MustPrintf(stderr, "./: %s\n", strerror(e));
+        return errno;
+      }
+      if (thread_count > 1) {
+        WalkInPool(".", &p, thread_count, verbose, top, duplicates, census,
+                   watch, &output);
+      } else {
+        Walk(".", &p, verbose, top, duplicates, changes, census, watch,
+             &output);
+      }
+    }
+  }
+  for (size_t i = 0; i < as.count; i++) {
+    const int e = PopulateDevice(&p, as.values[i], !up && !p.follow);
     if (e) {
       MustPrintf(stderr, "./: %s\n", strerror(e));
       continue;
     }
     if (up) {
-      WalkUp(as.values[i], &p, 0);
+      WalkUp(as.values[i], &p, limit, &output);
+    } else if (thread_count > 1) {
+      WalkInPool(as.values[i], &p, thread_count, verbose, top, duplicates,
+                 census, watch, &output);
     } else {
-      Walk(as.values[i], &p, 0);
+      Walk(as.values[i], &p, verbose, top, duplicates, changes, census, watch,
+           &output);
     }
   }
+  if (top) {
+    PrintLargest(&output, top);
+  }
+  if (census) {
+    PrintCensus(census, OVZ('C'), ors, &output);
+  }
+  if (snapshot.reader) {
+    FinishDiff(snapshot.reader, PrintChange, &snapshot);
+    CloseSnapshot(&snapshot.reader);
+  }
+  // Replace the old snapshot only once done reading it.
+  CloseSnapshotWriter(&snapshot.writer);
+  if (duplicates) {
+    const DuplicateCount c =
+        PrintDuplicates(duplicates, thread_count, ors, &output);
+    FlushOutput(&output);
+    MustPrintf(stderr,
+               "%zu duplicate files in %zu groups; %" PRIu64
+               " bytes reclaimable\n",
+               c.files, c.groups, c.bytes);
+  }
+  if (watch) {
+    WatchTrees(watch, &p, &output);
+  }
 }
@@ -0,0 +1,173 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cli.h"
+#include "testing.h"
+#include "utils.h"
+
+// clang-format off
+static char description[] =
+"stress `walk` with a very deep tree\n"
+"\n"
+"    walk_test [options...]\n"
+"\n"
+"Builds a temporary tree that is a chain of directories named `d`, each with a file `f`, and a file `leaf` at the bottom. Then walks it with `walk -f`, allowed only a few open files, and exits with an error if `walk` fails or does not print every entry. Then prints how long the walk took, and removes the tree.";
+
+static Option options[] = {
+  {
+    .flag = 'd',
+    .description = "make the tree this many levels deep",
+    .value = { .type = OptionTypeSize, .z = 10000 }
+  },
+  {
+    .flag = 'f',
+    .description = "run `walk -f` with this budget of open directories",
+    .value = { .type = OptionTypeSize, .z = 16 }
+  },
+  {
+    .flag = 'h',
+    .description = "print help message",
+    .value = { .type = OptionTypeBool }
+  },
+  {
+    .flag = 'n',
+    .description = "limit `walk` to this many open files",
+    .value = { .type = OptionTypeSize, .z = 64 }
+  },
+  {
+    .flag = 'w',
+    .description = "run this `walk` executable",
+    .value = { .type = OptionTypeString, .s = "./walk" }
+  },
+};
+
+static CLI cli = {
+  .name = "walk_test",
+  .description = description,
+  .options = {.count = COUNT(options), .values = options},
+};
+// clang-format on
+
+static int OpenDirectory(int directory, const char* name) {
+  return openat(directory, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+// Builds the tree in `root`, holding only one directory open at a time.
+static void BuildTree(const char* root, size_t depth) {
+  int directory = OpenDirectory(AT_FDCWD, root);
+  if (directory < 0) {
+    Die(errno, "%s", root);
+  }
+  for (size_t i = 0; i < depth; i++) {
+    CreateFile(directory, "f");
+    if (mkdirat(directory, "d", 0755)) {
+      Die(errno, "mkdirat d at level %zu", i);
+    }
+    const int child = OpenDirectory(directory, "d");
+    if (child < 0) {
+      Die(errno, "openat d at level %zu", i);
+    }
+    close(directory);
+    directory = child;
+  }
+  CreateFile(directory, "leaf");
+  close(directory);
+}
+
+// Removes the tree in `root` from the bottom up, climbing by "..", so that it
+// takes time in proportion to `depth` rather than its square.
+static void RemoveTree(const char* root, size_t depth) {
+  int directory = OpenDirectory(AT_FDCWD, root);
+  if (directory < 0) {
+    Die(errno, "%s", root);
+  }
+  for (size_t i = 0; i < depth; i++) {
+    const int child = OpenDirectory(directory, "d");
+    if (child < 0) {
+      Die(errno, "openat d at level %zu", i);
+    }
+    close(directory);
+    directory = child;
+  }
+  if (unlinkat(directory, "leaf", 0)) {
+    Die(errno, "unlinkat leaf");
+  }
+  for (size_t i = 0; i < depth; i++) {
+    const int parent = OpenDirectory(directory, "..");
+    if (parent < 0) {
+      Die(errno, "openat ..");
+    }
+    close(directory);
+    directory = parent;
+    if (unlinkat(directory, "d", AT_REMOVEDIR) || unlinkat(directory, "f", 0)) {
+      Die(errno, "unlinkat at level %zu", depth - i - 1);
+    }
+  }
+  close(directory);
+  if (rmdir(root)) {
+    Die(errno, "%s", root);
+  }
+}
+
+// Runs `walk` on `root` with no more than `file_limit` open files, and sets
+// `*records` to the number of records it printed. Returns false if it did not
+// exit successfully.
+static bool RunWalk(char* walk,
+                    char* root,
+                    size_t budget,
+                    size_t file_limit,
+                    size_t* records) {
+  char b[32];
+  MustFormat(b, sizeof(b), "%zu", budget);
+  char* const arguments[] = {walk, "-f", b, root, NULL};
+  *records = 0;
+  return RunProgram(arguments, NULL, file_limit, CountRecords, records);
+}
+
+int main(int count, char** arguments) {
+  Arguments as = ParseCLI(&cli, count, arguments);
+  if (FindOptionValue(cli.options, 'h')->b || as.count) {
+    PrintHelpAndExit(&cli, as.count > 0, true);
+  }
+  const size_t depth = FindOptionValue(cli.options, 'd')->z;
+  const size_t budget = FindOptionValue(cli.options, 'f')->z;
+  const size_t file_limit = FindOptionValue(cli.options, 'n')->z;
+  char* walk = FindOptionValue(cli.options, 'w')->s;
+
+  char root[] = "/tmp/walk_test.XXXXXX";
+  if (!mkdtemp(root)) {
+    Die(errno, "mkdtemp");
+  }
+  BuildTree(root, depth);
+
+  const int64_t start = GetEpochNanoseconds();
+  size_t records;
+  const bool exited = RunWalk(walk, root, budget, file_limit, &records);
+  const int64_t elapsed = GetEpochNanoseconds() - start;
+  RemoveTree(root, depth);
+
+  if (!exited) {
+    MustPrintf(stderr, "FAILED: %s did not exit successfully\n", walk);
+    return EXIT_FAILURE;
+  }
+  // Each level has `d` and `f`, and the bottom has `leaf`.
+  const size_t expected = 2 * depth + 1;
+  if (records != expected) {
+    MustPrintf(stderr, "FAILED: expected %zu records, got %zu\n", expected,
+               records);
+    return EXIT_FAILURE;
+  }
+  MustPrintf(stdout, "%zu levels, %zu records, -f %zu, %zu files: %.3f s\n",
+             depth, records, budget, file_limit, (double)elapsed / 1e9);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,722 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/statfs.h>
+#if defined(FAN_REPORT_DFID_NAME)
+#define USE_FANOTIFY
+#endif
+#endif
+
+#include "utils.h"
+#include "watch.h"
+
+#ifdef __linux__
+
+// Room for a few hundred events at a time.
+#define EVENT_BUFFER_SIZE (64 * 1024)
+// More than the size of any event: for inotify, with a name of up to NAME_MAX
+// bytes; for fanotify, with a file handle too.
+#define MAX_EVENT_SIZE 4096
+// How long to wait for more events once some have come.
+#define SETTLE_MILLISECONDS 10
+
+#define INOTIFY_MASK                                                    \
+  (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_CLOSE_WRITE | IN_ATTRIB | \
+   IN_ONLYDIR | IN_EXCL_UNLINK)
+
+// The `Directory.parent` of a root.
+#define NO_PARENT (-1)
+
+// A directory watched by inotify, at the index of its watch descriptor.
+typedef struct Directory {
+  // The watch descriptor of its parent, or `NO_PARENT` if it is a root, in
+  // which case `name` is its whole pathname.
+  int parent;
+  // `NULL` if the slot is free.
+  char* name;
+} Directory;
+
+// A root of a tree watched by fanotify: its pathname as given, and as
+// /proc/self/fd reports it.
+typedef struct Root {
+  char* pathname;
+  char* real;
+  size_t length;
+} Root;
+
+// A filesystem marked by fanotify, and a directory open on it, for
+// `open_by_handle_at`.
+typedef struct Filesystem {
+  dev_t device;
+  fsid_t id;
+  int fd;
+} Filesystem;
+
+struct Watch {
+  int fd;
+  bool fanotify;
+  pthread_mutex_t lock;
+
+  // For inotify: `capacity` slots, of which `count` are in use, and room to
+  // trace a directory's ancestors.
+  size_t count;
+  size_t capacity;
+  Directory* directories;
+  size_t chain_capacity;
+  int* chain;
+  // Whether running out of watches has been reported.
+  bool full;
+
+  // For fanotify.
+  size_t root_count;
+  Root* roots;
+  size_t filesystem_count;
+  Filesystem* filesystems;
+
+  // Events read, of which those before `next` have been seen.
+  size_t used;
+  size_t next;
+  char* buffer;
+  // The directory of the last event.
+  Path path;
+};
+
+Watch* NewWatch(void) {
+  Watch* w = calloc(1, sizeof(Watch));
+  if (!w) {
+    Die(errno, "calloc");
+  }
+  w->buffer = malloc(EVENT_BUFFER_SIZE);
+  if (!w->buffer) {
+    Die(errno, "malloc");
+  }
+  pthread_mutex_init(&w->lock, NULL);
+#ifdef USE_FANOTIFY
+  // Watching whole filesystems needs CAP_SYS_ADMIN.
+  w->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_REPORT_DFID_NAME,
+                        O_RDONLY | O_CLOEXEC);
+  w->fanotify = w->fd >= 0;
+#else
+  w->fd = -1;
+#endif
+  if (w->fd < 0) {
+    w->fd = inotify_init1(IN_CLOEXEC);
+  }
+  if (w->fd < 0) {
+    const int e = errno;
+    FreeWatch(&w);
+    errno = e;
+  }
+  return w;
+}
+
+static void ProcPathname(char* result, size_t size, int fd) {
+  MustFormat(result, size, "/proc/self/fd/%d", fd);
+}
+
+// Records `name` as the directory watched by `wd`, under `parent`.
+static void AddDirectory(Watch* w, int wd, int parent, const char* name) {
+  const size_t i = (size_t)wd;
+  if (i >= w->capacity) {
+    size_t capacity = w->capacity ? w->capacity : 1024;
+    while (capacity <= i) {
+      capacity *= 2;
+    }
+    Directory* directories =
+        realloc(w->directories, capacity * sizeof(Directory));
+    if (!directories) {
+      Die(errno, "realloc");
+    }
+    memset(&directories[w->capacity], 0,
+           (capacity - w->capacity) * sizeof(Directory));
+    w->directories = directories;
+    w->capacity = capacity;
+  }
+  Directory* d = &w->directories[i];
+  if (d->name) {
+    // Watched already, and now perhaps renamed.
+    free(d->name);
+  } else {
+    w->count++;
+  }
+  d->parent = parent;
+  d->name = strdup(name);
+  if (!d->name) {
+    Die(errno, "strdup");
+  }
+}
+
+static Directory* FindDirectory(Watch* w, int wd) {
+  const size_t i = (size_t)wd;
+  return wd >= 0 && i < w->capacity && w->directories[i].name
+             ? &w->directories[i]
+             : NULL;
+}
+
+static void ForgetDirectory(Watch* w, int wd) {
+  Directory* d = FindDirectory(w, wd);
+  if (d) {
+    free(d->name);
+    d->name = NULL;
+    w->count--;
+  }
+}
+
+static void RemoveDirectory(Watch* w, int wd) {
+  inotify_rm_watch(w->fd, wd);
+  ForgetDirectory(w, wd);
+}
+
+static void WatchWithInotify(Watch* w,
+                             int directory,
+                             const char* pathname,
+                             bool root) {
+  char proc[64];
+  ProcPathname(proc, sizeof(proc), directory);
+  const int wd = inotify_add_watch(w->fd, proc, INOTIFY_MASK);
+  if (wd < 0 && errno == ENOSPC) {
+    if (!w->full) {
+      Warn(ENOSPC,
+           "%s: cannot watch more directories (see "
+           "/proc/sys/fs/inotify/max_user_watches)",
+           pathname);
+      w->full = true;
+    }
+    return;
+  } else if (wd < 0) {
+    Warn(errno, "%s", pathname);
+    return;
+  }
+  if (root) {
+    AddDirectory(w, wd, NO_PARENT, pathname);
+    return;
+  }
+
+  // The parent is usually watched already, so this only finds its watch
+  // descriptor. If it is not (say, after ENOSPC), this watches it anew, and
+  // that watch must not outlive the child's. (IN_MASK_CREATE would fail in the
+  // usual case, so it cannot find the descriptor.)
+  MustFormat(proc, sizeof(proc), "/proc/self/fd/%d/..", directory);
+  const int parent = inotify_add_watch(w->fd, proc, INOTIFY_MASK);
+  if (parent < 0 || !FindDirectory(w, parent)) {
+    if (parent >= 0) {
+      inotify_rm_watch(w->fd, parent);
+    }
+    RemoveDirectory(w, wd);
+    return;
+  }
+  const char* slash = strrchr(pathname, '/');
+  AddDirectory(w, wd, parent, slash ? slash + 1 : pathname);
+}
+
+// Sets `w->path` to the pathname of the directory watched by `wd`, and
+// `*root` to the length of its root's. Returns false if it, or any of its
+// ancestors, is no longer watched.
+static bool GetDirectoryPath(Watch* w, int wd, size_t* root) {
+  size_t count = 0;
+  for (int i = wd; i != NO_PARENT; count++) {
+    const Directory* d = FindDirectory(w, i);
+    if (!d) {
+      return false;
+    }
+    if (count == w->chain_capacity) {
+      w->chain_capacity = w->chain_capacity ? 2 * w->chain_capacity : 64;
+      int* chain = realloc(w->chain, w->chain_capacity * sizeof(int));
+      if (!chain) {
+        Die(errno, "realloc");
+      }
+      w->chain = chain;
+    }
+    w->chain[count] = i;
+    i = d->parent;
+  }
+  SetPath(&w->path, w->directories[w->chain[count - 1]].name);
+  *root = w->path.count;
+  for (size_t i = count - 1; i > 0; i--) {
+    const char* name = w->directories[w->chain[i - 1]].name;
+    AppendPath(&w->path, name, strlen(name));
+  }
+  return true;
+}
+
+// Stops watching the directory `name` in the one watched by `parent`, which it
+// has been renamed out of. If it was renamed within the tree, walking it again
+// watches it again; its subdirectories are still watched, and are reattached
+// to it then. Otherwise, they are removed as their events arrive.
+static void DetachDirectory(Watch* w, int parent, const char* name) {
+  for (size_t i = 0; i < w->capacity; i++) {
+    const Directory* d = &w->directories[i];
+    if (d->name && d->parent == parent && StringEquals(d->name, name)) {
+      RemoveDirectory(w, (int)i);
+      return;
+    }
+  }
+}
+
+static unsigned GetInotifyChanges(uint32_t mask) {
+  return (mask & IN_CREATE ? WatchCreated : 0) |
+         (mask & IN_MOVED_TO ? WatchMovedIn : 0) |
+         (mask & (IN_CLOSE_WRITE | IN_ATTRIB) ? WatchModified : 0);
+}
+
+static const struct inotify_event* GetInotifyEvent(const Watch* w,
+                                                   size_t offset) {
+  return (const struct inotify_event*)(void*)&w->buffer[offset];
+}
+
+static bool NextInotifyEvent(Watch* w, WatchEvent* e) {
+  while (w->next < w->used) {
+    const struct inotify_event* event = GetInotifyEvent(w, w->next);
+    w->next += sizeof(struct inotify_event) + event->len;
+    if (event->mask & IN_Q_OVERFLOW) {
+      Warn(0, "too many changes at once; some were not printed\n");
+      continue;
+    } else if (event->mask & IN_IGNORED) {
+      ForgetDirectory(w, event->wd);
+      continue;
+    } else if (!event->len) {
+      // A change to the directory itself, which its parent reports too.
+      continue;
+    } else if (event->mask & IN_MOVED_FROM) {
+      if (event->mask & IN_ISDIR) {
+        DetachDirectory(w, event->wd, event->name);
+      }
+      continue;
+    }
+
+    unsigned changes = GetInotifyChanges(event->mask);
+    while (w->next < w->used) {
+      const struct inotify_event* next = GetInotifyEvent(w, w->next);
+      if (next->wd != event->wd || !next->len ||
+          (next->mask & (IN_MOVED_FROM | IN_IGNORED | IN_Q_OVERFLOW)) ||
+          !StringEquals(next->name, event->name)) {
+        break;
+      }
+      changes |= GetInotifyChanges(next->mask);
+      w->next += sizeof(struct inotify_event) + next->len;
+    }
+
+    size_t root;
+    if (!GetDirectoryPath(w, event->wd, &root)) {
+      // Under a directory that was renamed out of the tree.
+      RemoveDirectory(w, event->wd);
+      continue;
+    }
+    *e = (WatchEvent){.directory = w->path.values,
+                      .name = event->name,
+                      .length = strlen(event->name),
+                      .root = root,
+                      .changes = changes,
+                      .walk = changes & (WatchCreated | WatchMovedIn)};
+    return true;
+  }
+  return false;
+}
+
+#ifdef USE_FANOTIFY
+#define FANOTIFY_MASK \
+  (FAN_CREATE | FAN_MOVED_TO | FAN_CLOSE_WRITE | FAN_ATTRIB | FAN_ONDIR)
+
+// Marks the filesystem of the directory open as `directory`, whose status is
+// `status`, unless it is already. Returns false and sets `errno` if it cannot
+// be watched, including if its directories cannot be found by their handles.
+static bool MarkFilesystem(Watch* w, int directory, const struct stat* status) {
+  for (size_t i = 0; i < w->filesystem_count; i++) {
+    if (w->filesystems[i].device == status->st_dev) {
+      return w->filesystems[i].fd >= 0;
+    }
+  }
+  Filesystem* filesystems = realloc(
+      w->filesystems, (w->filesystem_count + 1) * sizeof(Filesystem));
+  if (!filesystems) {
+    Die(errno, "realloc");
+  }
+  w->filesystems = filesystems;
+  Filesystem* f = &w->filesystems[w->filesystem_count];
+  w->filesystem_count++;
+  *f = (Filesystem){.device = status->st_dev, .fd = -1};
+
+  struct statfs s;
+  if (fstatfs(directory, &s)) {
+    return false;
+  }
+  f->id = s.f_fsid;
+  alignas(struct file_handle) char buffer[sizeof(struct file_handle) +
+                                          MAX_HANDLE_SZ];
+  struct file_handle* handle = (struct file_handle*)(void*)buffer;
+  handle->handle_bytes = MAX_HANDLE_SZ;
+  int mount;
+  if (name_to_handle_at(directory, "", handle, &mount, AT_EMPTY_PATH)) {
+    return false;
+  }
+  const int probe = open_by_handle_at(directory, handle, O_PATH | O_CLOEXEC);
+  if (probe < 0) {
+    return false;
+  }
+  close(probe);
+  if (fanotify_mark(w->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK,
+                    directory, NULL)) {
+    return false;
+  }
+  f->fd = fcntl(directory, F_DUPFD_CLOEXEC, 0);
+  if (f->fd < 0) {
+    Die(errno, "fcntl");
+  }
+  return true;
+}
+
+static void WatchWithFanotify(Watch* w,
+                              int directory,
+                              const char* pathname,
+                              bool root) {
+  struct stat status;
+  if (fstat(directory, &status)) {
+    Warn(errno, "%s", pathname);
+    return;
+  }
+  if (!MarkFilesystem(w, directory, &status)) {
+    Warn(errno, "%s: cannot watch", pathname);
+  }
+  if (!root) {
+    return;
+  }
+  char proc[64];
+  ProcPathname(proc, sizeof(proc), directory);
+  char real[PATH_MAX];
+  const ssize_t length = readlink(proc, real, sizeof(real) - 1);
+  if (length < 0) {
+    Warn(errno, "%s", pathname);
+    return;
+  }
+  real[length] = '\0';
+  Root* roots = realloc(w->roots, (w->root_count + 1) * sizeof(Root));
+  if (!roots) {
+    Die(errno, "realloc");
+  }
+  w->roots = roots;
+  Root* r = &w->roots[w->root_count];
+  w->root_count++;
+  *r = (Root){.pathname = strdup(pathname),
+              .real = strdup(real),
+              .length = (size_t)length};
+  if (!r->pathname || !r->real) {
+    Die(errno, "strdup");
+  }
+}
+
+// Returns the record naming the entry that `m`, the event at `start`, is
+// about, or `NULL`.
+static const struct fanotify_event_info_fid* FindName(
+    const char* start,
+    const struct fanotify_event_metadata* m) {
+  for (size_t i = m->metadata_len; i < m->event_len;) {
+    const struct fanotify_event_info_fid* f =
+        (const struct fanotify_event_info_fid*)(const void*)&start[i];
+    if (f->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+      return f;
+    }
+    i += f->hdr.len;
+  }
+  return NULL;
+}
+
+static const struct file_handle* GetHandle(
+    const struct fanotify_event_info_fid* f) {
+  return (const struct file_handle*)(const void*)f->handle;
+}
+
+static const char* GetName(const struct fanotify_event_info_fid* f) {
+  const struct file_handle* h = GetHandle(f);
+  return (const char*)h->f_handle + h->handle_bytes;
+}
+
+static bool IsSameEntry(const struct fanotify_event_info_fid* a,
+                        const struct fanotify_event_info_fid* b) {
+  const struct file_handle* x = GetHandle(a);
+  const struct file_handle* y = GetHandle(b);
+  return !memcmp(&a->fsid, &b->fsid, sizeof(a->fsid)) &&
+         x->handle_bytes == y->handle_bytes &&
+         x->handle_type == y->handle_type &&
+         !memcmp(x->f_handle, y->f_handle, x->handle_bytes) &&
+         StringEquals(GetName(a), GetName(b));
+}
+
+// Sets `w->path` to the pathname, under one of the roots, of the directory
+// whose handle is in `f`, and `*root` to the length of the root's. Returns
+// false if it is under none of them, or is gone.
+static bool FindDirectoryByHandle(Watch* w,
+                                  const struct fanotify_event_info_fid* f,
+                                  size_t* root) {
+  int mount = -1;
+  for (size_t i = 0; i < w->filesystem_count; i++) {
+    if (!memcmp(&w->filesystems[i].id, &f->fsid, sizeof(f->fsid))) {
+      mount = w->filesystems[i].fd;
+      break;
+    }
+  }
+  if (mount < 0) {
+    return false;
+  }
+  const int directory = open_by_handle_at(
+      mount, (struct file_handle*)(uintptr_t)GetHandle(f), O_PATH | O_CLOEXEC);
+  if (directory < 0) {
+    return false;
+  }
+  char proc[64];
+  ProcPathname(proc, sizeof(proc), directory);
+  char real[PATH_MAX];
+  const ssize_t length = readlink(proc, real, sizeof(real) - 1);
+  close(directory);
+  if (length < 0) {
+    return false;
+  }
+  real[length] = '\0';
+
+  for (size_t i = 0; i < w->root_count; i++) {
+    const Root* r = &w->roots[i];
+    if (strncmp(real, r->real, r->length)) {
+      continue;
+    }
+    // The part under the root, without its leading '/'.
+    const char* rest = &real[r->length];
+    if (*rest == '/') {
+      rest++;
+    } else if (*rest && r->length > 1) {
+      continue;
+    }
+    SetPath(&w->path, r->pathname);
+    *root = w->path.count;
+    if (*rest) {
+      AppendPath(&w->path, rest, strlen(rest));
+    }
+    return true;
+  }
+  return false;
+}
+
+static unsigned GetFanotifyChanges(uint64_t mask) {
+  return (mask & FAN_CREATE ? WatchCreated : 0) |
+         (mask & FAN_MOVED_TO ? WatchMovedIn : 0) |
+         (mask & (FAN_CLOSE_WRITE | FAN_ATTRIB) ? WatchModified : 0);
+}
+
+// Copies the event at `offset` to `*m`. Events are aligned only to 4 bytes, so
+// it cannot be used where it is.
+static void GetFanotifyEvent(const Watch* w,
+                             size_t offset,
+                             struct fanotify_event_metadata* m) {
+  memcpy(m, &w->buffer[offset], sizeof(*m));
+}
+
+static bool NextFanotifyEvent(Watch* w, WatchEvent* e) {
+  while (w->next < w->used) {
+    const char* start = &w->buffer[w->next];
+    struct fanotify_event_metadata m;
+    GetFanotifyEvent(w, w->next, &m);
+    w->next += m.event_len;
+    if (m.vers != FANOTIFY_METADATA_VERSION) {
+      Die(0, "unexpected fanotify version %u\n", m.vers);
+    } else if (m.mask & FAN_Q_OVERFLOW) {
+      Warn(0, "too many changes at once; some were not printed\n");
+      continue;
+    }
+    const struct fanotify_event_info_fid* f = FindName(start, &m);
+    if (!f || StringEquals(GetName(f), ".")) {
+      continue;
+    }
+
+    unsigned changes = GetFanotifyChanges(m.mask);
+    while (w->next < w->used) {
+      struct fanotify_event_metadata next;
+      GetFanotifyEvent(w, w->next, &next);
+      const struct fanotify_event_info_fid* g =
+          FindName(&w->buffer[w->next], &next);
+      if (!g || !IsSameEntry(f, g)) {
+        break;
+      }
+      changes |= GetFanotifyChanges(next.mask);
+      w->next += next.event_len;
+    }
+
+    size_t root;
+    if (!FindDirectoryByHandle(w, f, &root)) {
+      continue;
+    }
+    const char* name = GetName(f);
+    *e = (WatchEvent){.directory = w->path.values,
+                      .name = name,
+                      .length = strlen(name),
+                      .root = root,
+                      .changes = changes,
+                      // Whatever happens in a new directory is reported, since
+                      // the whole filesystem is watched.
+                      .walk = changes & WatchMovedIn};
+    return true;
+  }
+  return false;
+}
+#endif
+
+void WatchDirectory(Watch* w,
+                    int directory,
+                    const char* pathname,
+                    bool root) {
+  pthread_mutex_lock(&w->lock);
+#ifdef USE_FANOTIFY
+  if (w->fanotify && root && !w->filesystem_count) {
+    struct stat status;
+    if (!fstat(directory, &status) && !MarkFilesystem(w, directory, &status)) {
+      // Where fanotify cannot watch the first tree, fall back to inotify.
+      close(w->fd);
+      if (w->filesystems[0].fd >= 0) {
+        close(w->filesystems[0].fd);
+      }
+      w->filesystem_count = 0;
+      w->fanotify = false;
+      w->fd = inotify_init1(IN_CLOEXEC);
+      if (w->fd < 0) {
+        Die(errno, "inotify_init1");
+      }
+    }
+  }
+  if (w->fanotify) {
+    WatchWithFanotify(w, directory, pathname, root);
+    pthread_mutex_unlock(&w->lock);
+    return;
+  }
+#endif
+  WatchWithInotify(w, directory, pathname, root);
+  pthread_mutex_unlock(&w->lock);
+}
+
+// Reads events into `w->buffer` after the first `w->used` bytes, waiting up to
+// `timeout` milliseconds (or forever, if negative) for them. Returns false if
+// none came.
+static bool ReadEvents(Watch* w, int timeout) {
+  struct pollfd p = {.fd = w->fd, .events = POLLIN};
+  while (true) {
+    const int ready = poll(&p, 1, timeout);
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    } else if (ready < 0) {
+      Die(errno, "poll");
+    } else if (ready == 0) {
+      return false;
+    }
+    const ssize_t count =
+        read(w->fd, &w->buffer[w->used], EVENT_BUFFER_SIZE - w->used);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    } else if (count < 0) {
+      Die(errno, "reading events");
+    }
+    w->used += (size_t)count;
+    return true;
+  }
+}
+
+bool ReadWatch(Watch* w) {
+  if (!w->fanotify && !w->count) {
+    return false;
+  }
+  w->used = 0;
+  w->next = 0;
+  ReadEvents(w, -1);
+  // Wait briefly for the events that usually follow (as a write follows a
+  // create), so that those for the same entry can be merged.
+  while (EVENT_BUFFER_SIZE - w->used >= MAX_EVENT_SIZE &&
+         ReadEvents(w, SETTLE_MILLISECONDS)) {
+  }
+  return true;
+}
+
+bool NextWatchEvent(Watch* w, WatchEvent* e) {
+#ifdef USE_FANOTIFY
+  if (w->fanotify) {
+    return NextFanotifyEvent(w, e);
+  }
+#endif
+  return NextInotifyEvent(w, e);
+}
+
+void FreeWatch(Watch** w) {
+  Watch* x = *w;
+  if (!x) {
+    return;
+  }
+  if (x->fd >= 0) {
+    close(x->fd);
+  }
+  for (size_t i = 0; i < x->capacity; i++) {
+    free(x->directories[i].name);
+  }
+  free(x->directories);
+  free(x->chain);
+  for (size_t i = 0; i < x->root_count; i++) {
+    free(x->roots[i].pathname);
+    free(x->roots[i].real);
+  }
+  free(x->roots);
+  for (size_t i = 0; i < x->filesystem_count; i++) {
+    if (x->filesystems[i].fd >= 0) {
+      close(x->filesystems[i].fd);
+    }
+  }
+  free(x->filesystems);
+  free(x->buffer);
+  FreePath(&x->path);
+  pthread_mutex_destroy(&x->lock);
+  free(x);
+  *w = NULL;
+}
+
+#else
+
+Watch* NewWatch(void) {
+  errno = ENOTSUP;
+  return NULL;
+}
+
+void WatchDirectory(Watch* w,
+                    int directory,
+                    const char* pathname,
+                    bool root) {
+  (void)w;
+  (void)directory;
+  (void)pathname;
+  (void)root;
+}
+
+bool ReadWatch(Watch* w) {
+  (void)w;
+  return false;
+}
+
+bool NextWatchEvent(Watch* w, WatchEvent* e) {
+  (void)w;
+  (void)e;
+  return false;
+}
+
+void FreeWatch(Watch** w) {
+  (void)w;
+}
+
+#endif
@@ -0,0 +1,67 @@
+// Copyright 2024 Chris Palmer, https://noncombatant.org/
+// SPDX-License-Identifier: MIT
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Changes to the entries of directories, as they happen. Where permitted, a
+// `Watch` uses fanotify to watch whole filesystems, which costs nothing per
+// directory; events outside the watched trees are discarded. Otherwise, it uses
+// inotify, watching each directory given to `WatchDirectory`, and keeps a table
+// of them indexed by watch descriptor, each entry holding only its parent and
+// its name.
+//
+// Only Linux has either; elsewhere, `NewWatch` fails.
+typedef struct Watch Watch;
+
+typedef enum WatchChange {
+  // Created, as by open(2) with O_CREAT, mkdir(2), symlink(2), or link(2).
+  WatchCreated = 1 << 0,
+  // Renamed into the directory, from within the tree or outside it.
+  WatchMovedIn = 1 << 1,
+  // Closed after being written, or its status changed (as by chmod(2) or
+  // utimes(2)).
+  WatchModified = 1 << 2,
+} WatchChange;
+
+typedef struct WatchEvent {
+  // The directory, named as it was to `WatchDirectory` (or under a root that
+  // was), and the name of the entry that changed in it.
+  const char* directory;
+  const char* name;
+  size_t length;
+  // The length of the pathname of the root that `directory` is under.
+  size_t root;
+  // The `WatchChange`s, of all the consecutive events for the entry.
+  unsigned changes;
+  // For a directory created or moved in, whether what is in it may not have
+  // been reported, so that it must be walked.
+  bool walk;
+} WatchEvent;
+
+// Returns a new `Watch`, watching nothing yet, or `NULL` and sets `errno`.
+Watch* NewWatch(void);
+
+// Watches the directory open as `directory`, named by `pathname`, for changes
+// to its entries. `root` if it is the root of a tree, and otherwise, its parent
+// must already be watched. May be called from several threads.
+void WatchDirectory(Watch* w,
+                    int directory,
+                    const char* pathname,
+                    bool root);
+
+// Waits for events. Returns false if there is nothing left to watch (as when
+// the trees have been deleted).
+bool ReadWatch(Watch* w);
+
+// Sets `*e` to the next event read by `ReadWatch`, which is valid until the
+// next call. Returns false if there are no more.
+bool NextWatchEvent(Watch* w, WatchEvent* e);
+
+// Destroys `*w`. See `AUTO`.
+void FreeWatch(Watch** w);
+
+#endif